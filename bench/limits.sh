@@ -0,0 +1,38 @@
+#!/usr/bin/env bash
+# Cost of the fuel and deadline checks at back-edges and calls. Runs
+# bench/hot.mx and bench/fib.mx without limits and with both (limits that
+# are never reached), interleaved, and prints the min CPU time (user + sys)
+# of each. A baseline mavix, e.g. one built without the safepoint, is
+# measured the same way.
+#
+# Usage: bench/limits.sh <mavix> [<baseline mavix>] [runs, default 31]
+
+mavix=${1:?usage: $0 <mavix> [<baseline mavix>] [runs]}
+baseline=$2
+runs=${3:-31}
+bench=$(dirname "$0")
+limits="--fuel=100000000000 --timeout=100000"
+
+# cpu <command...>: the CPU seconds the command took
+cpu() {
+    local TIMEFORMAT='%U %S'
+    { time "$@" > /dev/null 2>&1; } 2>&1 | awk '{ print $1 + $2 }'
+}
+
+# min <seconds...>
+min() {
+    printf '%s\n' "$@" | sort -g | head -n 1
+}
+
+for script in "$bench/hot.mx" "$bench/fib.mx"; do
+    base=() plain=() limited=()
+    for ((run = 0; run < runs; run++)); do
+        if [ -n "$baseline" ]; then base+=("$(cpu "$baseline" "$script")"); fi
+        plain+=("$(cpu "$mavix" "$script")")
+        limited+=("$(cpu "$mavix" $limits "$script")")
+    done
+
+    line="$(basename "$script"):"
+    if [ -n "$baseline" ]; then line="$line baseline $(min "${base[@]}")s,"; fi
+    echo "$line no limits $(min "${plain[@]}")s, both limits $(min "${limited[@]}")s"
+done
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "number.h"
+
+/* @note
+ * Checks parseDouble() against strtod() bit for bit on random literals and
+ * on edge cases, then times both on 1M literals of 17 significant digits
+ * (what "%.17g" prints) and on 1M short ones ("%.3f").
+ *
+ * Build and run: cmake --build <dir> --target bench_parse_double
+ *                <dir>/bench_parse_double [literals to check]
+ * */
+
+#define TIMED 1000000
+#define LITERAL_MAX 400
+
+// A random literal: up to 25 integer digits, sometimes a run of zeros
+// after the point and up to 40 fraction digits
+static int randomLiteral(char* buffer, int i) {
+    int length = 0;
+    int integerDigits = 1 + rand() % (i % 3 == 0 ? 25 : 10);
+    int fractionDigits = rand() % (i % 5 == 0 ? 40 : 18);
+
+    if (i % 7 == 0) {
+        buffer[length++] = '0';
+    } else {
+        for (int d = 0; d < integerDigits; d++) {
+            buffer[length++] = (char)('0' + (d == 0 ? 1 + rand() % 9 : rand() % 10));
+        }
+    }
+    if (fractionDigits > 0) {
+        buffer[length++] = '.';
+        int zeros = i % 11 == 0 ? rand() % 330 : 0;
+        for (int d = 0; d < zeros; d++) buffer[length++] = '0';
+        for (int d = 0; d < fractionDigits; d++) buffer[length++] = (char)('0' + rand() % 10);
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+// Returns whether both conversions agree, printing the literal if not
+static bool check(const char* literal, int length) {
+    double parsed = parseDouble(literal, length);
+    double expected = strtod(literal, NULL);
+    if (memcmp(&parsed, &expected, sizeof(double)) == 0) return true;
+    printf("mismatch: %s: %.17g, strtod %.17g\n", literal, parsed, expected);
+    return false;
+}
+
+static double seconds(clock_t start) {
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+// Times both conversions on literals printed with 'format'
+static void timeBoth(const char* format) {
+    char (*literals)[32] = malloc(TIMED * sizeof(*literals));
+    int* lengths = malloc(TIMED * sizeof(int));
+    for (int i = 0; i < TIMED; i++) {
+        lengths[i] = snprintf(literals[i], sizeof(literals[i]), format,
+                              (double)rand() / RAND_MAX * 1000);
+    }
+
+    // The sums keep the conversions from being optimized away
+    double sum = 0;
+    clock_t start = clock();
+    for (int i = 0; i < TIMED; i++) sum += parseDouble(literals[i], lengths[i]);
+    double parseTime = seconds(start);
+
+    start = clock();
+    for (int i = 0; i < TIMED; i++) sum += strtod(literals[i], NULL);
+    double strtodTime = seconds(start);
+
+    printf("%-6s parseDouble %.3fs  strtod %.3fs  (%g)\n",
+           format, parseTime, strtodTime, sum);
+    free(literals);
+    free(lengths);
+}
+
+int main(int argc, const char* argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : 3000000;
+    static const char* edges[] = {
+        "0", "0.0", "0.1", "2.2250738585072011", "3.1415926535897931",
+        "9007199254740993", "9007199254740992.5",
+        "123456789012345678901234567890.5",
+        "0.000000000000000000000000000000000000000000000000000000000000000000000000000000"
+        "00000000000000000000000000000000000000000000000000000000000000000000000000000000"
+        "00000000000000000000000000000000000000000000000000000000000000000000000000000000"
+        "00000000000000000000000000000000000000000000000000000000000000000000000000000000"
+        "0049406564584124654",
+        NULL,
+    };
+
+    srand(7);
+    long mismatches = 0;
+    char buffer[LITERAL_MAX];
+    for (long i = 0; i < count; i++) {
+        int length = randomLiteral(buffer, (int)i);
+        if (!check(buffer, length)) mismatches++;
+    }
+    for (int i = 0; edges[i] != NULL; i++) {
+        if (!check(edges[i], (int)strlen(edges[i]))) mismatches++;
+    }
+    printf("%ld random literals and the edge cases: %ld mismatches\n", count, mismatches);
+
+    timeBoth("%.17g");
+    timeBoth("%.3f");
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,27 @@
+#!/usr/bin/env bash
+# Tail calls reuse the caller's frame: a tail-recursive count keeps the same
+# max RSS from 1000 to 10M calls deep, where a normal call chain overflows
+# at FRAMES_MAX. Prints the time and the max RSS of each depth; the RSS
+# needs GNU time (/usr/bin/time).
+#
+# Usage: bench/tail_calls.sh <mavix>
+
+mavix=${1:?usage: $0 <mavix>}
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+for depth in 1000 10000000; do
+    cat > "$work/count.mx" <<SCRIPT
+fun count(n, acc) {
+    if (n == 0) return acc;
+    return count(n - 1, acc + 1);
+}
+print count($depth, 0);
+SCRIPT
+    if [ -x /usr/bin/time ]; then
+        /usr/bin/time -f "count($depth): %es, %MKB max RSS" "$mavix" "$work/count.mx" > /dev/null
+    else
+        TIMEFORMAT="count($depth): %Rs (no GNU time for the max RSS)"
+        time "$mavix" "$work/count.mx" > /dev/null
+    fi
+done
@@ -0,0 +1,35 @@
+#ifndef mavix_batch_h
+#define mavix_batch_h
+
+#include "chunk.h"
+#include "vm.h"
+
+// Number of rows each vectorized instruction processes at once
+#define BATCH_LANES 1024
+
+/**
+ * @brief Evaluates a compiled chunk once per row of the input columns.
+ *
+ * Every instruction is executed over a whole batch of rows at a time, using
+ * SIMD kernels for arithmetic and comparisons. Batches that the vectorized
+ * path cannot handle (e.g. a type error) are re-run row by row on the scalar
+ * VM, so the results are always identical to scalar execution, bit for bit
+ * (tests/batch/differential.c checks it). The exception is an operation on
+ * two NaNs: which one comes out is up to the C compiler on either path.
+ *
+ * Only embedders reach batch mode: the mavix binary has no option for it.
+ *
+ * @param chunk A chunk compiled with compileColumns().
+ * @param columns One array of rowCount doubles per column.
+ * @param rowCount Number of rows to evaluate.
+ * @param results Receives one value per row.
+ */
+InterpretResult runBatch(Chunk* chunk, const double* const* columns,
+                         size_t rowCount, Value* results);
+
+// Compiles an expression over the named columns and evaluates it for every row.
+InterpretResult interpretBatch(const char* source, const char* const* names,
+                               int columnCount, const double* const* columns,
+                               size_t rowCount, Value* results);
+
+#endif  // mavix_batch_h
@@ -0,0 +1,92 @@
+#ifndef mavix_cache_h
+#define mavix_cache_h
+
+#include <stdatomic.h>
+
+#include "chunk.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MAVIX_CACHE_LOCKS
+#include <pthread.h>
+#endif
+
+// Default memory budget of a chunk cache
+#define CHUNK_CACHE_BUDGET (16 * 1024 * 1024)
+
+
+typedef struct CacheEntry {
+    uint64_t hash;
+    char* source;           // private copy, compared in full on every hit
+    size_t length;
+    Chunk chunk;
+    size_t size;            // bytes charged against the budget
+
+    uint64_t lastUsed;      // value of the cache's clock at the last hit
+    int refs;               // one for the table, plus one per acquireChunk()
+
+    struct CacheEntry* next;    // next entry in the same bucket
+} CacheEntry;
+
+
+/**
+ * @brief Compiled chunks, keyed by the hash of their source text.
+ *
+ * Misses compile the source and insert it, evicting the least recently used
+ * entries while the cache is over its memory budget. Entries that are still
+ * in use when evicted are freed once the last user releases them.
+ *
+ * Only the thread running the VM may acquire and release chunks: compiling
+ * allocates in the VM's heap and may collect, and running a chunk changes
+ * it (see acquireChunk()). Any thread may read the statistics.
+ */
+typedef struct {
+    CacheEntry** buckets;
+    int bucketCount;
+    int count;
+
+    size_t bytes;           // total size of the entries in the table
+    size_t budget;
+
+    uint64_t clock;         // ticks on every lookup, for LRU order
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t evictions;
+
+#ifdef MAVIX_CACHE_LOCKS
+    pthread_rwlock_t lock;  // guards 'count' and 'bytes' against chunkCacheStats()
+#endif
+} ChunkCache;
+
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    int count;
+    size_t bytes;
+} ChunkCacheStats;
+
+
+void initChunkCache(ChunkCache* cache, size_t budget);
+void freeChunkCache(ChunkCache* cache);
+
+/**
+ * @brief Returns the compiled chunk for a source, compiling it on a miss.
+ *
+ * The entry stays valid until it is handed back with releaseChunk(), even
+ * if it is evicted in between. Every run of the chunk shares it with the
+ * others: the quickened instructions and the JIT's machine code carry over,
+ * the loop counters are the caller's to reset.
+ *
+ * @return The entry holding the chunk, or NULL if the source does not compile.
+ */
+CacheEntry* acquireChunk(ChunkCache* cache, const char* source, size_t length);
+void releaseChunk(ChunkCache* cache, CacheEntry* entry);
+
+// Any thread may call it
+ChunkCacheStats chunkCacheStats(ChunkCache* cache);
+
+// wyhash (final version 4) of the bytes, with the default secret
+uint64_t hashBytes(const char* bytes, size_t length);
+
+#endif  // mavix_cache_h
@@ -18,16 +18,70 @@ typedef enum {
     OP_DIVIDE,
     OP_NOT,
     OP_NEGATE,
+    OP_GET_COLUMN,
+    OP_POP,
+    OP_JUMP,            // 16-bit forward offset, from the next instruction
+    OP_JUMP_IF_FALSE,   // jumps if the top is falsey, leaving it on the stack
+    OP_JUMP_IF_TRUE,    // jumps if the top is truthy, leaving it on the stack
+    OP_LOOP,            // 16-bit backward offset, then the loop's profile index
+    OP_PRINT,
+    OP_DEFINE_GLOBAL,
+    OP_GET_GLOBAL,
+    OP_SET_GLOBAL,
+    OP_GET_LOCAL,
+    OP_SET_LOCAL,
+    OP_CALL,
+    OP_TAIL_CALL,
+    OP_CALL_NATIVE,     // native index, then the argument count
     OP_RETURN,
+
+    // Specialized (quickened) forms, rewritten in place by the VM once the
+    // generic instruction has seen two doubles (*_NUM) or two ints (*_INT).
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_INT,
+    OP_LESS_INT,
+    OP_ADD_INT,
+    OP_SUBTRACT_INT,
+    OP_MULTIPLY_INT,
+
+    // Unchecked forms, emitted by the compiler when it has proven the operand
+    // types statically. They perform no tag checks at all.
+    OP_GREATER_UNCHECKED,
+    OP_LESS_UNCHECKED,
+    OP_ADD_UNCHECKED,
+    OP_SUBTRACT_UNCHECKED,
+    OP_MULTIPLY_UNCHECKED,
+    OP_DIVIDE_UNCHECKED,
+    OP_NEGATE_UNCHECKED,
 } OpCode;
 
 
+// Hotness profile of one loop, counted on its back-edge (OP_LOOP)
+typedef struct {
+    int header;         // offset of the loop's first instruction
+    int line;           // source line of the loop
+    uint64_t iterations;    // back-edges taken so far
+} LoopProfile;
+
+
 typedef struct {
     int count;          // Array element count
     int capacity;       // Number of allocated entried in use
     uint8_t* code;      // Pointer to the array of bytecode instructions
     int* lines;
     ValueArray constants;
+    int quickened;      // Number of instruction sites currently specialized
+
+    LoopProfile* loops; // indexed by the operand of OP_LOOP
+    int loopCount;
+    int loopCapacity;
+
+    struct JitCode* jit;    // machine code (--jit), made on the chunk's first run
 } Chunk;
 
 
@@ -35,5 +89,8 @@ void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int addLoop(Chunk* chunk, int header, int line);
+// Forgets what was added after the chunk had these counts, keeping the memory
+void truncateChunk(Chunk* chunk, int count, int constantCount, int loopCount);
 
 #endif
\ No newline at end of file
@@ -5,7 +5,12 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define UINT8_COUNT (UINT8_MAX + 1)
+
+// The tests build without the debug output (see CMakeLists.txt)
+#ifndef MAVIX_NO_DEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
 
 #endif
@@ -5,8 +5,20 @@
 #ifndef COMPILER_H
 #define COMPILER_H
 
+#include "scanner.h"
 #include "vm.h"
 
-bool compile(const char* source, Chunk* chunk);
+// Sources at least this large are tokenized in one pass before parsing
+#define PRETOKENIZE_THRESHOLD (64 * 1024)
+// ... and scanned on several threads from this size on
+#define PARALLEL_SCAN_THRESHOLD (4 * 1024 * 1024)
+
+bool compile(const char* source, size_t length, Chunk* chunk);
+bool compileColumns(const char* source, size_t length,
+                    const char* const* names, int count, Chunk* chunk);
+bool compileTokens(const TokenStream* tokens, Chunk* chunk);
+
+// Reports the functions and constants being compiled to the collector
+void markCompilerRoots();
 
 #endif //COMPILER_H
@@ -0,0 +1,32 @@
+#ifndef mavix_image_h
+#define mavix_image_h
+
+#include "common.h"
+
+/**
+ * @brief Saves the state a script left behind, to start other VMs from it.
+ *
+ * The image holds the main fiber's globals and every function they reach,
+ * with their chunks and constants, laid out for one address (IMAGE_BASE in
+ * image.c) and listing the pointers to adjust if it ends up elsewhere.
+ *
+ * @return false (after saying why) if the file could not be written.
+ */
+bool saveImage(const char* path);
+
+/**
+ * @brief Maps an image made by saveImage() and defines its globals.
+ *
+ * The VM must be fresh: no globals yet, and the same natives as the VM that
+ * saved the image. The functions stay in the mapping, which the collector
+ * leaves alone, and are only written to when they run (quickening, loop
+ * counters), page by page.
+ *
+ * @return false (after saying why) if the image cannot be used.
+ */
+bool loadImage(const char* path);
+
+// Unmaps the image; nothing may use its functions anymore (freeVM())
+void unloadImage();
+
+#endif  // mavix_image_h
@@ -0,0 +1,41 @@
+#ifndef mavix_jit_h
+#define mavix_jit_h
+
+#include "chunk.h"
+
+/*
+ * Machine code entry point for a chunk. It runs the chunk's instructions
+ * from 'start' directly on the VM stack and returns the bytecode offset at
+ * which the interpreter has to continue: an instruction the JIT leaves to
+ * it (calls, returns, natives), or one whose type check failed
+ * (deoptimization).
+ */
+typedef int (*JitEntry)(Value** stackTop, const Value* constants, Value* slots,
+                        const uint8_t* start);
+
+typedef struct JitCode {
+    JitEntry entry;
+    uint8_t* code;      // mmap'd executable buffer
+    size_t size;        // size of the mapping in bytes
+    uint32_t* starts;   // where each instruction's code starts, by bytecode offset
+    int count;          // bytecode offsets in 'starts'
+} JitCode;
+
+/*
+ * Translates the chunk into machine code, kept in chunk->jit until the chunk
+ * is freed or changes. 'name' is for perf. Returns false if the JIT is not
+ * available on this platform.
+ */
+bool jitCompile(Chunk* chunk, const char* name, int length);
+// Frees the chunk's machine code, if any
+void jitFree(Chunk* chunk);
+
+// Runs the chunk's machine code from the instruction at 'offset'; returns
+// where the interpreter continues
+static inline int jitRun(Chunk* chunk, int offset, Value** stackTop, Value* slots) {
+    JitCode* jit = chunk->jit;
+    return jit->entry(stackTop, chunk->constants.values, slots,
+                      jit->code + jit->starts[offset]);
+}
+
+#endif  // mavix_jit_h
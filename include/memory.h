@@ -1,7 +1,15 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
+#include "object.h"
+
+#define ALLOCATE(type, count) \
+    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+
+#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
 // Doubles capacity, or sets to 8 if starting from zero
 #define GROW_CAPACITY(capacity) \
@@ -18,8 +26,132 @@
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 
+// Bump-allocated space for new objects
+#ifndef NURSERY_SIZE
+#define NURSERY_SIZE (256 * 1024)
+#endif
+
+// Object bytes in the old generation before the first major collection
+#ifndef FIRST_MAJOR_GC
+#define FIRST_MAJOR_GC (1024 * 1024)
+#endif
+#define HEAP_GROW_FACTOR 2
+
+// Object bytes allocated between two slices of an incremental collection
+#define GC_SLICE_BYTES (16 * 1024)
+// Debt charged by each back-edge and call while a collection is under way,
+// so long-running code keeps the collection moving without allocating
+#define GC_SAFEPOINT_DEBT 16
+// Default upper bound of a single slice
+#define GC_PAUSE_TARGET_NS (500 * 1000)
+// Pause histogram buckets: [2^i, 2^(i+1)) microseconds, the last open-ended
+#define PAUSE_BUCKETS 16
+
+
+typedef struct {
+    uint64_t minorCollections;
+    uint64_t majorCollections;
+    uint64_t slices;        // bounded steps of incremental major collections
+    uint64_t lastPauseNs;
+    uint64_t maxPauseNs;
+    uint64_t totalPauseNs;
+    uint64_t pauses;
+    uint64_t pauseHistogram[PAUSE_BUCKETS];
+
+    size_t nurseryBytes;    // in use right now
+    size_t oldBytes;        // object bytes in the old generation
+    size_t promotedBytes;   // total moved out of the nursery
+    size_t freedBytes;      // total swept from the old generation
+} GcStats;
+
+
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,     // an incremental major collection is tracing
+    GC_SWEEPING,    // ... and then freeing what it did not reach
+} GcPhase;
+
+
+/*
+ * Objects are born in the nursery, a single block carved up by bumping a
+ * pointer. A minor collection moves the survivors into the old generation
+ * (individually allocated and linked through Obj.next) and empties the
+ * nursery at once; the old generation is collected by mark-sweep when it
+ * has doubled since the last major collection.
+ *
+ * In incremental mode the major collection is spread over slices of at most
+ * 'pauseTargetNs' each, interleaved with the program (tri-color marking:
+ * white objects are unmarked, gray ones are marked and on the gray stack,
+ * black ones are marked and scanned).
+ */
+typedef struct {
+    uint8_t* nursery;
+    uint8_t* nurseryTop;
+    uint8_t* nurseryEnd;
+
+    Obj* objects;           // the old generation
+    size_t nextMajor;
+
+    // Old objects that may point into the nursery (see writeBarrier())
+    Obj** remembered;
+    int rememberedCount;
+    int rememberedCapacity;
+
+    // Objects reached but not scanned yet, by the major collection
+    Obj** gray;
+    int grayCount;
+    int grayCapacity;
+
+    // Objects moved by a minor collection but not scanned yet
+    Obj** scan;
+    int scanCount;
+    int scanCapacity;
+
+    bool incremental;
+    uint64_t pauseTargetNs;
+    GcPhase phase;
+    size_t debt;            // object bytes allocated since the last slice
+    Obj** sweepLink;        // link to the next object to sweep
+    Obj* fresh;             // promoted while sweeping, joins 'objects' after
+
+    GcStats stats;
+} Heap;
+
+
 // Reallocates memory block to new size
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 
+void initHeap(Heap* heap);
+// Frees every object the VM allocated, and the nursery
+void freeHeap(Heap* heap);
+
+// New object of the given size; the only place a collection can start.
+Obj* allocateObject(size_t size, ObjType type);
+
+/**
+ * @brief Records that 'owner' now references 'value'.
+ *
+ * Must be called whenever a reference is stored into an object (roots like
+ * the stack and the globals need no barrier), so that a minor collection
+ * finds the nursery objects that old objects keep alive.
+ */
+void writeBarrier(Obj* owner, Value value);
+
+// Collects the nursery, and the old generation as well when 'major'
+// (finishing an incremental collection that is under way)
+void collectGarbage(bool major);
+
+// Runs one bounded slice of the incremental collection under way, if any
+void gcStep();
+// Charges 'ticks' back-edges and calls of the interpreter loop to the
+// collection under way
+void gcSafepoint(uint64_t ticks);
+
+// Reports a root to the running collection, which may move the object
+void markObject(Obj** slot);
+void markValue(Value* slot);
+void markChunk(Chunk* chunk);
+
+void printGcStats(FILE* file);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,120 @@
+#ifndef mavix_metrics_h
+#define mavix_metrics_h
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "cache.h"
+#include "common.h"
+
+// Plain counters (see writeMetrics() for their names)
+typedef enum {
+    METRIC_INSTRUCTIONS,        // only counted with COUNT_INSTRUCTIONS
+    METRIC_TICKS,               // back-edges and calls
+    METRIC_COMPILES,
+    METRIC_COMPILE_ERRORS,
+    METRIC_COMPILE_NS,
+    METRIC_ALLOCATED_BYTES,     // by reallocate()
+    METRIC_FREED_BYTES,
+    METRIC_COUNT
+} Metric;
+
+typedef enum {
+    ERROR_TYPE,                 // operands or operand of the wrong type
+    ERROR_UNDEFINED,            // undefined variable
+    ERROR_CALL,                 // not a function, or the wrong arity
+    ERROR_STACK_OVERFLOW,
+    ERROR_NATIVE,               // raised by a host function
+    ERROR_FUEL,
+    ERROR_DEADLINE,
+    ERROR_KIND_COUNT
+} ErrorKind;
+
+#define HISTOGRAM_BUCKETS 8     // the last one is +Inf
+
+typedef struct {
+    atomic_uint_fast64_t counts[HISTOGRAM_BUCKETS];     // not cumulative
+    atomic_uint_fast64_t sum;
+} Histogram;
+
+
+/*
+ * The counts of one thread. Only that thread writes them, so the hot paths
+ * take no lock and need no atomic read-modify-write; readers sum up every
+ * shard. A shard outlives its thread, or its counts would go backwards.
+ */
+typedef struct MetricShard {
+    atomic_uint_fast64_t counters[METRIC_COUNT];
+    atomic_uint_fast64_t errors[ERROR_KIND_COUNT];
+    Histogram chunkBytes;       // bytecode of each compiled function and script
+    Histogram chunkConstants;
+    struct MetricShard* next;
+} MetricShard;
+
+extern _Thread_local MetricShard* metricShard;
+
+// The calling thread's first shard
+MetricShard* registerShard();
+
+static inline MetricShard* currentShard() {
+    MetricShard* shard = metricShard;
+    return shard != NULL ? shard : registerShard();
+}
+
+static inline void addCount(atomic_uint_fast64_t* counter, uint64_t amount) {
+    uint64_t value = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, value + amount, memory_order_relaxed);
+}
+
+static inline void countMetric(Metric metric, uint64_t amount) {
+    addCount(&currentShard()->counters[metric], amount);
+}
+
+static inline void countRuntimeError(ErrorKind kind) {
+    addCount(&currentShard()->errors[kind], 1);
+}
+
+// Sizes of a chunk the compiler finished
+void observeChunk(int bytes, int constants);
+
+// CLOCK_MONOTONIC nanoseconds, for METRIC_COMPILE_NS
+uint64_t metricClock();
+
+// Sum over all threads
+uint64_t metricValue(Metric metric);
+uint64_t runtimeErrors(ErrorKind kind);
+
+/**
+ * @brief Adds the statistics of a chunk cache to the metrics.
+ *
+ * The cache must stay valid until the process exits, since the metrics may
+ * be written at exit.
+ */
+void exportChunkCache(ChunkCache* cache);
+
+/**
+ * @brief Writes every metric in the Prometheus text exposition format.
+ */
+void writeMetrics(FILE* file);
+
+/**
+ * @brief Replaces the file with the current metrics, atomically (through a
+ * temporary file and rename()), as node_exporter's textfile collector wants.
+ *
+ * @return false if the file could not be written.
+ */
+bool exportMetrics(const char* path);
+
+/**
+ * @brief Serves the metrics on a Unix socket from a thread of its own.
+ *
+ * Every connection gets the current metrics as an HTTP response, so that
+ * 'curl --unix-socket <path> http://localhost/metrics' works, and is closed.
+ *
+ * @return false if the socket could not be bound, or if one is served.
+ */
+bool serveMetrics(const char* path);
+// Closes and removes the socket
+void stopServingMetrics();
+
+#endif  // mavix_metrics_h
@@ -0,0 +1,52 @@
+#ifndef mavix_native_h
+#define mavix_native_h
+
+#include "common.h"
+#include "value.h"
+
+#define NATIVES_MAX UINT8_COUNT
+
+
+/*
+ * A function of the host, callable from scripts. 'args' points straight at
+ * the arguments on the VM stack (nothing is copied), and the arity was
+ * checked by the compiler already. Returns true with the result stored in
+ * *result, or false after reporting the failure with nativeError().
+ */
+typedef bool (*NativeFn)(int argCount, Value* args, Value* result);
+
+
+/*
+ * Host functions by name. The compiler binds a call of a native to its
+ * index once, like a global, so the table only ever grows.
+ */
+typedef struct {
+    const char* names[NATIVES_MAX];     // not copied: must outlive the VM
+    int lengths[NATIVES_MAX];
+    int arities[NATIVES_MAX];           // -1 for any number of arguments
+    NativeFn functions[NATIVES_MAX];
+    int count;
+} Natives;
+
+
+/**
+ * @brief Makes a host function callable from scripts compiled from now on.
+ *
+ * Defining a name again replaces the function (and its arity) in place, so
+ * chunks compiled before call the new one.
+ *
+ * @return The native's index, or -1 when the table is full.
+ */
+int defineNative(const char* name, int arity, NativeFn function);
+
+// Index of the native with this name, or -1
+int nativeSlot(const char* name, int length);
+
+// Reports why a native fails; the VM raises it as a runtime error
+void nativeError(const char* format, ...);
+const char* nativeErrorMessage();
+
+// clock(), sqrt(), abs(), floor(), min() and max()
+void defineCoreNatives();
+
+#endif  // mavix_native_h
@@ -0,0 +1,15 @@
+#ifndef mavix_number_h
+#define mavix_number_h
+
+#include "common.h"
+
+/**
+ * @brief Converts a number literal (digits with an optional '.' and fraction)
+ *        to the nearest double.
+ *
+ * Only the 'length' characters at 'start' are read, so the literal does not
+ * have to be NUL-terminated, and the result does not depend on the locale.
+ */
+double parseDouble(const char* start, int length);
+
+#endif  // mavix_number_h
@@ -0,0 +1,53 @@
+#ifndef mavix_object_h
+#define mavix_object_h
+
+#include "chunk.h"
+#include "common.h"
+#include "output.h"
+#include "value.h"
+
+#define OBJ_TYPE(value)     (AS_OBJ(value)->type)
+
+#define IS_FUNCTION(value)  isObjType(value, OBJ_FUNCTION)
+
+#define AS_FUNCTION(value)  ((ObjFunction*)AS_OBJ(value))
+
+
+typedef enum {
+    OBJ_FUNCTION,
+} ObjType;
+
+
+// Header shared by every heap object (see memory.h for the generations)
+struct Obj {
+    ObjType type;
+    bool isMarked;
+    bool isOld;         // promoted out of the nursery
+    bool isRemembered;  // in the remembered set of the next minor collection
+    struct Obj* next;   // next old object; for a moved one, its new address
+};
+
+
+/*
+ * A function compiled from a 'fun' declaration. The function owns its chunk;
+ * the top-level script is a bare Chunk and has no ObjFunction.
+ */
+typedef struct {
+    Obj obj;
+    int arity;
+    Chunk chunk;
+    char* name;         // copied from the source
+    int nameLength;
+} ObjFunction;
+
+
+ObjFunction* newFunction(const char* name, int length);
+
+void printObject(Value value);
+void writeObject(OutputSink* sink, Value value);
+
+static inline bool isObjType(Value value, ObjType type) {
+    return IS_OBJ(value) && AS_OBJ(value)->type == type;
+}
+
+#endif  // mavix_object_h
@@ -0,0 +1,45 @@
+#ifndef mavix_output_h
+#define mavix_output_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "value.h"
+
+// Size of the reusable buffer of a flushing sink
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Receives each block of buffered output when the sink is flushed
+typedef void (*OutputFn)(void* context, const char* bytes, size_t length);
+
+// Destination for the values a script produces
+typedef struct {
+    char* buffer;
+    size_t count;       // bytes currently buffered
+    size_t capacity;
+    OutputFn flush;     // NULL for a memory sink, which only ever grows
+    void* context;      // passed to 'flush'
+} OutputSink;
+
+void initOutputSink(OutputSink* sink, OutputFn flush, void* context);
+// Writes to a stdio stream, one fwrite() per full buffer
+void initFileSink(OutputSink* sink, FILE* file);
+// Keeps all output in sink->buffer (sink->count bytes) for the embedder
+void initMemorySink(OutputSink* sink);
+void freeOutputSink(OutputSink* sink);
+
+void writeOutput(OutputSink* sink, const char* bytes, size_t length);
+void flushOutput(OutputSink* sink);
+
+// Formats a value exactly like printValue() does
+void writeValue(OutputSink* sink, Value value);
+
+/**
+ * @brief Formats a double exactly like printf("%g") does.
+ *
+ * @param buffer Receives the text (NUL-terminated); at least 32 bytes.
+ * @return The length of the text.
+ */
+int formatDouble(double value, char* buffer);
+
+#endif  // mavix_output_h
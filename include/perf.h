@@ -0,0 +1,39 @@
+#ifndef mavix_perf_h
+#define mavix_perf_h
+
+#include "common.h"
+
+#if defined(__linux__)
+#define MAVIX_PERF
+#endif
+
+// Where the machine code of a line of script starts
+typedef struct {
+    size_t offset;      // from the start of the code
+    int line;
+} PerfLine;
+
+
+/**
+ * @brief Tells Linux perf about the machine code the JIT generates (--perf).
+ *
+ * Writes /tmp/perf-<pid>.map, which 'perf report' reads by itself, and
+ * jit-<pid>.dump in 'directory', which 'perf record -k mono' notices and
+ * 'perf inject --jit' turns into symbols with line numbers.
+ *
+ * @return false if neither file could be created, or off Linux.
+ */
+bool startPerf(const char* directory);
+// Closes the files; code generated later is not reported
+void stopPerf();
+bool perfEnabled();
+
+/**
+ * @brief Reports freshly generated code, before it runs.
+ *
+ * @param lines Where each line's code starts, in order (may be NULL).
+ */
+void perfCodeLoad(const void* code, size_t size, const char* name,
+                  const PerfLine* lines, int lineCount);
+
+#endif  // mavix_perf_h
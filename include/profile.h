@@ -0,0 +1,72 @@
+#ifndef mavix_profile_h
+#define mavix_profile_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+
+// One loop of a chunk, as reported by hottestLoops()
+typedef struct {
+    int index;              // operand of the loop's OP_LOOP
+    int header;             // bytecode offset of the loop's first instruction
+    int line;
+    uint64_t iterations;    // back-edges taken
+} LoopStats;
+
+
+/**
+ * @brief Lists the loops of a chunk, hottest first.
+ *
+ * @param chunk A chunk that may have run any number of times.
+ * @param stats Receives up to 'max' loops, by descending iteration count.
+ * @param max Capacity of 'stats'.
+ * @return The number of loops written.
+ */
+int hottestLoops(Chunk* chunk, LoopStats* stats, int max);
+
+// Total back-edges taken over all loops of the chunk
+uint64_t totalIterations(Chunk* chunk);
+
+// Sets every loop counter of the chunk back to zero
+void resetLoopCounters(Chunk* chunk);
+
+// Prints the loops of the chunk that ran, hottest first (--profile-loops)
+void printLoopProfile(Chunk* chunk, FILE* file);
+
+
+/*
+#####################################
+Sampling profiler
+#####################################
+*/
+
+// Samples per second of CPU time the profiler takes by default (--profile)
+#define SAMPLE_HZ 1000
+
+/**
+ * @brief Samples where the VM is, 'hz' times per second of CPU time.
+ *
+ * A SIGPROF handler reads the running function, the instruction pointer and
+ * the suspended callers, maps them to source lines and counts the stack in
+ * place. Samples add up until resetSamples().
+ *
+ * @return false where there are no profiling timers, or if one is running.
+ */
+bool startSampling(int hz);
+// Stops the timer; the samples stay for writeFoldedStacks()
+void stopSampling();
+void resetSamples();
+
+/**
+ * @brief Writes the samples as folded stacks, one line per distinct stack:
+ * the frames from the script down, separated by ';', then the count
+ * ("script:12;fib:3;fib:4 57"), which is what flamegraph tools read.
+ *
+ * @return The number of samples written.
+ */
+uint64_t writeFoldedStacks(FILE* file);
+
+// Samples lost because the tables were full
+uint64_t droppedSamples();
+
+#endif  // mavix_profile_h
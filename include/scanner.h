@@ -5,6 +5,11 @@
 #ifndef SCANNER_H
 #define SCANNER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
 
 typedef enum {
     // Single-character tokens
@@ -37,7 +42,55 @@ typedef struct {
 } Token;
 
 
-void initScanner(const char* source);
+// The source does not need to be NUL-terminated: scanning stops after
+// 'length' bytes, and tokens point straight into the source.
+void initScanner(const char* source, size_t length);
 Token scanToken();
 
+
+// Upper bound on the threads used by tokenizeParallel()
+#define MAX_SCAN_THREADS 64
+
+/**
+ * @brief A whole source tokenized up front, in struct-of-arrays layout.
+ *
+ * Token i is described by types[i], offsets[i] (from the start of the
+ * source), lengths[i] and lines[i]. Error tokens carry no source text: their
+ * length indexes 'messages' instead. The last token is always TOKEN_EOF.
+ */
+typedef struct {
+    int count;
+    int capacity;
+    uint8_t* types;         // TokenType
+    uint32_t* offsets;
+    uint32_t* lengths;
+    int* lines;
+
+    const char* source;
+    const char** messages;  // error messages of TOKEN_ERROR tokens
+    int messageCount;
+    int messageCapacity;
+} TokenStream;
+
+void initTokenStream(TokenStream* stream);
+void freeTokenStream(TokenStream* stream);
+
+// Tokenizes the whole source into the stream. Returns false if the source is
+// too large to be indexed by ints (2GB or more).
+bool tokenize(const char* source, size_t length, TokenStream* stream);
+
+/**
+ * @brief Tokenizes the source like tokenize(), on several threads.
+ *
+ * The source is split into pieces at newlines, which are scanned in
+ * parallel and stitched into one stream identical to the serial scanner's.
+ *
+ * @param threadCount Number of threads, or 0 for one per online CPU.
+ */
+bool tokenizeParallel(const char* source, size_t length, int threadCount,
+                      TokenStream* stream);
+
+// Rebuilds token 'index' of the stream (indexes past the end give the EOF)
+Token streamToken(const TokenStream* stream, int index);
+
 #endif //SCANNER_H
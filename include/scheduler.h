@@ -0,0 +1,80 @@
+#ifndef mavix_scheduler_h
+#define mavix_scheduler_h
+
+#include "vm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MAVIX_SCHEDULER_THREAD
+#include <pthread.h>
+#endif
+
+// Back-edges and calls a fiber runs before the next one gets its turn
+#define FIBER_SLICE 4096
+
+
+// A script handed to the scheduler, compiled once the worker gets to it
+typedef struct Submission {
+    char* source;           // private copy
+    size_t length;
+    struct Submission* next;
+} Submission;
+
+
+/**
+ * @brief Runs many scripts at once, each in its own fiber.
+ *
+ * The ready fibers take turns of 'slice' back-edges and calls each, round
+ * robin, so a long-running script cannot starve the others. All of them run
+ * on one thread, the only one that may use the VM meanwhile: either a
+ * worker started with startScheduler(), or the caller of runScheduler().
+ * Other threads only submit scripts.
+ */
+typedef struct {
+    Fiber* head;            // ready queue, owned by the running thread
+    Fiber* tail;
+    uint64_t slice;
+
+    Submission* inbox;      // submitted but not compiled yet
+    Submission* inboxTail;
+    bool closed;            // no more submissions
+
+    uint64_t completed;     // ran to the end
+    uint64_t failed;        // stopped by a runtime error
+    uint64_t killed;        // ran out of fuel or time
+    uint64_t rejected;      // did not compile
+    uint64_t switches;      // turns taken
+
+#ifdef MAVIX_SCHEDULER_THREAD
+    pthread_mutex_t lock;   // guards the inbox and 'closed'
+    pthread_cond_t wake;    // signaled on submissions and on closing
+    pthread_t worker;
+    bool started;
+#endif
+} Scheduler;
+
+
+void initScheduler(Scheduler* scheduler, uint64_t slice);
+// The scheduler must be closed and finished
+void freeScheduler(Scheduler* scheduler);
+
+// Queues a copy of the source to run in a new fiber. Any thread may call it.
+void submitScript(Scheduler* scheduler, const char* source, size_t length);
+// Signals that no more scripts will be submitted
+void closeScheduler(Scheduler* scheduler);
+
+/**
+ * @brief Runs the fibers on the calling thread until every script submitted
+ * before the scheduler was closed has finished.
+ */
+void runScheduler(Scheduler* scheduler);
+
+/**
+ * @brief Runs runScheduler() on a new worker thread.
+ *
+ * @return false if no thread could be started (call runScheduler() then).
+ */
+bool startScheduler(Scheduler* scheduler);
+// Closes the scheduler and waits until the worker has run everything
+void joinScheduler(Scheduler* scheduler);
+
+#endif  // mavix_scheduler_h
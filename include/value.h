@@ -4,10 +4,14 @@
 #include "common.h"
 
 
+typedef struct Obj Obj;
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
-    VAL_NUMBER
+    VAL_NUMBER,
+    VAL_INT,
+    VAL_OBJ         // heap allocated, see object.h
 } ValueType;
 
 
@@ -16,6 +20,8 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        int64_t integer;
+        Obj* obj;
     } as;
 } Value;
 
@@ -23,15 +29,34 @@ typedef struct {
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_INT(value)     ((value).type == VAL_INT)
+#define IS_OBJ(value)     ((value).type == VAL_OBJ)
+// Either kind of number (int or double)
+#define IS_NUMERIC(value) (IS_NUMBER(value) || IS_INT(value))
+// Checks both operands with a single branch (used by the quickened opcodes)
+#define IS_NUMBER_PAIR(a, b) \
+    (((a).type == VAL_NUMBER) & ((b).type == VAL_NUMBER))
+#define IS_INT_PAIR(a, b) \
+    (((a).type == VAL_INT) & ((b).type == VAL_INT))
 
 // Value access (Unpacking) macros
 #define AS_BOOL(value)    ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
+#define AS_INT(value)     ((value).as.integer)
+#define AS_OBJ(value)     ((value).as.obj)
+// Widens an int or double value to a double
+#define TO_DOUBLE(value) \
+    (IS_INT(value) ? (double)AS_INT(value) : AS_NUMBER(value))
 
 // Value construction macros
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)    ((Value){VAL_INT, {.integer = value}})
+#define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+
+// Result of compareNumbers() when a NaN is involved
+#define UNORDERED 2
 
 
 // a dynamic array of values
@@ -42,6 +67,7 @@ typedef struct {
 } ValueArray;
 
 bool valuesEqual(Value a, Value b);
+int compareNumbers(Value a, Value b);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
@@ -5,24 +5,143 @@
 #ifndef VM_H
 #define VM_H
 
+#include "cache.h"
 #include "chunk.h"
+#include "memory.h"
+#include "native.h"
+#include "object.h"
+#include "output.h"
 #include "value.h"
 
+#define FRAMES_MAX 64
+// Slots one frame can use (the compiler and the batch executor assume this)
 #define STACK_MAX 256
+#define VALUE_STACK_MAX (FRAMES_MAX * STACK_MAX)
+// Slots a new fiber starts with; its stack grows on calls up to VALUE_STACK_MAX
+#define FIBER_STACK_MIN STACK_MAX
+#define GLOBALS_MAX UINT8_COUNT
+
+
+/*
+ * Top-level variables. The compiler binds every name to a slot once, and the
+ * table outlives chunks, so code compiled later (e.g. the next REPL line)
+ * sees the variables defined before. The names are shared, while every
+ * fiber has values of its own: 'values' and 'defined' are the running one's.
+ */
+typedef struct {
+    char* names[GLOBALS_MAX];
+    int lengths[GLOBALS_MAX];
+    Value* values;
+    bool* defined;          // false until its 'var' statement ran
+    int count;
+} Globals;
+
+
+/*
+ * The state of a suspended caller. The running function's state lives in
+ * the VM itself (chunk, ip, slots), so a frame is only written by a call
+ * and read back by the matching return.
+ */
+typedef struct {
+    ObjFunction* function;  // NULL for the top-level script
+    uint8_t* ip;            // where the caller continues
+    Value* slots;           // the caller's first stack slot
+} CallFrame;
+
+
+/*
+ * A script's execution state: its stack, its callers and where it is. The
+ * running fiber's registers live in the VM (the copies here are only
+ * current while it is suspended); switching fibers swaps them, while the
+ * stack and the frames stay where they are.
+ *
+ * Fibers share the heap and the names of the globals, but each one has
+ * its own global variables, like a VM of its own.
+ */
+typedef struct Fiber {
+    uint8_t* ip;
+    Value* slots;
+    ObjFunction* function;
+    Chunk* script;
+    int frameCount;
+    Value* stackTop;
+
+    CallFrame frames[FRAMES_MAX];
+    Value* stack;
+    int stackCapacity;
+
+    Value globals[GLOBALS_MAX];
+    bool defined[GLOBALS_MAX];
+
+    Chunk code;         // the script compiled by newFiber()...
+    CacheEntry* cached; // ... or the cache's copy of it
+    uint64_t fuel;      // back-edges and calls left, UINT64_MAX: unlimited
+    uint64_t deadline;  // CLOCK_MONOTONIC nanoseconds, UINT64_MAX: none
+    bool done;          // returned or failed: it cannot be resumed
+
+    struct Fiber* prev; // every fiber, so the collector finds their roots
+    struct Fiber* next;
+    struct Fiber* nextReady;    // in a scheduler's ready queue
+} Fiber;
+
 
 typedef struct {
     Chunk* chunk;       // takes an entire chunk of code
     uint8_t* ip;        // Instruction pointer (points to the next instruction)
-    Value stack[STACK_MAX];
+    Value* slots;       // the running function's slot 0 (its locals follow)
+    ObjFunction* function;  // the running function, NULL for the script
+    Chunk* script;      // the top-level chunk being run
+
+    CallFrame* frames;  // the running fiber's
+    int frameCount;     // suspended callers
+
+    Value* stack;       // the running fiber's
     Value* stackTop;    // points to the next value 
+    Value* stackLimit;  // end of the running fiber's stack
+    Value result;       // value returned by the chunk that ran last
+    Globals globals;
+    Natives natives;
+
+    Chunk session;      // the lines given to interpretLine(), one after another
+    Fiber main;         // what interpret() and evaluate() run on
+    Fiber* fiber;       // the running fiber
+    Fiber* fibers;      // all of them, the main fiber included
+
+    // Back-edges and calls left until the safepoint's slow path runs, and
+    // the count it started from
+    int64_t ticks;
+    int64_t armed;
+    uint64_t slice;     // back-edges and calls before the fiber yields
+
+    // Limits of every run (of the main fiber) and every new fiber, from the
+    // start of the run or the creation of the fiber. UINT64_MAX: none.
+    uint64_t fuelLimit;     // back-edges and calls
+    uint64_t timeLimitNs;   // wall-clock time
+
+    const double* const* columns;   // input columns read by OP_GET_COLUMN
+    size_t row;                     // current input row within the columns
+
+    bool jit;           // run chunks as machine code where it can (--jit)
+    OutputSink* output; // where results go (buffered stdout by default)
+    ChunkCache* cache;  // compiled chunks reused by interpret(), or NULL
+    bool profileLoops;  // print each chunk's loop profile after it ran
+
+    Heap heap;          // every heap object, freed by freeVM()
+    bool gcStats;       // print the collector's statistics at exit
 } VM;
 
 
+extern VM vm;
+
+
 // VM responses
 typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
     INTERPRET_RUNTIME_ERROR,
+    INTERPRET_YIELD,        // the fiber used up its slice: resume it later
+    INTERPRET_OUT_OF_FUEL,  // stopped after vm.fuelLimit back-edges and calls
+    INTERPRET_TIMEOUT,      // stopped after vm.timeLimitNs
 } InterpretResult;
 
 
@@ -31,6 +150,44 @@ void freeVM();
 
 // main entrypoint of VM
 InterpretResult interpret(const char* source);
+InterpretResult interpretSource(const char* source, size_t length);
+
+/**
+ * @brief Runs one input of an interactive session (the REPL).
+ *
+ * The input is compiled onto the end of the session's chunk and runs from
+ * there, so lines share the chunk and its constant pool instead of each
+ * building and freeing a chunk of its own. Globals persist as usual.
+ */
+InterpretResult interpretLine(const char* source, size_t length);
+
+// Slot of the global variable with this name, added if new (-1 when full)
+int globalSlot(const char* name, int length);
+
+// Runs an already compiled chunk and stores its result instead of printing it
+InterpretResult evaluate(Chunk* chunk, Value* result);
+
+/**
+ * @brief Compiles a script into a new fiber, suspended at its first instruction.
+ *
+ * @return The fiber, or NULL if the source does not compile.
+ */
+Fiber* newFiber(const char* source, size_t length);
+// The fiber must not be running
+void freeFiber(Fiber* fiber);
+
+/**
+ * @brief Runs the fiber until it finishes or has made 'slice' back-jumps
+ * and calls, whichever comes first.
+ *
+ * Must not be called from code the VM is running.
+ *
+ * @return INTERPRET_YIELD if the fiber was suspended, otherwise how it ended.
+ */
+InterpretResult resumeFiber(Fiber* fiber, uint64_t slice);
+
+// Makes the next back-edge or call run the safepoint's slow path
+void requestSafepoint();
 
 // Stack protocol operation
 /*
@@ -0,0 +1,641 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "compiler.h"
+#include "memory.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BATCH_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Ints beyond this magnitude are not exactly representable as doubles
+#define EXACT_INT_LIMIT 9007199254740992LL     // 2^53
+
+
+/*
+#####################################
+Lane kernels
+#####################################
+*/
+
+typedef void (*ArithKernel)(double* out, const double* a, const double* b, int n);
+typedef void (*CompareKernel)(uint8_t* out, const double* a, const double* b, int n);
+
+// The kernel set picked for the running CPU (see selectKernels())
+typedef struct {
+    ArithKernel add;
+    ArithKernel subtract;
+    ArithKernel multiply;
+    ArithKernel divide;
+    CompareKernel greater;
+    CompareKernel less;
+    CompareKernel equal;
+} Kernels;
+
+
+// Portable kernels, also used for the tail of every SIMD loop
+#define SCALAR_ARITH(name, op) \
+    static void name(double* out, const double* a, const double* b, int n) { \
+        for (int i = 0; i < n; i++) out[i] = a[i] op b[i]; \
+    }
+
+#define SCALAR_COMPARE(name, op) \
+    static void name(uint8_t* out, const double* a, const double* b, int n) { \
+        for (int i = 0; i < n; i++) out[i] = a[i] op b[i]; \
+    }
+
+SCALAR_ARITH(addScalar, +)
+SCALAR_ARITH(subtractScalar, -)
+SCALAR_ARITH(multiplyScalar, *)
+SCALAR_ARITH(divideScalar, /)
+SCALAR_COMPARE(greaterScalar, >)
+SCALAR_COMPARE(lessScalar, <)
+SCALAR_COMPARE(equalScalar, ==)
+
+#ifdef BATCH_X86_SIMD
+
+/* @note
+ * IEEE add/sub/mul/div are correctly rounded in both the packed and the scalar
+ * SSE2 instructions, so these produce bit-identical results to the VM. The
+ * comparison predicates are the ordered ones: NaN compares false, like in C.
+ * */
+#define SIMD_ARITH(name, isa, width, load, store, vectorOp, op) \
+    __attribute__((target(isa))) \
+    static void name(double* out, const double* a, const double* b, int n) { \
+        int i = 0; \
+        for (; i + (width) <= n; i += (width)) { \
+            store(out + i, vectorOp(load(a + i), load(b + i))); \
+        } \
+        for (; i < n; i++) out[i] = a[i] op b[i]; \
+    }
+
+#define SIMD_COMPARE(name, isa, width, load, compare, movemask, op) \
+    __attribute__((target(isa))) \
+    static void name(uint8_t* out, const double* a, const double* b, int n) { \
+        int i = 0; \
+        for (; i + (width) <= n; i += (width)) { \
+            int mask = movemask(compare(load(a + i), load(b + i))); \
+            for (int lane = 0; lane < (width); lane++) { \
+                out[i + lane] = (mask >> lane) & 1; \
+            } \
+        } \
+        for (; i < n; i++) out[i] = a[i] op b[i]; \
+    }
+
+#define SSE2_GT(a, b) _mm_cmpgt_pd(a, b)
+#define SSE2_LT(a, b) _mm_cmplt_pd(a, b)
+#define SSE2_EQ(a, b) _mm_cmpeq_pd(a, b)
+#define AVX_GT(a, b)  _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define AVX_LT(a, b)  _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define AVX_EQ(a, b)  _mm256_cmp_pd(a, b, _CMP_EQ_OQ)
+
+SIMD_ARITH(addSse2, "sse2", 2, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd, +)
+SIMD_ARITH(subtractSse2, "sse2", 2, _mm_loadu_pd, _mm_storeu_pd, _mm_sub_pd, -)
+SIMD_ARITH(multiplySse2, "sse2", 2, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd, *)
+SIMD_ARITH(divideSse2, "sse2", 2, _mm_loadu_pd, _mm_storeu_pd, _mm_div_pd, /)
+SIMD_COMPARE(greaterSse2, "sse2", 2, _mm_loadu_pd, SSE2_GT, _mm_movemask_pd, >)
+SIMD_COMPARE(lessSse2, "sse2", 2, _mm_loadu_pd, SSE2_LT, _mm_movemask_pd, <)
+SIMD_COMPARE(equalSse2, "sse2", 2, _mm_loadu_pd, SSE2_EQ, _mm_movemask_pd, ==)
+
+SIMD_ARITH(addAvx2, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, +)
+SIMD_ARITH(subtractAvx2, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd, -)
+SIMD_ARITH(multiplyAvx2, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd, *)
+SIMD_ARITH(divideAvx2, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_div_pd, /)
+SIMD_COMPARE(greaterAvx2, "avx2", 4, _mm256_loadu_pd, AVX_GT, _mm256_movemask_pd, >)
+SIMD_COMPARE(lessAvx2, "avx2", 4, _mm256_loadu_pd, AVX_LT, _mm256_movemask_pd, <)
+SIMD_COMPARE(equalAvx2, "avx2", 4, _mm256_loadu_pd, AVX_EQ, _mm256_movemask_pd, ==)
+
+#endif  // BATCH_X86_SIMD
+
+
+static Kernels kernels;
+static bool kernelsSelected = false;
+
+// Picks the widest kernels the CPU supports (once per process).
+static void selectKernels() {
+    if (kernelsSelected) return;
+    kernelsSelected = true;
+
+    kernels = (Kernels){addScalar, subtractScalar, multiplyScalar, divideScalar,
+                        greaterScalar, lessScalar, equalScalar};
+
+#ifdef BATCH_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels = (Kernels){addAvx2, subtractAvx2, multiplyAvx2, divideAvx2,
+                            greaterAvx2, lessAvx2, equalAvx2};
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernels = (Kernels){addSse2, subtractSse2, multiplySse2, divideSse2,
+                            greaterSse2, lessSse2, equalSse2};
+    }
+#endif
+}
+
+
+/*
+#####################################
+Lane stack
+#####################################
+*/
+
+typedef enum {
+    SLOT_UNIFORM,       // the same value in every lane
+    SLOT_NUMBERS,       // one double per lane
+    SLOT_BOOLS,         // one bool (a 0/1 byte) per lane
+} SlotKind;
+
+
+typedef struct {
+    SlotKind kind;
+    Value value;                // SLOT_UNIFORM
+    const double* numbers;      // SLOT_NUMBERS: a column or the slot's own lanes
+    uint8_t* bools;             // SLOT_BOOLS: the slot's own lanes
+} Slot;
+
+
+// A short-circuit jump that only some lanes take (see branch())
+typedef struct {
+    const uint8_t* target;      // where the lanes join again
+    bool jumpIfTrue;            // 'or' (OP_JUMP_IF_TRUE) or 'and'
+    uint8_t* taken;             // lanes that jumped, with the condition as value
+} Merge;
+
+
+// Mirror of the VM stack where every slot holds a whole batch of values
+typedef struct {
+    Slot slots[STACK_MAX];
+    double* numbers[STACK_MAX];     // lane buffers per slot, allocated on first use
+    uint8_t* bools[STACK_MAX];
+    double scratch[BATCH_LANES];    // a uniform operand broadcast to all lanes
+    int lanes;                      // rows in the current batch
+
+    Merge merges[STACK_MAX];        // pending merges, innermost last
+    uint8_t* mergeLanes[STACK_MAX]; // 'taken' buffers per nesting depth
+    int mergeCount;
+} Batch;
+
+
+static int slotIndex(Batch* batch, Slot* slot) {
+    return (int)(slot - batch->slots);
+}
+
+static double* numberStorage(Batch* batch, Slot* slot) {
+    int index = slotIndex(batch, slot);
+    if (batch->numbers[index] == NULL) {
+        batch->numbers[index] = GROW_ARRAY(double, NULL, 0, BATCH_LANES);
+    }
+    return batch->numbers[index];
+}
+
+static uint8_t* boolStorage(Batch* batch, Slot* slot) {
+    int index = slotIndex(batch, slot);
+    if (batch->bools[index] == NULL) {
+        batch->bools[index] = GROW_ARRAY(uint8_t, NULL, 0, BATCH_LANES);
+    }
+    return batch->bools[index];
+}
+
+
+static bool isNumericSlot(Slot* slot) {
+    return slot->kind == SLOT_NUMBERS ||
+           (slot->kind == SLOT_UNIFORM && IS_NUMERIC(slot->value));
+}
+
+// A uniform int that a double comparison would not see exactly
+static bool isInexactInt(Slot* slot) {
+    return slot->kind == SLOT_UNIFORM && IS_INT(slot->value) &&
+           (AS_INT(slot->value) > EXACT_INT_LIMIT ||
+            AS_INT(slot->value) < -EXACT_INT_LIMIT);
+}
+
+// Lanes of a numeric slot. A uniform operand is widened to a double (as the VM
+// does for mixed operands) and broadcast into the scratch lanes.
+static const double* numberLanes(Batch* batch, Slot* slot) {
+    if (slot->kind == SLOT_NUMBERS) return slot->numbers;
+
+    double value = TO_DOUBLE(slot->value);
+    for (int i = 0; i < batch->lanes; i++) batch->scratch[i] = value;
+    return batch->scratch;
+}
+
+static void setUniform(Slot* slot, Value value) {
+    slot->kind = SLOT_UNIFORM;
+    slot->value = value;
+}
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+
+/*
+#####################################
+Vectorized instructions
+#####################################
+*/
+
+// Evaluates an arithmetic instruction on two uniform operands, with the same
+// int/double semantics as the VM. Returns false on a type error.
+static bool foldArithmetic(uint8_t op, Value a, Value b, Value* result) {
+    if (!IS_NUMERIC(a) || !IS_NUMERIC(b)) return false;
+
+    if (IS_INT(a) && IS_INT(b)) {
+        int64_t x = AS_INT(a);
+        int64_t y = AS_INT(b);
+        int64_t value;
+        switch (op) {
+            case OP_ADD:
+                if (__builtin_add_overflow(x, y, &value)) break;
+                *result = INT_VAL(value);
+                return true;
+            case OP_SUBTRACT:
+                if (__builtin_sub_overflow(x, y, &value)) break;
+                *result = INT_VAL(value);
+                return true;
+            case OP_MULTIPLY:
+                if (__builtin_mul_overflow(x, y, &value)) break;
+                *result = INT_VAL(value);
+                return true;
+            case OP_DIVIDE:
+                if (y == 0 || (x == INT64_MIN && y == -1) || x % y != 0) break;
+                *result = INT_VAL(x / y);
+                return true;
+        }
+    }
+
+    double x = TO_DOUBLE(a);
+    double y = TO_DOUBLE(b);
+    switch (op) {
+        case OP_ADD:      *result = NUMBER_VAL(x + y); break;
+        case OP_SUBTRACT: *result = NUMBER_VAL(x - y); break;
+        case OP_MULTIPLY: *result = NUMBER_VAL(x * y); break;
+        case OP_DIVIDE:   *result = NUMBER_VAL(x / y); break;
+    }
+    return true;
+}
+
+// 'a' is the left operand; the result replaces it. 'op' is the generic opcode.
+static bool arithmetic(Batch* batch, Slot* a, uint8_t op, ArithKernel kernel) {
+    Slot* b = a + 1;
+    if (a->kind == SLOT_UNIFORM && b->kind == SLOT_UNIFORM) {
+        return foldArithmetic(op, a->value, b->value, &a->value);
+    }
+    if (!isNumericSlot(a) || !isNumericSlot(b)) return false;
+
+    double* out = numberStorage(batch, a);
+    kernel(out, numberLanes(batch, a), numberLanes(batch, b), batch->lanes);
+    a->kind = SLOT_NUMBERS;
+    a->numbers = out;
+    return true;
+}
+
+static bool comparison(Batch* batch, Slot* a, uint8_t op, CompareKernel kernel) {
+    Slot* b = a + 1;
+    if (!isNumericSlot(a) || !isNumericSlot(b)) return false;
+
+    if (a->kind == SLOT_UNIFORM && b->kind == SLOT_UNIFORM) {
+        int order = compareNumbers(a->value, b->value);
+        setUniform(a, BOOL_VAL(order != UNORDERED &&
+                               (op == OP_LESS ? order < 0 : order > 0)));
+        return true;
+    }
+    // Let the VM compare such ints exactly
+    if (isInexactInt(a) || isInexactInt(b)) return false;
+
+    uint8_t* out = boolStorage(batch, a);
+    kernel(out, numberLanes(batch, a), numberLanes(batch, b), batch->lanes);
+    a->kind = SLOT_BOOLS;
+    a->bools = out;
+    return true;
+}
+
+static bool equality(Batch* batch, Slot* a) {
+    Slot* b = a + 1;
+    if (a->kind == SLOT_UNIFORM && b->kind == SLOT_UNIFORM) {
+        setUniform(a, BOOL_VAL(valuesEqual(a->value, b->value)));
+        return true;
+    }
+
+    if (isNumericSlot(a) && isNumericSlot(b)) {
+        if (isInexactInt(a) || isInexactInt(b)) return false;
+
+        uint8_t* out = boolStorage(batch, a);
+        kernels.equal(out, numberLanes(batch, a), numberLanes(batch, b), batch->lanes);
+        a->kind = SLOT_BOOLS;
+        a->bools = out;
+        return true;
+    }
+
+    // Bool lanes against bool lanes or a uniform bool
+    if (b->kind == SLOT_BOOLS) {
+        Slot swap = *a;
+        *a = *b;
+        *b = swap;
+    }
+    if (a->kind == SLOT_BOOLS &&
+        (b->kind == SLOT_BOOLS || (b->kind == SLOT_UNIFORM && IS_BOOL(b->value)))) {
+        uint8_t* out = boolStorage(batch, a);
+        const uint8_t* left = a->bools;
+        for (int i = 0; i < batch->lanes; i++) {
+            uint8_t right = b->kind == SLOT_BOOLS ? b->bools[i] : AS_BOOL(b->value);
+            out[i] = left[i] == right;
+        }
+        a->bools = out;
+        return true;
+    }
+
+    // Values of different types are never equal
+    setUniform(a, BOOL_VAL(false));
+    return true;
+}
+
+static bool logicalNot(Batch* batch, Slot* a) {
+    switch (a->kind) {
+        case SLOT_UNIFORM:
+            setUniform(a, BOOL_VAL(isFalsey(a->value)));
+            return true;
+        case SLOT_NUMBERS:
+            setUniform(a, BOOL_VAL(false));     // numbers are always truthy
+            return true;
+        case SLOT_BOOLS: {
+            uint8_t* out = boolStorage(batch, a);
+            for (int i = 0; i < batch->lanes; i++) out[i] = !a->bools[i];
+            a->bools = out;
+            return true;
+        }
+    }
+    return false;   // Unreachable.
+}
+
+static bool negate(Batch* batch, Slot* a) {
+    if (a->kind == SLOT_UNIFORM) {
+        if (IS_INT(a->value)) {
+            int64_t value = AS_INT(a->value);
+            a->value = value == INT64_MIN ? NUMBER_VAL(-(double)value)
+                                          : INT_VAL(-value);
+            return true;
+        }
+        if (!IS_NUMBER(a->value)) return false;
+        a->value = NUMBER_VAL(-AS_NUMBER(a->value));
+        return true;
+    }
+    if (a->kind != SLOT_NUMBERS) return false;
+
+    double* out = numberStorage(batch, a);
+    for (int i = 0; i < batch->lanes; i++) out[i] = -a->numbers[i];
+    a->numbers = out;
+    return true;
+}
+
+/* @note
+ * A conditional jump that goes the same way for all lanes is simply taken or
+ * not. When only some lanes jump, every lane runs the right operand instead,
+ * and merge() picks per lane between the condition and the right operand
+ * where the jump lands. That is only correct because expressions have no
+ * side effects; an error in a lane that should have skipped the right
+ * operand makes the batch fall back to the VM, which does skip it.
+ *
+ * @return false if the condition cannot be handled here.
+ * */
+static bool branch(Batch* batch, Slot* condition, bool jumpIfTrue,
+                   const uint8_t** ip, uint16_t offset) {
+    bool truthy;
+    switch (condition->kind) {
+        case SLOT_UNIFORM: truthy = !isFalsey(condition->value); break;
+        case SLOT_NUMBERS: truthy = true; break;
+        case SLOT_BOOLS: {
+            int count = 0;
+            for (int i = 0; i < batch->lanes; i++) count += condition->bools[i];
+            if (count != 0 && count != batch->lanes) {
+                if (batch->mergeCount == STACK_MAX) return false;
+                int depth = batch->mergeCount;
+                if (batch->mergeLanes[depth] == NULL) {
+                    batch->mergeLanes[depth] = GROW_ARRAY(uint8_t, NULL, 0, BATCH_LANES);
+                }
+                Merge* merge = &batch->merges[batch->mergeCount++];
+                merge->target = *ip + offset;
+                merge->jumpIfTrue = jumpIfTrue;
+                merge->taken = batch->mergeLanes[depth];
+                memcpy(merge->taken, condition->bools, (size_t)batch->lanes);
+                return true;
+            }
+            truthy = count != 0;
+            break;
+        }
+        default: return false;  // Unreachable.
+    }
+
+    if (truthy == jumpIfTrue) *ip += offset;
+    return true;
+}
+
+// Joins the lanes of the innermost pending merge into the top slot.
+static bool merge(Batch* batch, Slot* slot) {
+    Merge* merge = &batch->merges[--batch->mergeCount];
+
+    // Lanes that jumped hold their bool condition, the others the right
+    // operand, which has to be a bool too to fit in one slot
+    bool uniform = slot->kind == SLOT_UNIFORM;
+    if (uniform ? !IS_BOOL(slot->value) : slot->kind != SLOT_BOOLS) return false;
+
+    uint8_t* out = boolStorage(batch, slot);
+    uint8_t jumped = merge->jumpIfTrue ? 1 : 0;
+    for (int i = 0; i < batch->lanes; i++) {
+        uint8_t right = uniform ? AS_BOOL(slot->value) : slot->bools[i];
+        out[i] = merge->taken[i] == jumped ? jumped : right;
+    }
+    slot->kind = SLOT_BOOLS;
+    slot->bools = out;
+    return true;
+}
+
+
+static void storeResults(Batch* batch, Slot* slot, Value* results) {
+    for (int i = 0; i < batch->lanes; i++) {
+        switch (slot->kind) {
+            case SLOT_UNIFORM: results[i] = slot->value; break;
+            case SLOT_NUMBERS: results[i] = NUMBER_VAL(slot->numbers[i]); break;
+            case SLOT_BOOLS:   results[i] = BOOL_VAL(slot->bools[i]); break;
+        }
+    }
+}
+
+
+/**
+ * Runs the chunk once over the rows [base, base + batch->lanes).
+ *
+ * @return false if some instruction could not be vectorized (including any
+ *         type error); the caller then re-runs these rows on the scalar VM.
+ */
+static bool runLanes(Batch* batch, Chunk* chunk, const double* const* columns,
+                     size_t base, Value* results) {
+    const uint8_t* ip = chunk->code;
+    Slot* top = batch->slots;
+    batch->mergeCount = 0;
+
+    for (;;) {
+        while (batch->mergeCount > 0 &&
+               ip == batch->merges[batch->mergeCount - 1].target) {
+            if (!merge(batch, top - 1)) return false;
+        }
+
+        switch (*ip++) {
+            case OP_CONSTANT:
+                setUniform(top++, chunk->constants.values[*ip++]);
+                break;
+            case OP_NIL:   setUniform(top++, NIL_VAL); break;
+            case OP_TRUE:  setUniform(top++, BOOL_VAL(true)); break;
+            case OP_FALSE: setUniform(top++, BOOL_VAL(false)); break;
+
+            case OP_GET_COLUMN:
+                top->kind = SLOT_NUMBERS;
+                top->numbers = columns[*ip++] + base;
+                top++;
+                break;
+
+            case OP_EQUAL:
+                if (!equality(batch, top - 2)) return false;
+                top--;
+                break;
+
+            case OP_GREATER:
+            case OP_GREATER_NUM:
+            case OP_GREATER_INT:
+            case OP_GREATER_UNCHECKED:
+                if (!comparison(batch, top - 2, OP_GREATER, kernels.greater)) return false;
+                top--;
+                break;
+            case OP_LESS:
+            case OP_LESS_NUM:
+            case OP_LESS_INT:
+            case OP_LESS_UNCHECKED:
+                if (!comparison(batch, top - 2, OP_LESS, kernels.less)) return false;
+                top--;
+                break;
+
+            case OP_ADD:
+            case OP_ADD_NUM:
+            case OP_ADD_INT:
+            case OP_ADD_UNCHECKED:
+                if (!arithmetic(batch, top - 2, OP_ADD, kernels.add)) return false;
+                top--;
+                break;
+            case OP_SUBTRACT:
+            case OP_SUBTRACT_NUM:
+            case OP_SUBTRACT_INT:
+            case OP_SUBTRACT_UNCHECKED:
+                if (!arithmetic(batch, top - 2, OP_SUBTRACT, kernels.subtract)) return false;
+                top--;
+                break;
+            case OP_MULTIPLY:
+            case OP_MULTIPLY_NUM:
+            case OP_MULTIPLY_INT:
+            case OP_MULTIPLY_UNCHECKED:
+                if (!arithmetic(batch, top - 2, OP_MULTIPLY, kernels.multiply)) return false;
+                top--;
+                break;
+            case OP_DIVIDE:
+            case OP_DIVIDE_NUM:
+            case OP_DIVIDE_UNCHECKED:
+                if (!arithmetic(batch, top - 2, OP_DIVIDE, kernels.divide)) return false;
+                top--;
+                break;
+
+            case OP_NOT:
+                if (!logicalNot(batch, top - 1)) return false;
+                break;
+            case OP_NEGATE:
+            case OP_NEGATE_UNCHECKED:
+                if (!negate(batch, top - 1)) return false;
+                break;
+
+            case OP_POP:
+                top--;
+                break;
+
+            case OP_JUMP:
+                ip += (uint16_t)((ip[0] << 8) | ip[1]) + 2;
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE: {
+                uint16_t offset = (uint16_t)((ip[0] << 8) | ip[1]);
+                ip += 2;
+                if (!branch(batch, top - 1, ip[-3] == OP_JUMP_IF_TRUE, &ip, offset)) {
+                    return false;
+                }
+                break;
+            }
+
+            case OP_RETURN:
+                storeResults(batch, top - 1, results + base);
+                return true;
+
+            default:
+                return false;   // not vectorized
+        }
+    }
+}
+
+
+// Evaluates the rows [base, base + count) one at a time on the scalar VM.
+static InterpretResult runRows(Chunk* chunk, const double* const* columns,
+                               size_t base, int count, Value* results) {
+    vm.columns = columns;
+    for (int i = 0; i < count; i++) {
+        vm.row = base + i;
+        InterpretResult result = evaluate(chunk, &results[base + i]);
+        if (result != INTERPRET_OK) return result;
+    }
+    return INTERPRET_OK;
+}
+
+
+InterpretResult runBatch(Chunk* chunk, const double* const* columns,
+                         size_t rowCount, Value* results) {
+    selectKernels();
+
+    Batch* batch = GROW_ARRAY(Batch, NULL, 0, 1);
+    for (int i = 0; i < STACK_MAX; i++) {
+        batch->numbers[i] = NULL;
+        batch->bools[i] = NULL;
+        batch->mergeLanes[i] = NULL;
+    }
+
+    InterpretResult result = INTERPRET_OK;
+    for (size_t base = 0; base < rowCount; base += BATCH_LANES) {
+        size_t remaining = rowCount - base;
+        batch->lanes = remaining < BATCH_LANES ? (int)remaining : BATCH_LANES;
+
+        if (!runLanes(batch, chunk, columns, base, results)) {
+            result = runRows(chunk, columns, base, batch->lanes, results);
+            if (result != INTERPRET_OK) break;
+        }
+    }
+
+    for (int i = 0; i < STACK_MAX; i++) {
+        FREE_ARRAY(double, batch->numbers[i], BATCH_LANES);
+        FREE_ARRAY(uint8_t, batch->bools[i], BATCH_LANES);
+        FREE_ARRAY(uint8_t, batch->mergeLanes[i], BATCH_LANES);
+    }
+    FREE_ARRAY(Batch, batch, 1);
+    return result;
+}
+
+
+InterpretResult interpretBatch(const char* source, const char* const* names,
+                               int columnCount, const double* const* columns,
+                               size_t rowCount, Value* results) {
+    Chunk chunk;
+    initChunk(&chunk);
+
+    if (!compileColumns(source, strlen(source), names, columnCount, &chunk)) {
+        freeChunk(&chunk);
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    InterpretResult result = runBatch(&chunk, columns, rowCount, results);
+    freeChunk(&chunk);
+    return result;
+}
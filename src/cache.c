@@ -0,0 +1,310 @@
+#include <string.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "memory.h"
+
+__extension__ typedef unsigned __int128 uint128_t;
+
+#ifdef MAVIX_CACHE_LOCKS
+#define READ_LOCK(cache)    pthread_rwlock_rdlock(&(cache)->lock)
+#define WRITE_LOCK(cache)   pthread_rwlock_wrlock(&(cache)->lock)
+#define UNLOCK(cache)       pthread_rwlock_unlock(&(cache)->lock)
+#else
+#define READ_LOCK(cache)    ((void)0)
+#define WRITE_LOCK(cache)   ((void)0)
+#define UNLOCK(cache)       ((void)0)
+#endif
+
+
+/*
+#####################################
+Hashing
+#####################################
+*/
+
+static const uint64_t secret[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL,
+};
+
+// 128-bit product of a and b, folded to 64 bits
+static uint64_t mix(uint64_t a, uint64_t b) {
+    uint128_t product = (uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static uint64_t read64(const uint8_t* bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint64_t read32(const uint8_t* bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+
+uint64_t hashBytes(const char* bytes, size_t length) {
+    const uint8_t* p = (const uint8_t*)bytes;
+    uint64_t seed = mix(secret[0], secret[1]);
+    uint64_t a;
+    uint64_t b;
+
+    if (length <= 16) {
+        if (length >= 4) {
+            size_t middle = (length >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + middle);
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - middle);
+        } else if (length > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        size_t remaining = length;
+        if (remaining > 48) {
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do {
+                seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+                seed1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ seed1);
+                seed2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ seed2);
+                p += 48;
+                remaining -= 48;
+            } while (remaining > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (remaining > 16) {
+            seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // The last 16 bytes, overlapping the ones already mixed in if needed
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
+    }
+
+    uint128_t product = (uint128_t)(a ^ secret[1]) * (b ^ seed);
+    a = (uint64_t)product;
+    b = (uint64_t)(product >> 64);
+    return mix(a ^ secret[0] ^ length, b ^ secret[1]);
+}
+
+
+
+/*
+#####################################
+Entries
+#####################################
+*/
+
+static size_t entrySize(CacheEntry* entry) {
+    return sizeof(CacheEntry) + entry->length +
+           (size_t)entry->chunk.capacity * (sizeof(uint8_t) + sizeof(int)) +
+           (size_t)entry->chunk.constants.capacity * sizeof(Value) +
+           (size_t)entry->chunk.loopCapacity * sizeof(LoopProfile);
+}
+
+static void freeEntry(CacheEntry* entry) {
+    freeChunk(&entry->chunk);
+    FREE_ARRAY(char, entry->source, entry->length);
+    FREE_ARRAY(CacheEntry, entry, 1);
+}
+
+
+// The entry for the source in the table, or NULL
+static CacheEntry* findEntry(ChunkCache* cache, uint64_t hash,
+                             const char* source, size_t length) {
+    CacheEntry* entry = cache->buckets[hash & (uint64_t)(cache->bucketCount - 1)];
+    for (; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(entry->source, source, length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+static void unlinkEntry(ChunkCache* cache, CacheEntry* entry) {
+    CacheEntry** link = &cache->buckets[entry->hash & (uint64_t)(cache->bucketCount - 1)];
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+
+    cache->count--;
+    cache->bytes -= entry->size;
+}
+
+
+static void growBuckets(ChunkCache* cache) {
+    int oldCount = cache->bucketCount;
+    int newCount = oldCount * 2;
+    CacheEntry** buckets = GROW_ARRAY(CacheEntry*, NULL, 0, newCount);
+    for (int i = 0; i < newCount; i++) buckets[i] = NULL;
+
+    for (int i = 0; i < oldCount; i++) {
+        CacheEntry* entry = cache->buckets[i];
+        while (entry != NULL) {
+            CacheEntry* next = entry->next;
+            CacheEntry** bucket = &buckets[entry->hash & (uint64_t)(newCount - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+
+    FREE_ARRAY(CacheEntry*, cache->buckets, oldCount);
+    cache->buckets = buckets;
+    cache->bucketCount = newCount;
+}
+
+
+/* @note
+ * Hits only bump the entry's timestamp. Eviction finds the oldest one with
+ * a scan of the table, which only happens on a miss while the cache is full.
+ * Needs the write lock held.
+ * */
+static void evictEntries(ChunkCache* cache) {
+    while (cache->bytes > cache->budget) {
+        CacheEntry* oldest = NULL;
+        uint64_t oldestUse = UINT64_MAX;
+
+        for (int i = 0; i < cache->bucketCount; i++) {
+            for (CacheEntry* entry = cache->buckets[i]; entry != NULL; entry = entry->next) {
+                if (entry->lastUsed < oldestUse) {
+                    oldest = entry;
+                    oldestUse = entry->lastUsed;
+                }
+            }
+        }
+        if (oldest == NULL) return;
+
+        unlinkEntry(cache, oldest);
+        atomic_fetch_add(&cache->evictions, 1);
+
+        // Drop the table's reference; whoever still runs the chunk frees it
+        releaseChunk(cache, oldest);
+    }
+}
+
+
+
+/*
+#####################################
+Cache
+#####################################
+*/
+
+void initChunkCache(ChunkCache* cache, size_t budget) {
+    cache->bucketCount = 64;
+    cache->buckets = GROW_ARRAY(CacheEntry*, NULL, 0, cache->bucketCount);
+    for (int i = 0; i < cache->bucketCount; i++) cache->buckets[i] = NULL;
+    cache->count = 0;
+
+    cache->bytes = 0;
+    cache->budget = budget;
+    cache->clock = 0;
+    atomic_init(&cache->hits, 0);
+    atomic_init(&cache->misses, 0);
+    atomic_init(&cache->evictions, 0);
+
+#ifdef MAVIX_CACHE_LOCKS
+    pthread_rwlock_init(&cache->lock, NULL);
+#endif
+}
+
+
+// No entry may still be acquired when the cache is freed.
+void freeChunkCache(ChunkCache* cache) {
+    for (int i = 0; i < cache->bucketCount; i++) {
+        CacheEntry* entry = cache->buckets[i];
+        while (entry != NULL) {
+            CacheEntry* next = entry->next;
+            freeEntry(entry);
+            entry = next;
+        }
+    }
+    FREE_ARRAY(CacheEntry*, cache->buckets, cache->bucketCount);
+    cache->buckets = NULL;
+    cache->bucketCount = 0;
+    cache->count = 0;
+    cache->bytes = 0;
+
+#ifdef MAVIX_CACHE_LOCKS
+    pthread_rwlock_destroy(&cache->lock);
+#endif
+}
+
+
+/* @note
+ * Only the VM's thread changes the table, so its own lookups need no lock;
+ * changes take the write lock for the sake of chunkCacheStats().
+ * */
+CacheEntry* acquireChunk(ChunkCache* cache, const char* source, size_t length) {
+    uint64_t hash = hashBytes(source, length);
+
+    CacheEntry* entry = findEntry(cache, hash, source, length);
+    if (entry != NULL) {
+        entry->refs++;
+        entry->lastUsed = cache->clock++;
+        atomic_fetch_add(&cache->hits, 1);
+        return entry;
+    }
+
+    atomic_fetch_add(&cache->misses, 1);
+    entry = GROW_ARRAY(CacheEntry, NULL, 0, 1);
+    initChunk(&entry->chunk);
+    entry->length = length;
+    entry->source = GROW_ARRAY(char, NULL, 0, length);
+    memcpy(entry->source, source, length);
+
+    if (!compile(entry->source, length, &entry->chunk)) {
+        freeEntry(entry);
+        return NULL;
+    }
+
+    entry->hash = hash;
+    entry->size = entrySize(entry);
+    entry->refs = 2;
+    entry->lastUsed = cache->clock++;
+
+    WRITE_LOCK(cache);
+    if (cache->count + 1 > cache->bucketCount * 3 / 4) growBuckets(cache);
+
+    CacheEntry** bucket = &cache->buckets[hash & (uint64_t)(cache->bucketCount - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    cache->count++;
+    cache->bytes += entry->size;
+
+    // An entry larger than the whole budget is evicted as well
+    evictEntries(cache);
+    UNLOCK(cache);
+
+    return entry;
+}
+
+
+void releaseChunk(ChunkCache* cache, CacheEntry* entry) {
+    (void)cache;
+    if (--entry->refs == 0) freeEntry(entry);
+}
+
+
+ChunkCacheStats chunkCacheStats(ChunkCache* cache) {
+    ChunkCacheStats stats;
+    stats.hits = atomic_load(&cache->hits);
+    stats.misses = atomic_load(&cache->misses);
+    stats.evictions = atomic_load(&cache->evictions);
+
+    READ_LOCK(cache);
+    stats.count = cache->count;
+    stats.bytes = cache->bytes;
+    UNLOCK(cache);
+    return stats;
+}
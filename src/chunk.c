@@ -1,6 +1,7 @@
 #include <stdlib.h>
 
 #include "chunk.h"
+#include "jit.h"
 #include "memory.h"
 
 // initialize the chunk with empty array
@@ -9,6 +10,11 @@ void initChunk(Chunk* chunk) {
     chunk->capacity = 0;        // No memory allocated yet
     chunk->code = NULL;         // Code array not initialized
     chunk->lines = NULL;
+    chunk->quickened = 0;
+    chunk->loops = NULL;
+    chunk->loopCount = 0;
+    chunk->loopCapacity = 0;
+    chunk->jit = NULL;
     initValueArray(&chunk->constants);
 }
 
@@ -16,6 +22,8 @@ void initChunk(Chunk* chunk) {
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(LoopProfile, chunk->loops, chunk->loopCapacity);
+    jitFree(chunk);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -67,4 +75,27 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 int addConstant(Chunk* chunk, Value value) {
     writeValueArray(&chunk->constants, value);
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+
+// Registers a loop starting at 'header' and returns its profile index.
+int addLoop(Chunk* chunk, int header, int line) {
+    if (chunk->loopCapacity < chunk->loopCount + 1) {
+        int oldCapacity = chunk->loopCapacity;
+        chunk->loopCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->loops = GROW_ARRAY(LoopProfile, chunk->loops,
+                                  oldCapacity, chunk->loopCapacity);
+    }
+
+    chunk->loops[chunk->loopCount] = (LoopProfile){header, line, 0};
+    return chunk->loopCount++;
+}
+
+
+void truncateChunk(Chunk* chunk, int count, int constantCount, int loopCount) {
+    chunk->count = count;
+    chunk->constants.count = constantCount;
+    chunk->loopCount = loopCount;
+    if (count == 0) chunk->quickened = 0;
+    jitFree(chunk);
+}
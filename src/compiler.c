@@ -4,9 +4,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "metrics.h"
+#include "number.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -37,7 +41,17 @@ typedef enum {
 } Precedence;
 
 
-typedef void (*ParseFn)();
+// Static type of a value on the VM stack, as far as the compiler can prove it
+typedef enum {
+    TYPE_UNKNOWN,
+    TYPE_NUMBER,        // a double
+    TYPE_INT,
+    TYPE_BOOL,
+    TYPE_NIL,
+} StaticType;
+
+
+typedef void (*ParseFn)(bool canAssign);
 
 typedef struct {
     ParseFn prefix;
@@ -49,12 +63,47 @@ typedef struct {
 } ParseRule;
 
 
+// A local variable: a named slot on the VM stack
+typedef struct {
+    Token name;
+    int depth;      // scope depth, -1 while its initializer is compiled
+} Local;
+
+// One per function being compiled, innermost in 'current'
+typedef struct Compiler {
+    struct Compiler* enclosing;
+    ObjFunction* function;  // NULL for the top-level script (or expression)
+    int typeBase;           // slotTypeCount when the function started
+
+    Local locals[UINT8_COUNT];
+    int localCount;
+    int scopeDepth;     // 0 at the top level, where variables are globals
+    int lastCall;       // offset of the last OP_CALL in this chunk, -1: none
+} Compiler;
+
+
 Parser parser;
+Compiler* current = NULL;
+
+// compile() compiles statements, compileColumns() a single expression
+bool scriptMode;
+
+Chunk* compilingChunk = NULL;
 
-Chunk* compilingChunk;
+// Input columns that identifiers refer to (see compileColumns())
+const char* const* columnNames;
+int columnCount;
+
+// Pre-tokenized input (see compileTokens()), or NULL to scan on demand
+const TokenStream* tokenStream;
+int nextToken;
+
+// Compile-time mirror of the VM stack: the static type of each slot
+StaticType slotTypes[STACK_MAX];
+int slotTypeCount;
 
 static Chunk* currentChunk() {
-    return compilingChunk;
+    return current->function != NULL ? &current->function->chunk : compilingChunk;
 }
 
 
@@ -109,7 +158,9 @@ static void advance() {
     parser.previous = parser.current;
 
     for (;;) {
-        parser.current = scanToken();
+        parser.current = tokenStream != NULL
+            ? streamToken(tokenStream, nextToken++)
+            : scanToken();
 
         // Break the loop if we successfully scanned a valid token
         if (parser.current.type != TOKEN_ERROR) break;
@@ -145,6 +196,19 @@ static void consume(TokenType type, const char* message) {
 }
 
 
+static bool check(TokenType type) {
+    return parser.current.type == type;
+}
+
+
+// Consumes the current token if it has the given type.
+static bool match(TokenType type) {
+    if (!check(type)) return false;
+    advance();
+    return true;
+}
+
+
 /*
 #####################################
 Emitting Bytecode
@@ -166,6 +230,44 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
 }
 
 
+// Emits a jump with a placeholder offset, and returns the offset's position
+// so that patchJump() can fill it in once the target is known.
+static int emitJump(uint8_t instruction) {
+    emitByte(instruction);
+    emitByte(0xff);
+    emitByte(0xff);
+    return currentChunk()->count - 2;
+}
+
+
+// Points the jump at 'offset' to the next instruction to be emitted.
+static void patchJump(int offset) {
+    // -2 to adjust for the jump offset itself
+    int jump = currentChunk()->count - offset - 2;
+
+    if (jump > UINT16_MAX) {
+        error("Too much code to jump over.");
+    }
+
+    currentChunk()->code[offset] = (jump >> 8) & 0xff;
+    currentChunk()->code[offset + 1] = jump & 0xff;
+}
+
+
+// Emits a backward jump to 'loopStart', counted in the loop's profile.
+static void emitLoop(int loopStart, int loop) {
+    emitByte(OP_LOOP);
+
+    // +3 to also jump back over the operands
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset > UINT16_MAX) error("Loop body too large.");
+
+    emitByte((offset >> 8) & 0xff);
+    emitByte(offset & 0xff);
+    emitByte((uint8_t)loop);
+}
+
+
 // Emits the OP_RETURN instruction (tells the VM to return from the function).
 static void emitReturn() {
     emitByte(OP_RETURN);
@@ -174,6 +276,8 @@ static void emitReturn() {
 
 // Adds value to the constant table
 static uint8_t makeConstant(Value value) {
+    // The function being compiled may be old already
+    if (current->function != NULL) writeBarrier((Obj*)current->function, value);
     int constant = addConstant(currentChunk(), value);
 
     if (constant > UINT8_MAX) {
@@ -185,15 +289,52 @@ static uint8_t makeConstant(Value value) {
 }
 
 
+/*
+#####################################
+Static type inference
+#####################################
+*/
+
+// Records the static type of the value the emitted code just pushed.
+static void pushType(StaticType type) {
+    // Slots beyond the VM stack limit are simply not tracked
+    if (slotTypeCount < STACK_MAX) slotTypes[slotTypeCount] = type;
+    slotTypeCount++;
+}
+
+// Forgets the topmost slot and returns its static type.
+static StaticType popType() {
+    if (slotTypeCount == 0) return TYPE_UNKNOWN;    // only after a syntax error
+    slotTypeCount--;
+    return slotTypeCount < STACK_MAX ? slotTypes[slotTypeCount] : TYPE_UNKNOWN;
+}
+
+static StaticType typeOf(Value value) {
+    switch (value.type) {
+        case VAL_BOOL:   return TYPE_BOOL;
+        case VAL_NIL:    return TYPE_NIL;
+        case VAL_NUMBER: return TYPE_NUMBER;
+        case VAL_INT:    return TYPE_INT;
+        default:         return TYPE_UNKNOWN;
+    }
+}
+
+
 static void emitConstant(Value value) {
     emitBytes(OP_CONSTANT, makeConstant(value));
+    pushType(typeOf(value));
 }
 
 
 // Called at the end of compilation to finish the function.
 // Emits a return instruction so the VM knows when to stop executing.
 static void endCompiler() {
+    // Scripts leave nothing behind; an expression returns its value
+    if (scriptMode) emitByte(OP_NIL);
     emitReturn();
+    if (!parser.hadError) {
+        observeChunk(currentChunk()->count, currentChunk()->constants.count);
+    }
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
@@ -203,6 +344,51 @@ static void endCompiler() {
 }
 
 
+/* @note
+ * Slot 0 of every function holds the callee itself, and the arguments
+ * follow it: that is exactly how OP_CALL finds them on the stack.
+ * */
+static void initCompiler(Compiler* compiler, ObjFunction* function) {
+    compiler->enclosing = current;
+    compiler->function = function;
+    compiler->typeBase = slotTypeCount;
+    compiler->localCount = 0;
+    compiler->scopeDepth = 0;
+    compiler->lastCall = -1;
+    current = compiler;
+
+    Local* local = &current->locals[current->localCount++];
+    local->depth = 0;
+    local->name.start = "";
+    local->name.length = 0;
+    pushType(TYPE_UNKNOWN);
+}
+
+
+// Finishes the innermost function and returns to the enclosing compiler.
+static ObjFunction* endFunction() {
+    // Falling off the end of a function returns nil
+    emitByte(OP_NIL);
+    emitReturn();
+    ObjFunction* function = current->function;
+    if (!parser.hadError) {
+        observeChunk(currentChunk()->count, currentChunk()->constants.count);
+    }
+
+#ifdef DEBUG_PRINT_CODE
+    if (!parser.hadError) {
+        char name[64];
+        snprintf(name, sizeof(name), "%.*s", function->nameLength, function->name);
+        disassembleChunk(currentChunk(), name);
+    }
+#endif
+
+    slotTypeCount = current->typeBase;
+    current = current->enclosing;
+    return function;
+}
+
+
 /*
 #############################
 Parsing expressions
@@ -216,7 +402,8 @@ static void parsePrecedence(Precedence precedence);
 
 
 // infix parser for binary operations
-static void binary() {
+static void binary(bool canAssign) {
+    (void)canAssign;
     TokenType operatorType = parser.previous.type;
 
     // get the parsing rule to find precedence level of this operation
@@ -225,61 +412,309 @@ static void binary() {
     // parse the right-hand operand with higher precedence (to bind tightly)
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    // When both operands are proven doubles, the unchecked form can be used.
+    // Int operands go through the generic (quickening) path, which handles
+    // overflow promotion.
+    StaticType right = popType();
+    StaticType left = popType();
+    bool numbers = left == TYPE_NUMBER && right == TYPE_NUMBER;
+
     // Emit the corresponding bytecode instruction for the binary operator
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-
-        case TOKEN_PLUS:          emitByte(OP_ADD); break;
-        case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+        case TOKEN_GREATER:
+            emitByte(numbers ? OP_GREATER_UNCHECKED : OP_GREATER);
+            break;
+        case TOKEN_GREATER_EQUAL:
+            emitBytes(numbers ? OP_LESS_UNCHECKED : OP_LESS, OP_NOT);
+            break;
+        case TOKEN_LESS:
+            emitByte(numbers ? OP_LESS_UNCHECKED : OP_LESS);
+            break;
+        case TOKEN_LESS_EQUAL:
+            emitBytes(numbers ? OP_GREATER_UNCHECKED : OP_GREATER, OP_NOT);
+            break;
+
+        case TOKEN_PLUS:
+            emitByte(numbers ? OP_ADD_UNCHECKED : OP_ADD);
+            break;
+        case TOKEN_MINUS:
+            emitByte(numbers ? OP_SUBTRACT_UNCHECKED : OP_SUBTRACT);
+            break;
+        case TOKEN_STAR:
+            emitByte(numbers ? OP_MULTIPLY_UNCHECKED : OP_MULTIPLY);
+            break;
+        case TOKEN_SLASH:
+            emitByte(numbers ? OP_DIVIDE_UNCHECKED : OP_DIVIDE);
+            break;
         default: return; // Unreachable.
     }
+
+    // Comparisons always produce a bool. Arithmetic with a double operand
+    // either produces a double or raises a runtime error. Int arithmetic may
+    // overflow into a double, so its result type is not known statically.
+    switch (operatorType) {
+        case TOKEN_PLUS:
+        case TOKEN_MINUS:
+        case TOKEN_STAR:
+        case TOKEN_SLASH:
+            pushType(left == TYPE_NUMBER || right == TYPE_NUMBER
+                ? TYPE_NUMBER : TYPE_UNKNOWN);
+            break;
+        default:
+            pushType(TYPE_BOOL);
+            break;
+    }
 }
 
 
 
-static void literal() {
+// The value of a short-circuited and/or is one of its operands
+static void mergeTypes(StaticType left) {
+    StaticType right = popType();
+    pushType(left == right ? left : TYPE_UNKNOWN);
+}
+
+
+/* @note
+ * 'a and b': if a is falsey it is the result and b is skipped, otherwise a is
+ * popped and b is the result. The left operand is already on the stack.
+ * */
+static void and_(bool canAssign) {
+    (void)canAssign;
+    int endJump = emitJump(OP_JUMP_IF_FALSE);
+
+    emitByte(OP_POP);
+    StaticType left = popType();
+    parsePrecedence(PREC_AND);
+
+    patchJump(endJump);
+    mergeTypes(left);
+}
+
+
+// 'a or b': a is the result if it is truthy, otherwise b.
+static void or_(bool canAssign) {
+    (void)canAssign;
+    int endJump = emitJump(OP_JUMP_IF_TRUE);
+
+    emitByte(OP_POP);
+    StaticType left = popType();
+    parsePrecedence(PREC_OR);
+
+    patchJump(endJump);
+    mergeTypes(left);
+}
+
+
+
+static void literal(bool canAssign) {
+    (void)canAssign;
     switch (parser.previous.type) {
-        case TOKEN_FALSE:   emitByte(OP_FALSE); break;
-        case TOKEN_NIL:     emitByte(OP_NIL); break;
-        case TOKEN_TRUE:    emitByte(OP_TRUE); break;
+        case TOKEN_FALSE:   emitByte(OP_FALSE); pushType(TYPE_BOOL); break;
+        case TOKEN_NIL:     emitByte(OP_NIL); pushType(TYPE_NIL); break;
+        case TOKEN_TRUE:    emitByte(OP_TRUE); pushType(TYPE_BOOL); break;
         default: return;    // Unreachable.
     }
 }
 
 
 // compiling groupings
-static void grouping() {
+static void grouping(bool canAssign) {
+    (void)canAssign;
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 
 // compiling number literals
-static void number() {
+static void number(bool canAssign) {
+    (void)canAssign;
+    const char* start = parser.previous.start;
+    int length = parser.previous.length;
+
+    // Literals without a fractional part are ints, unless they overflow int64_t
+    if (memchr(start, '.', length) == NULL) {
+        int64_t value = 0;
+        bool overflow = false;
+        for (int i = 0; i < length && !overflow; i++) {
+            overflow = __builtin_mul_overflow(value, 10, &value) ||
+                       __builtin_add_overflow(value, start[i] - '0', &value);
+        }
+
+        if (!overflow) {
+            emitConstant(INT_VAL(value));
+            return;
+        }
+    }
 
-    double value = strtod(parser.previous.start, NULL);     // converts string into double value.
+    double value = parseDouble(start, length);
     emitConstant(NUMBER_VAL(value));
 }
 
 
+// compiling references to input columns (compileColumns() only)
+static void column(Token* name) {
+    for (int i = 0; i < columnCount; i++) {
+        if ((int)strlen(columnNames[i]) == name->length &&
+            memcmp(columnNames[i], name->start, name->length) == 0) {
+            emitBytes(OP_GET_COLUMN, (uint8_t)i);
+            pushType(TYPE_NUMBER);      // columns hold doubles
+            return;
+        }
+    }
+
+    error("Unknown column.");
+    pushType(TYPE_UNKNOWN);
+}
+
+
+static bool identifiersEqual(Token* a, Token* b) {
+    return a->length == b->length && memcmp(a->start, b->start, a->length) == 0;
+}
+
+
+// Stack slot of the innermost local with this name, or -1 for a global
+static int resolveLocal(Compiler* compiler, Token* name) {
+    for (int i = compiler->localCount - 1; i >= 0; i--) {
+        Local* local = &compiler->locals[i];
+        if (identifiersEqual(name, &local->name)) {
+            if (local->depth == -1) {
+                error("Can't read local variable in its own initializer.");
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+// Binds a global variable's name to its slot in the VM's global table
+static uint8_t globalVariable(Token* name) {
+    int slot = globalSlot(name->start, name->length);
+    if (slot < 0) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint8_t)slot;
+}
+
+
+static uint8_t argumentList() {
+    uint8_t argCount = 0;
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            expression();
+            if (argCount == UINT8_MAX) {
+                error("Can't have more than 255 arguments.");
+            }
+            argCount++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return argCount;
+}
+
+
+/* @note
+ * A call of a native is bound to the native's index right away. There is
+ * no callee on the stack: the arguments alone are pushed, and the native
+ * gets a pointer to them.
+ * */
+static void nativeCall(int native) {
+    advance();      // the '('
+    uint8_t argCount = argumentList();
+
+    int arity = vm.natives.arities[native];
+    if (arity >= 0 && argCount != arity) {
+        char message[64];
+        snprintf(message, sizeof(message), "Expected %d arguments but got %d.",
+                 arity, argCount);
+        error(message);
+    }
+    emitBytes(OP_CALL_NATIVE, (uint8_t)native);
+    emitByte(argCount);
+
+    for (int i = 0; i < argCount; i++) popType();
+    pushType(TYPE_UNKNOWN);
+}
+
+
+static void namedVariable(Token name, bool canAssign) {
+    uint8_t getOp, setOp;
+    int arg = resolveLocal(current, &name);
+
+    // Locals shadow natives, natives shadow globals (and columns)
+    int native = -1;
+    if (arg == -1 && check(TOKEN_LEFT_PAREN)) native = nativeSlot(name.start, name.length);
+
+    if (native != -1) {
+        nativeCall(native);
+        return;
+    } else if (arg != -1) {
+        getOp = OP_GET_LOCAL;
+        setOp = OP_SET_LOCAL;
+    } else if (!scriptMode) {
+        column(&name);
+        return;
+    } else {
+        arg = globalVariable(&name);
+        getOp = OP_GET_GLOBAL;
+        setOp = OP_SET_GLOBAL;
+    }
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();   // the assigned value stays on the stack, as does its type
+        emitBytes(setOp, (uint8_t)arg);
+    } else {
+        emitBytes(getOp, (uint8_t)arg);
+        // A variable can be reassigned to any type (also later in a loop)
+        pushType(TYPE_UNKNOWN);
+    }
+}
+
+
+static void variable(bool canAssign) {
+    namedVariable(parser.previous, canAssign);
+}
+
+
+
+
+// The callee is on the stack already, the arguments are pushed after it
+static void call(bool canAssign) {
+    (void)canAssign;
+    uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
+    emitBytes(OP_CALL, argCount);
+
+    // The callee and its arguments become the returned value
+    for (int i = 0; i <= argCount; i++) popType();
+    pushType(TYPE_UNKNOWN);
+}
+
+
 // compiling unary expression
-static void unary() {
+static void unary(bool canAssign) {
+    (void)canAssign;
     TokenType operatorType = parser.previous.type;  // for the '-' part
 
-    // Compile the operand.
-    expression();
+    // Compile the operand (only: '-a + b' negates just a).
+    parsePrecedence(PREC_UNARY);
+    StaticType operand = popType();
 
     // Emit the operator instruction.
     switch (operatorType) {
-        case TOKEN_BANG: emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG:
+            emitByte(OP_NOT);
+            pushType(TYPE_BOOL);
+            break;
+        case TOKEN_MINUS:
+            emitByte(operand == TYPE_NUMBER ? OP_NEGATE_UNCHECKED : OP_NEGATE);
+            // Negating INT64_MIN promotes to a double
+            pushType(operand == TYPE_NUMBER ? TYPE_NUMBER : TYPE_UNKNOWN);
+            break;
         default: return;    // Unreachable.
     }
 }
@@ -289,7 +724,7 @@ static void unary() {
  * An array of ParseRule structures that define the parsing rules for the compiler.
  */
 ParseRule rules[] = {
-  [TOKEN_LEFT_PAREN]    = {grouping, NULL,   PREC_NONE},
+  [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
   [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE}, 
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
@@ -308,10 +743,10 @@ ParseRule rules[] = {
   [TOKEN_GREATER_EQUAL] = {NULL,     binary, PREC_COMPARISON},
   [TOKEN_LESS]          = {NULL,     binary, PREC_COMPARISON},
   [TOKEN_LESS_EQUAL]    = {NULL,     binary, PREC_COMPARISON},
-  [TOKEN_IDENTIFIER]    = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE},
   [TOKEN_STRING]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
-  [TOKEN_AND]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
   [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE},
@@ -319,7 +754,7 @@ ParseRule rules[] = {
   [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
   [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE},
-  [TOKEN_OR]            = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_SUPER]         = {NULL,     NULL,   PREC_NONE},
@@ -353,13 +788,20 @@ static void parsePrecedence(Precedence precedence) {
         return;
     }
 
-    prefixRule();   // parse the prefix part (like number, variable, or grouping)
+    // Only a variable at the lowest precedence can be assigned: 'a * b = c'
+    // must not compile as 'a * (b = c)'
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    prefixRule(canAssign);  // parse the prefix part (like number, variable, or grouping)
 
     // Keep parsing infix expression as long as their precedence is >= current level
     while (precedence <= getRule(parser.current.type)->precedence) {
         advance();      // consume the infix operator
         ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule();    // parse the infix operation (e.g. +, -. *. /)
+        infixRule(canAssign);   // parse the infix operation (e.g. +, -. *. /)
+    }
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        error("Invalid assignment target.");
     }
 }
 
@@ -377,6 +819,408 @@ static void expression() {
 
 
 
+/*
+#####################################
+Statements
+#####################################
+*/
+
+static void statement();
+static void declaration();
+static void block();
+
+
+static void beginScope() {
+    current->scopeDepth++;
+}
+
+// Pops the locals of the scope that ends, along with their static types.
+static void endScope() {
+    current->scopeDepth--;
+
+    while (current->localCount > 0 &&
+           current->locals[current->localCount - 1].depth > current->scopeDepth) {
+        emitByte(OP_POP);
+        popType();
+        current->localCount--;
+    }
+}
+
+
+static void addLocal(Token name) {
+    if (current->localCount == UINT8_COUNT) {
+        error("Too many local variables in scope.");
+        return;
+    }
+
+    Local* local = &current->locals[current->localCount++];
+    local->name = name;
+    local->depth = -1;      // declared, but not usable until initialized
+}
+
+
+static void declareLocal() {
+    Token* name = &parser.previous;
+    for (int i = current->localCount - 1; i >= 0; i--) {
+        Local* local = &current->locals[i];
+        if (local->depth != -1 && local->depth < current->scopeDepth) break;
+
+        if (identifiersEqual(name, &local->name)) {
+            error("Already a variable with this name in this scope.");
+        }
+    }
+    addLocal(*name);
+}
+
+
+/* @note
+ * A global is bound to its slot in the VM's global table at compile time, so
+ * reading it at run time is a plain index. A local simply stays on the stack
+ * where its initializer left it (its static type too).
+ * */
+static void markInitialized() {
+    if (current->scopeDepth == 0) return;
+    current->locals[current->localCount - 1].depth = current->scopeDepth;
+}
+
+
+// Binds the value on top of the stack to the variable just declared.
+static void defineVariable(Token* name) {
+    if (current->scopeDepth > 0) {
+        markInitialized();
+        // Its type may change with any later assignment
+        popType();
+        pushType(TYPE_UNKNOWN);
+        return;
+    }
+
+    // Calls would reach the native, never this global
+    if (nativeSlot(name->start, name->length) != -1) {
+        errorAt(name, "Already a native function with this name.");
+    }
+    emitBytes(OP_DEFINE_GLOBAL, globalVariable(name));
+    popType();
+}
+
+
+static void varDeclaration() {
+    consume(TOKEN_IDENTIFIER, "Expect variable name.");
+    Token name = parser.previous;
+    if (current->scopeDepth > 0) declareLocal();
+
+    if (match(TOKEN_EQUAL)) {
+        expression();
+    } else {
+        emitByte(OP_NIL);
+        pushType(TYPE_NIL);
+    }
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    defineVariable(&name);
+}
+
+
+// Compiles a function's parameters and body, and pushes the function.
+static void function(Token* name) {
+    Compiler compiler;
+    initCompiler(&compiler, newFunction(name->start, name->length));
+    beginScope();
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            current->function->arity++;
+            if (current->function->arity > UINT8_MAX) {
+                errorAtCurrent("Can't have more than 255 parameters.");
+            }
+            consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+            declareLocal();
+            markInitialized();
+            pushType(TYPE_UNKNOWN);     // arguments can be anything
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block();
+
+    // No endScope(): returning discards the function's slots at once
+    ObjFunction* function = endFunction();
+    emitConstant(OBJ_VAL(function));
+}
+
+
+static void funDeclaration() {
+    consume(TOKEN_IDENTIFIER, "Expect function name.");
+    Token name = parser.previous;
+    if (current->scopeDepth > 0) {
+        declareLocal();
+        markInitialized();      // the body may call the function itself
+    }
+
+    function(&name);
+    defineVariable(&name);
+}
+
+
+// A trailing expression without ';' at the end of a script is printed,
+// so 'mavix -c "1 + 2"' style one-liners keep working.
+static void expressionStatement() {
+    expression();
+    if (current->scopeDepth == 0 && check(TOKEN_EOF)) {
+        emitByte(OP_PRINT);
+    } else {
+        consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+        emitByte(OP_POP);
+    }
+    popType();
+}
+
+
+static void returnStatement() {
+    if (current->function == NULL) {
+        error("Can't return from top-level code.");
+    }
+
+    if (match(TOKEN_SEMICOLON)) {
+        emitByte(OP_NIL);
+        emitReturn();
+        return;
+    }
+
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+    /* @note
+     * A call that is the last instruction before the return is in tail
+     * position: its result would only be handed on. Jumps of an and/or
+     * around it land on the return as well, so 'return a and f(x);' is a
+     * tail call too.
+     * */
+    Chunk* chunk = currentChunk();
+    int call = current->lastCall;
+    if (current->function != NULL && call >= 0 && call == chunk->count - 2 &&
+        chunk->code[call] == OP_CALL) {
+        chunk->code[call] = OP_TAIL_CALL;
+    }
+    emitReturn();
+    popType();
+}
+
+
+static void printStatement() {
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(OP_PRINT);
+    popType();
+}
+
+
+static void block() {
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        declaration();
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+
+// Compiles a condition whose value the next conditional jump tests, and
+// forgets its static type (the jump's branches pop it).
+static void condition() {
+    expression();
+    popType();
+}
+
+
+static void ifStatement() {
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    condition();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int thenJump = emitJump(OP_JUMP_IF_FALSE);
+    emitByte(OP_POP);
+    statement();
+
+    int elseJump = emitJump(OP_JUMP);
+    patchJump(thenJump);
+    emitByte(OP_POP);
+
+    if (match(TOKEN_ELSE)) statement();
+    patchJump(elseJump);
+}
+
+
+// Registers a loop in the chunk's profile; its index is OP_LOOP's operand.
+static int beginLoop(int header, int line) {
+    int loop = addLoop(currentChunk(), header, line);
+    if (loop > UINT8_MAX) error("Too many loops in one chunk.");
+    return loop;
+}
+
+
+static void whileStatement() {
+    int line = parser.previous.line;
+    int loopStart = currentChunk()->count;
+    int loop = beginLoop(loopStart, line);
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    condition();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int exitJump = emitJump(OP_JUMP_IF_FALSE);
+    emitByte(OP_POP);
+    statement();
+    emitLoop(loopStart, loop);
+
+    patchJump(exitJump);
+    emitByte(OP_POP);
+}
+
+
+/* @note
+ * The increment is compiled where it appears, then cut out of the chunk and
+ * appended again after the body. Every iteration thus runs exactly one
+ * OP_LOOP (the back-edge whose counter is the loop's iteration count)
+ * instead of bouncing through the increment with a second backward jump.
+ * Its jumps, if any, are relative and move along with it.
+ * */
+static void forStatement() {
+    int line = parser.previous.line;
+    beginScope();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(TOKEN_SEMICOLON)) {
+        // No initializer
+    } else if (match(TOKEN_VAR)) {
+        varDeclaration();
+    } else {
+        expression();
+        consume(TOKEN_SEMICOLON, "Expect ';'.");
+        emitByte(OP_POP);
+        popType();
+    }
+
+    Chunk* chunk = currentChunk();
+    int loopStart = chunk->count;
+    int loop = beginLoop(loopStart, line);
+
+    int exitJump = -1;
+    if (!match(TOKEN_SEMICOLON)) {
+        condition();
+        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+        exitJump = emitJump(OP_JUMP_IF_FALSE);
+        emitByte(OP_POP);
+    }
+
+    uint8_t* increment = NULL;
+    int* incrementLines = NULL;
+    int incrementCount = 0;
+    if (!match(TOKEN_RIGHT_PAREN)) {
+        int incrementStart = chunk->count;
+        expression();
+        emitByte(OP_POP);
+        popType();
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+        incrementCount = chunk->count - incrementStart;
+        increment = GROW_ARRAY(uint8_t, NULL, 0, incrementCount);
+        incrementLines = GROW_ARRAY(int, NULL, 0, incrementCount);
+        memcpy(increment, chunk->code + incrementStart, incrementCount);
+        memcpy(incrementLines, chunk->lines + incrementStart,
+               incrementCount * sizeof(int));
+        chunk->count = incrementStart;
+    }
+
+    statement();
+
+    // The body may have declared functions, and collecting garbage for
+    // them may have moved the function this chunk belongs to
+    chunk = currentChunk();
+    for (int i = 0; i < incrementCount; i++) {
+        writeChunk(chunk, increment[i], incrementLines[i]);
+    }
+    FREE_ARRAY(uint8_t, increment, incrementCount);
+    FREE_ARRAY(int, incrementLines, incrementCount);
+    emitLoop(loopStart, loop);
+
+    if (exitJump != -1) {
+        patchJump(exitJump);
+        emitByte(OP_POP);
+    }
+    endScope();
+}
+
+
+// Skips tokens until a statement boundary, so one error is reported per statement.
+static void synchronize() {
+    parser.panicMode = false;
+
+    while (parser.current.type != TOKEN_EOF) {
+        if (parser.previous.type == TOKEN_SEMICOLON) return;
+        switch (parser.current.type) {
+            case TOKEN_CLASS:
+            case TOKEN_FUN:
+            case TOKEN_VAR:
+            case TOKEN_FOR:
+            case TOKEN_IF:
+            case TOKEN_WHILE:
+            case TOKEN_PRINT:
+            case TOKEN_RETURN:
+                return;
+            default:
+                ;   // Do nothing
+        }
+        advance();
+    }
+}
+
+
+static void statement() {
+    if (match(TOKEN_PRINT)) {
+        printStatement();
+    } else if (match(TOKEN_RETURN)) {
+        returnStatement();
+    } else if (match(TOKEN_IF)) {
+        ifStatement();
+    } else if (match(TOKEN_WHILE)) {
+        whileStatement();
+    } else if (match(TOKEN_FOR)) {
+        forStatement();
+    } else if (match(TOKEN_LEFT_BRACE)) {
+        beginScope();
+        block();
+        endScope();
+    } else {
+        expressionStatement();
+    }
+}
+
+
+static void declaration() {
+    if (match(TOKEN_FUN)) {
+        funDeclaration();
+    } else if (match(TOKEN_VAR)) {
+        varDeclaration();
+    } else {
+        statement();
+    }
+
+    if (parser.panicMode) synchronize();
+}
+
+
+
+static bool compileChunk(const char* const* names, int count, Chunk* chunk, bool script);
+
+
+// Counts a compilation that started at 'start' (see metricClock())
+static bool countCompile(bool compiled, uint64_t start) {
+    countMetric(METRIC_COMPILES, 1);
+    if (!compiled) countMetric(METRIC_COMPILE_ERRORS, 1);
+    countMetric(METRIC_COMPILE_NS, metricClock() - start);
+    return compiled;
+}
+
+
 /**
  * @brief Compiles the given source code into a chunk of bytecode.
  *
@@ -385,22 +1229,124 @@ static void expression() {
  * source code. The compilation process involves lexical analysis, 
  * parsing, and code generation.
  *
- * @param source The source code to be compiled.
+ * @param source The source code to be compiled (not necessarily NUL-terminated).
+ * @param length The length of the source in bytes.
  * @param chunk A pointer to the Chunk structure where the compiled 
  *              bytecode will be stored.
  * @return true if the compilation was successful, false otherwise.
  */
-bool compile(const char* source, Chunk* chunk) {
-    initScanner(source);
+bool compile(const char* source, size_t length, Chunk* chunk) {
+    uint64_t start = metricClock();
+    if (length < PRETOKENIZE_THRESHOLD) {
+        initScanner(source, length);
+        return countCompile(compileChunk(NULL, 0, chunk, true), start);
+    }
+
+    // Large sources are scanned in one pass before parsing
+    TokenStream tokens;
+    initTokenStream(&tokens);
+    bool scanned = length >= PARALLEL_SCAN_THRESHOLD
+        ? tokenizeParallel(source, length, 0, &tokens)
+        : tokenize(source, length, &tokens);
+    bool compiled;
+    if (scanned) {
+        compiled = compileTokens(&tokens, chunk);
+    } else {
+        initScanner(source, length);
+        compiled = compileChunk(NULL, 0, chunk, true);
+    }
+    freeTokenStream(&tokens);
+    return countCompile(compiled, start);
+}
+
+
+// Compiles a script, or an expression whose identifiers name columns
+static bool compileChunk(const char* const* names, int count, Chunk* chunk, bool script) {
+    if (count > UINT8_MAX + 1) {
+        fprintf(stderr, "Too many input columns.\n");
+        return false;
+    }
+
+    columnNames = names;
+    columnCount = count;
+    scriptMode = script;
+
+    Compiler compiler;
+    compiler.enclosing = NULL;
+    compiler.function = NULL;
+    compiler.typeBase = 0;
+    compiler.localCount = 0;
+    compiler.scopeDepth = 0;
+    compiler.lastCall = -1;
+    current = &compiler;
+
     compilingChunk = chunk;     // Initializes the Chunk (for writing bytecode)
 
     parser.hadError = false;
     parser.panicMode = false;
+    slotTypeCount = 0;
 
     advance();
-    expression();
-    consume(TOKEN_EOF, "Expect end of expression.");
+    if (script) {
+        while (!match(TOKEN_EOF)) {
+            declaration();
+        }
+    } else {
+        expression();
+        consume(TOKEN_EOF, "Expect end of expression.");
+    }
     endCompiler();
+    current = NULL;
+    compilingChunk = NULL;
 
     return !parser.hadError;
 }
+
+
+/**
+ * @brief Compiles source code that was already tokenized with tokenize().
+ *
+ * The parser reads the token arrays in order instead of calling the scanner.
+ *
+ * @param tokens The token stream. It must outlive the compilation only.
+ * @param chunk A pointer to the Chunk the bytecode will be written to.
+ * @return true if the compilation was successful, false otherwise.
+ */
+bool compileTokens(const TokenStream* tokens, Chunk* chunk) {
+    tokenStream = tokens;
+    nextToken = 0;
+
+    bool compiled = compileChunk(NULL, 0, chunk, true);
+    tokenStream = NULL;
+    return compiled;
+}
+
+
+/**
+ * @brief Compiles an expression evaluated over rows of input columns.
+ *
+ * Identifiers in the expression refer to the columns by name and compile to
+ * OP_GET_COLUMN with the column's index, which the VM (or the batch executor)
+ * reads from its current input row.
+ *
+ * @param source The source code to be compiled.
+ * @param length The length of the source in bytes.
+ * @param names The column names, indexed like the columns passed at run time.
+ * @param count Number of columns (at most UINT8_MAX + 1).
+ * @param chunk A pointer to the Chunk the bytecode will be written to.
+ * @return true if the compilation was successful, false otherwise.
+ */
+bool compileColumns(const char* source, size_t length,
+                    const char* const* names, int count, Chunk* chunk) {
+    uint64_t start = metricClock();
+    initScanner(source, length);
+    return countCompile(compileChunk(names, count, chunk, false), start);
+}
+
+
+void markCompilerRoots() {
+    if (compilingChunk != NULL) markChunk(compilingChunk);
+    for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+        markObject((Obj**)&compiler->function);
+    }
+}
@@ -2,6 +2,7 @@
 
 #include "debug.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("==== %s ====\n", name);
@@ -21,6 +22,43 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
 }
 
 
+// Instructions with a single one-byte operand that is not a constant index
+static int byteInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t operand = chunk->code[offset + 1];
+    printf("%-16s %4d\n", name, operand);
+    return offset + 2;
+}
+
+
+// Jumps print their offset and the target: 'sign' is the jump's direction
+static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    return offset + 3;
+}
+
+
+// OP_LOOP jumps back and also names the loop whose counter it bumps
+static int loopInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    uint8_t loop = chunk->code[offset + 3];
+    printf("%-16s %4d -> %d (loop %d)\n", name, offset, offset + 4 - jump, loop);
+    return offset + 4;
+}
+
+
+// OP_CALL_NATIVE names the native and its argument count
+static int nativeInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t native = chunk->code[offset + 1];
+    uint8_t argCount = chunk->code[offset + 2];
+    printf("%-16s %4d '%s' (%d args)\n", name, native,
+           vm.natives.names[native], argCount);
+    return offset + 3;
+}
+
+
 static int simpleInstruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;  // Increment the offset with each instruction
@@ -66,8 +104,74 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_NOT", offset);
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
+        case OP_GET_COLUMN:
+            return byteInstruction("OP_GET_COLUMN", chunk, offset);
+        case OP_POP:
+            return simpleInstruction("OP_POP", offset);
+        case OP_JUMP:
+            return jumpInstruction("OP_JUMP", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_TRUE:
+            return jumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
+        case OP_LOOP:
+            return loopInstruction("OP_LOOP", chunk, offset);
+        case OP_PRINT:
+            return simpleInstruction("OP_PRINT", offset);
+        case OP_DEFINE_GLOBAL:
+            return byteInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL:
+            return byteInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL:
+            return byteInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_GET_LOCAL:
+            return byteInstruction("OP_GET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL:
+            return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_CALL:
+            return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_CALL_NATIVE:
+            return nativeInstruction("OP_CALL_NATIVE", chunk, offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_GREATER_INT:
+            return simpleInstruction("OP_GREATER_INT", offset);
+        case OP_LESS_INT:
+            return simpleInstruction("OP_LESS_INT", offset);
+        case OP_ADD_INT:
+            return simpleInstruction("OP_ADD_INT", offset);
+        case OP_SUBTRACT_INT:
+            return simpleInstruction("OP_SUBTRACT_INT", offset);
+        case OP_MULTIPLY_INT:
+            return simpleInstruction("OP_MULTIPLY_INT", offset);
+        case OP_GREATER_UNCHECKED:
+            return simpleInstruction("OP_GREATER_UNCHECKED", offset);
+        case OP_LESS_UNCHECKED:
+            return simpleInstruction("OP_LESS_UNCHECKED", offset);
+        case OP_ADD_UNCHECKED:
+            return simpleInstruction("OP_ADD_UNCHECKED", offset);
+        case OP_SUBTRACT_UNCHECKED:
+            return simpleInstruction("OP_SUBTRACT_UNCHECKED", offset);
+        case OP_MULTIPLY_UNCHECKED:
+            return simpleInstruction("OP_MULTIPLY_UNCHECKED", offset);
+        case OP_DIVIDE_UNCHECKED:
+            return simpleInstruction("OP_DIVIDE_UNCHECKED", offset);
+        case OP_NEGATE_UNCHECKED:
+            return simpleInstruction("OP_NEGATE_UNCHECKED", offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
@@ -0,0 +1,514 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "image.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MAVIX_IMAGE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* @note
+ * An image is one block, laid out for IMAGE_BASE: mapped there, every
+ * pointer in it is right as it is and loading costs one mmap(). Should
+ * something else live there already, the image is mapped anywhere and the
+ * pointers listed in its relocation table are moved by the difference.
+ *
+ * Its functions look old and marked to the collector, which therefore
+ * never moves, scans or frees them. They only reference each other, so
+ * nothing in the heap is kept alive through them.
+ * */
+#define IMAGE_BASE 0x500000000000ULL
+#define IMAGE_MAGIC "MAVIXIMG"
+#define IMAGE_VERSION 1
+#define IMAGE_ALIGN 16
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint16_t valueSize;         // the layout the image was made with...
+    uint16_t functionSize;
+    uint32_t opcodeCount;       // ... and the instruction set
+    uint32_t globalCount;
+    uint32_t nativeCount;
+    uint32_t relocationCount;
+    uint64_t base;              // address the pointers are for
+    uint64_t size;              // of the whole image
+    uint64_t globals;           // offset of the ImageGlobals
+    uint64_t natives;           // offset of the ImageNames of the natives
+    uint64_t relocations;       // offset of the pointers' offsets (uint64_t)
+} ImageHeader;
+
+// A name copied out at load time, so it is stored as an offset
+typedef struct {
+    uint64_t name;
+    uint32_t length;
+    uint32_t defined;           // globals only
+} ImageName;
+
+typedef struct {
+    ImageName name;
+    Value value;                // a function is a pointer into the image
+} ImageGlobal;
+
+
+static struct {
+    void* bytes;                // NULL: no image
+    size_t size;
+} image = {NULL, 0};
+
+
+
+/*
+#####################################
+Saving
+#####################################
+*/
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+
+    uint64_t* relocations;
+    size_t relocationCount;
+    size_t relocationCapacity;
+
+    // Functions written so far, and where
+    ObjFunction** functions;
+    uint64_t* offsets;
+    size_t functionCount;
+    size_t functionCapacity;
+} ImageWriter;
+
+
+// Zeroed room for 'size' bytes; the buffer may move, so it returns an offset
+static uint64_t reserve(ImageWriter* writer, size_t size, size_t align) {
+    size_t offset = (writer->count + align - 1) / align * align;
+    if (writer->capacity < offset + size) {
+        size_t oldCapacity = writer->capacity;
+        while (writer->capacity < offset + size) {
+            writer->capacity = GROW_CAPACITY(writer->capacity);
+        }
+        writer->bytes = GROW_ARRAY(uint8_t, writer->bytes, oldCapacity, writer->capacity);
+    }
+    memset(writer->bytes + writer->count, 0, offset + size - writer->count);
+    writer->count = offset + size;
+    return offset;
+}
+
+
+static uint64_t writeBytes(ImageWriter* writer, const void* bytes, size_t size, size_t align) {
+    uint64_t offset = reserve(writer, size, align);
+    if (size > 0) memcpy(writer->bytes + offset, bytes, size);
+    return offset;
+}
+
+
+// Stores the address of 'target' at 'at', and remembers to relocate it
+static void writePointer(ImageWriter* writer, uint64_t at, uint64_t target) {
+    uint64_t address = IMAGE_BASE + target;
+    memcpy(writer->bytes + at, &address, sizeof(address));
+
+    if (writer->relocationCapacity < writer->relocationCount + 1) {
+        size_t oldCapacity = writer->relocationCapacity;
+        writer->relocationCapacity = GROW_CAPACITY(oldCapacity);
+        writer->relocations = GROW_ARRAY(uint64_t, writer->relocations,
+                                         oldCapacity, writer->relocationCapacity);
+    }
+    writer->relocations[writer->relocationCount++] = at;
+}
+
+
+static uint64_t writeFunction(ImageWriter* writer, ObjFunction* function);
+
+// Writes the value at 'at', with its function (if any) in the image
+static void writeImageValue(ImageWriter* writer, uint64_t at, Value value) {
+    Value* slot = (Value*)(writer->bytes + at);
+    slot->type = value.type;
+    if (!IS_OBJ(value)) {
+        slot->as = value.as;
+        return;
+    }
+
+    uint64_t function = writeFunction(writer, AS_FUNCTION(value));
+    writePointer(writer, at + offsetof(Value, as), function);
+}
+
+
+static uint64_t writeFunction(ImageWriter* writer, ObjFunction* function) {
+    for (size_t i = 0; i < writer->functionCount; i++) {
+        if (writer->functions[i] == function) return writer->offsets[i];
+    }
+
+    uint64_t offset = reserve(writer, sizeof(ObjFunction), IMAGE_ALIGN);
+    if (writer->functionCapacity < writer->functionCount + 1) {
+        size_t oldCapacity = writer->functionCapacity;
+        writer->functionCapacity = GROW_CAPACITY(oldCapacity);
+        writer->functions = GROW_ARRAY(ObjFunction*, writer->functions,
+                                       oldCapacity, writer->functionCapacity);
+        writer->offsets = GROW_ARRAY(uint64_t, writer->offsets,
+                                     oldCapacity, writer->functionCapacity);
+    }
+    writer->functions[writer->functionCount] = function;
+    writer->offsets[writer->functionCount++] = offset;
+
+    Chunk* chunk = &function->chunk;
+    uint64_t name = writeBytes(writer, function->name, (size_t)function->nameLength, 1);
+    uint64_t code = writeBytes(writer, chunk->code, (size_t)chunk->count, 1);
+    uint64_t lines = writeBytes(writer, chunk->lines, sizeof(int) * (size_t)chunk->count,
+                                IMAGE_ALIGN);
+    uint64_t loops = reserve(writer, sizeof(LoopProfile) * (size_t)chunk->loopCount,
+                             IMAGE_ALIGN);
+    for (int i = 0; i < chunk->loopCount; i++) {
+        LoopProfile* loop = (LoopProfile*)(writer->bytes + loops) + i;
+        *loop = (LoopProfile){chunk->loops[i].header, chunk->loops[i].line, 0};
+    }
+    uint64_t constants = reserve(writer, sizeof(Value) * (size_t)chunk->constants.count,
+                                 IMAGE_ALIGN);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeImageValue(writer, constants + sizeof(Value) * (size_t)i, chunk->constants.values[i]);
+    }
+
+    // The pointers are filled in by writePointer(): nothing else is valid
+    ObjFunction* copy = (ObjFunction*)(writer->bytes + offset);
+    copy->obj.type = OBJ_FUNCTION;
+    copy->obj.isMarked = true;
+    copy->obj.isOld = true;
+    copy->obj.isRemembered = false;
+    copy->arity = function->arity;
+    copy->nameLength = function->nameLength;
+    copy->chunk.count = chunk->count;
+    copy->chunk.capacity = chunk->count;
+    copy->chunk.quickened = chunk->quickened;
+    copy->chunk.loopCount = chunk->loopCount;
+    copy->chunk.loopCapacity = chunk->loopCount;
+    copy->chunk.constants.count = chunk->constants.count;
+    copy->chunk.constants.capacity = chunk->constants.count;
+
+    writePointer(writer, offset + offsetof(ObjFunction, name), name);
+    writePointer(writer, offset + offsetof(ObjFunction, chunk.code), code);
+    writePointer(writer, offset + offsetof(ObjFunction, chunk.lines), lines);
+    if (chunk->loopCount > 0) {
+        writePointer(writer, offset + offsetof(ObjFunction, chunk.loops), loops);
+    }
+    if (chunk->constants.count > 0) {
+        writePointer(writer, offset + offsetof(ObjFunction, chunk.constants.values), constants);
+    }
+    return offset;
+}
+
+
+static void writeName(ImageWriter* writer, uint64_t at, const char* name, int length) {
+    uint64_t bytes = writeBytes(writer, name, (size_t)length, 1);
+    ImageName* entry = (ImageName*)(writer->bytes + at);
+    entry->name = bytes;
+    entry->length = (uint32_t)length;
+}
+
+
+bool saveImage(const char* path) {
+    ImageWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    uint64_t header = reserve(&writer, sizeof(ImageHeader), IMAGE_ALIGN);
+
+    int globalCount = vm.globals.count;
+    uint64_t globals = reserve(&writer, sizeof(ImageGlobal) * (size_t)globalCount, IMAGE_ALIGN);
+    for (int i = 0; i < globalCount; i++) {
+        uint64_t at = globals + sizeof(ImageGlobal) * (size_t)i;
+        writeName(&writer, at, vm.globals.names[i], vm.globals.lengths[i]);
+        ((ImageGlobal*)(writer.bytes + at))->name.defined = vm.globals.defined[i];
+        writeImageValue(&writer, at + offsetof(ImageGlobal, value), vm.globals.values[i]);
+    }
+
+    // Compiled code calls natives by index
+    int nativeCount = vm.natives.count;
+    uint64_t natives = reserve(&writer, sizeof(ImageName) * (size_t)nativeCount, IMAGE_ALIGN);
+    for (int i = 0; i < nativeCount; i++) {
+        writeName(&writer, natives + sizeof(ImageName) * (size_t)i,
+                  vm.natives.names[i], vm.natives.lengths[i]);
+    }
+
+    uint64_t relocations = writeBytes(&writer, writer.relocations,
+                                      sizeof(uint64_t) * writer.relocationCount, IMAGE_ALIGN);
+
+    ImageHeader* head = (ImageHeader*)(writer.bytes + header);
+    memcpy(head->magic, IMAGE_MAGIC, sizeof(head->magic));
+    head->version = IMAGE_VERSION;
+    head->valueSize = sizeof(Value);
+    head->functionSize = sizeof(ObjFunction);
+    head->opcodeCount = OP_NEGATE_UNCHECKED + 1;
+    head->globalCount = (uint32_t)globalCount;
+    head->nativeCount = (uint32_t)nativeCount;
+    head->relocationCount = (uint32_t)writer.relocationCount;
+    head->base = IMAGE_BASE;
+    head->size = writer.count;
+    head->globals = globals;
+    head->natives = natives;
+    head->relocations = relocations;
+
+    FILE* file = fopen(path, "wb");
+    bool saved = file != NULL && fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+    if (file != NULL && fclose(file) != 0) saved = false;
+    if (!saved) fprintf(stderr, "Could not write image \"%s\".\n", path);
+
+    FREE_ARRAY(uint8_t, writer.bytes, writer.capacity);
+    FREE_ARRAY(uint64_t, writer.relocations, writer.relocationCapacity);
+    FREE_ARRAY(ObjFunction*, writer.functions, writer.functionCapacity);
+    FREE_ARRAY(uint64_t, writer.offsets, writer.functionCapacity);
+    return saved;
+}
+
+
+
+/*
+#####################################
+Loading
+#####################################
+*/
+
+#ifdef MAVIX_IMAGE
+
+// Whether 'count' things of 'size' bytes at 'offset' lie within the image
+static bool inImage(uint64_t offset, uint64_t count, size_t size, uint64_t imageSize) {
+    return offset <= imageSize && count <= (imageSize - offset) / size;
+}
+
+
+// Checks the header and moves the pointers if the image is not at its base
+static const char* checkImage(uint8_t* bytes, size_t size) {
+    ImageHeader* header = (ImageHeader*)bytes;
+    if (size < sizeof(ImageHeader) || memcmp(header->magic, IMAGE_MAGIC, 8) != 0) {
+        return "not an image";
+    }
+    if (header->version != IMAGE_VERSION || header->valueSize != sizeof(Value) ||
+        header->functionSize != sizeof(ObjFunction) ||
+        header->opcodeCount != OP_NEGATE_UNCHECKED + 1) {
+        return "made by a different version of mavix";
+    }
+    if (header->size != size ||
+        !inImage(header->globals, header->globalCount, sizeof(ImageGlobal), size) ||
+        !inImage(header->natives, header->nativeCount, sizeof(ImageName), size) ||
+        !inImage(header->relocations, header->relocationCount, sizeof(uint64_t), size)) {
+        return "truncated or corrupt";
+    }
+
+    uint64_t delta = (uint64_t)(uintptr_t)bytes - header->base;
+    if (delta == 0) return NULL;
+
+    const uint64_t* relocations = (const uint64_t*)(bytes + header->relocations);
+    for (uint32_t i = 0; i < header->relocationCount; i++) {
+        if (!inImage(relocations[i], 1, sizeof(uint64_t), size)) return "truncated or corrupt";
+        uint64_t pointer;
+        memcpy(&pointer, bytes + relocations[i], sizeof(pointer));
+        pointer += delta;
+        memcpy(bytes + relocations[i], &pointer, sizeof(pointer));
+    }
+    return NULL;
+}
+
+
+// What checkContents() has found so far
+typedef struct {
+    uint8_t* bytes;
+    size_t size;
+
+    // Functions checked so far
+    ObjFunction** functions;
+    size_t functionCount;
+    size_t functionCapacity;
+} ImageChecker;
+
+
+// Whether 'count' things of 'size' bytes at 'pointer' lie within the image,
+// aligned to 'align'
+static bool inMapping(ImageChecker* checker, const void* pointer, int64_t count,
+                      size_t size, size_t align) {
+    uint64_t offset = (uint64_t)((uintptr_t)pointer - (uintptr_t)checker->bytes);
+    return count >= 0 && offset % align == 0 &&
+           inImage(offset, (uint64_t)count, size, checker->size);
+}
+
+
+/*
+ * A function record must be one saveImage() could have written: old and
+ * marked, with no machine code, and its arrays exactly as long as their
+ * counts and within the image. The code itself is trusted.
+ */
+static bool checkFunction(ImageChecker* checker, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    if (function->obj.type != OBJ_FUNCTION || !function->obj.isMarked ||
+        !function->obj.isOld || chunk->jit != NULL ||
+        !inMapping(checker, function->name, function->nameLength, 1, 1) ||
+        chunk->count <= 0 || chunk->capacity != chunk->count ||
+        chunk->quickened < 0 || chunk->quickened > chunk->count ||
+        !inMapping(checker, chunk->code, chunk->count, 1, 1) ||
+        !inMapping(checker, chunk->lines, chunk->count, sizeof(int), IMAGE_ALIGN) ||
+        chunk->loopCount < 0 || chunk->loopCapacity != chunk->loopCount ||
+        chunk->constants.count < 0 || chunk->constants.count > UINT8_COUNT ||
+        chunk->constants.capacity != chunk->constants.count) {
+        return false;
+    }
+    if (chunk->loopCount > 0 &&
+        !inMapping(checker, chunk->loops, chunk->loopCount, sizeof(LoopProfile), IMAGE_ALIGN)) {
+        return false;
+    }
+    return chunk->constants.count == 0 ||
+           inMapping(checker, chunk->constants.values, chunk->constants.count,
+                     sizeof(Value), IMAGE_ALIGN);
+}
+
+
+// Checks a function the first time it is found; its constants wait their turn
+static bool checkValue(ImageChecker* checker, Value value) {
+    if ((unsigned)value.type > VAL_OBJ) return false;
+    if (!IS_OBJ(value)) return true;
+
+    ObjFunction* function = (ObjFunction*)AS_OBJ(value);
+    for (size_t i = 0; i < checker->functionCount; i++) {
+        if (checker->functions[i] == function) return true;
+    }
+    if (!inMapping(checker, function, 1, sizeof(ObjFunction), IMAGE_ALIGN) ||
+        !checkFunction(checker, function)) {
+        return false;
+    }
+
+    if (checker->functionCapacity < checker->functionCount + 1) {
+        size_t oldCapacity = checker->functionCapacity;
+        checker->functionCapacity = GROW_CAPACITY(oldCapacity);
+        checker->functions = GROW_ARRAY(ObjFunction*, checker->functions,
+                                        oldCapacity, checker->functionCapacity);
+    }
+    checker->functions[checker->functionCount++] = function;
+    return true;
+}
+
+
+// Checks the names, and every function reachable from the globals
+static const char* checkContents(uint8_t* bytes, size_t size) {
+    ImageHeader* header = (ImageHeader*)bytes;
+    ImageChecker checker = {bytes, size, NULL, 0, 0};
+
+    bool valid = true;
+    const ImageName* natives = (const ImageName*)(bytes + header->natives);
+    for (uint32_t i = 0; valid && i < header->nativeCount; i++) {
+        valid = inImage(natives[i].name, natives[i].length, 1, size);
+    }
+    const ImageGlobal* globals = (const ImageGlobal*)(bytes + header->globals);
+    for (uint32_t i = 0; valid && i < header->globalCount; i++) {
+        valid = inImage(globals[i].name.name, globals[i].name.length, 1, size) &&
+                checkValue(&checker, globals[i].value);
+    }
+    // The list grows as the constants turn up more functions
+    for (size_t i = 0; valid && i < checker.functionCount; i++) {
+        ValueArray* constants = &checker.functions[i]->chunk.constants;
+        for (int j = 0; valid && j < constants->count; j++) {
+            valid = checkValue(&checker, constants->values[j]);
+        }
+    }
+
+    FREE_ARRAY(ObjFunction*, checker.functions, checker.functionCapacity);
+    return valid ? NULL : "truncated or corrupt";
+}
+
+
+static const char* nameAt(uint8_t* bytes, const ImageName* name) {
+    return (const char*)bytes + name->name;
+}
+
+
+// Binds the natives and defines the globals, as the image's VM had them
+static const char* installImage(uint8_t* bytes) {
+    ImageHeader* header = (ImageHeader*)bytes;
+
+    const ImageName* natives = (const ImageName*)(bytes + header->natives);
+    if (header->nativeCount > (uint32_t)vm.natives.count) return "needs other natives";
+    for (uint32_t i = 0; i < header->nativeCount; i++) {
+        if (natives[i].length != (uint32_t)vm.natives.lengths[i] ||
+            memcmp(nameAt(bytes, &natives[i]), vm.natives.names[i], natives[i].length) != 0) {
+            return "needs other natives";
+        }
+    }
+
+    const ImageGlobal* globals = (const ImageGlobal*)(bytes + header->globals);
+    for (uint32_t i = 0; i < header->globalCount; i++) {
+        int slot = globalSlot(nameAt(bytes, &globals[i].name), (int)globals[i].name.length);
+        if (slot != (int)i) return "has globals the VM cannot define";
+        vm.globals.values[slot] = globals[i].value;
+        vm.globals.defined[slot] = globals[i].name.defined != 0;
+    }
+    return NULL;
+}
+
+
+bool loadImage(const char* path) {
+    const char* problem = NULL;
+    if (image.bytes != NULL || vm.globals.count > 0 || vm.fiber != &vm.main) {
+        problem = "the VM is not fresh";
+    }
+
+    int file = problem == NULL ? open(path, O_RDONLY) : -1;
+    struct stat info;
+    if (problem == NULL && (file < 0 || fstat(file, &info) != 0 || info.st_size <= 0)) {
+        problem = "cannot be read";
+    }
+
+    uint8_t* bytes = MAP_FAILED;
+    size_t size = problem == NULL ? (size_t)info.st_size : 0;
+    if (problem == NULL) {
+        int flags = MAP_PRIVATE;
+#ifdef MAP_FIXED_NOREPLACE
+        flags |= MAP_FIXED_NOREPLACE;   // never over an existing mapping
+#endif
+        // Written to copy-on-write: relocation, quickening, loop counters
+        bytes = mmap((void*)(uintptr_t)IMAGE_BASE, size, PROT_READ | PROT_WRITE,
+                     flags, file, 0);
+        if (bytes == MAP_FAILED) {
+            bytes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+        }
+        if (bytes == MAP_FAILED) problem = "cannot be mapped";
+    }
+    if (file >= 0) close(file);
+
+    if (problem == NULL) problem = checkImage(bytes, size);
+    if (problem == NULL) problem = checkContents(bytes, size);
+    if (problem == NULL) problem = installImage(bytes);
+
+    if (problem != NULL) {
+        // Globals defined before the problem was found stay, undefined
+        for (int i = 0; i < vm.globals.count; i++) vm.globals.defined[i] = false;
+        if (bytes != MAP_FAILED) munmap(bytes, size);
+        fprintf(stderr, "Could not load image \"%s\": %s.\n", path, problem);
+        return false;
+    }
+
+    image.bytes = bytes;
+    image.size = size;
+    return true;
+}
+
+
+void unloadImage() {
+    if (image.bytes != NULL) munmap(image.bytes, image.size);
+    image.bytes = NULL;
+    image.size = 0;
+}
+
+#else
+
+bool loadImage(const char* path) {
+    fprintf(stderr, "Could not load image \"%s\": images need mmap().\n", path);
+    return false;
+}
+
+
+void unloadImage() {
+}
+
+#endif
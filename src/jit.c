@@ -0,0 +1,830 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "jit.h"
+#include "memory.h"
+#include "perf.h"
+
+#if defined(__linux__) && defined(__x86_64__)
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "vm.h"
+
+/* @note
+ * Baseline template JIT. Every instruction is translated in order into a
+ * fixed machine code template, so the code can be entered at any of them.
+ * Register usage (System V):
+ *
+ *   rbx  Value** stackTop   (the VM's stack top, written back on exit)
+ *   r12  const Value*       (the chunk's constant table)
+ *   r13  Value*             (the slots of the running call)
+ *   r8   Value*             (the stack top while running)
+ *   xmm0, xmm1, rax, rcx, rdx    scratch
+ *
+ * rbx, r12 and r13 are callee-saved, so they survive the calls to the
+ * helpers below; r8 is stored before and reloaded after them.
+ *
+ * Calls, returns, natives and the slow path of a back-edge are left to the
+ * interpreter: their template is an exit that stores r8 back and returns the
+ * instruction's offset. A failed type check exits the same way at the
+ * instruction that made it, so the interpreter re-executes it with the exact
+ * same stack (deoptimization).
+ * */
+
+_Static_assert(sizeof(Value) == 16, "JIT templates assume 16-byte values");
+_Static_assert(offsetof(Value, type) == 0, "JIT templates assume the tag first");
+_Static_assert(offsetof(Value, as) == 8, "JIT templates assume the payload at 8");
+
+// Displacements from r8 of the top two stack slots and their payloads
+#define TOP         (-16)
+#define TOP_AS      (-8)
+#define SECOND      (-32)
+#define SECOND_AS   (-24)
+
+// The epilogue is the first thing in the code, so every exit jumps to 0
+#define EPILOGUE 0
+
+
+// A pending rel32 to patch: a jump to an exit stub, or to an instruction
+typedef struct {
+    int patch;      // position of the rel32 field
+    int offset;     // bytecode offset to resume at, or to jump to
+    bool exit;      // to the exit stub for 'offset' rather than its code
+} Patch;
+
+
+typedef struct {
+    uint8_t* bytes;
+    int count;
+    int capacity;
+    Patch* patches;
+    int patchCount;
+    int patchCapacity;
+    PerfLine* lines;    // where each line's code starts, for perf
+    int lineCount;
+    int lineCapacity;
+} Assembler;
+
+
+static void emit(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->bytes = GROW_ARRAY(uint8_t, as->bytes, oldCapacity, as->capacity);
+    }
+    as->bytes[as->count++] = byte;
+}
+
+static void emitAll(Assembler* as, const uint8_t* bytes, int count) {
+    for (int i = 0; i < count; i++) emit(as, bytes[i]);
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emit(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emit(as, (uint8_t)(value >> (8 * i)));
+}
+
+// Notes where the code of a new line starts
+static void markLine(Assembler* as, int line) {
+    if (as->lineCount > 0 && as->lines[as->lineCount - 1].line == line) return;
+    if (as->lineCapacity < as->lineCount + 1) {
+        int oldCapacity = as->lineCapacity;
+        as->lineCapacity = GROW_CAPACITY(oldCapacity);
+        as->lines = GROW_ARRAY(PerfLine, as->lines, oldCapacity, as->lineCapacity);
+    }
+    as->lines[as->lineCount++] = (PerfLine){(size_t)as->count, line};
+}
+
+#define EMIT(as, ...) \
+    do { \
+        const uint8_t code[] = {__VA_ARGS__}; \
+        emitAll(as, code, (int)sizeof(code)); \
+    } while (false)
+
+
+// A rel32 for the final pass to fill in
+static void emitPatch(Assembler* as, int offset, bool exit) {
+    if (as->patchCapacity < as->patchCount + 1) {
+        int oldCapacity = as->patchCapacity;
+        as->patchCapacity = GROW_CAPACITY(oldCapacity);
+        as->patches = GROW_ARRAY(Patch, as->patches, oldCapacity, as->patchCapacity);
+    }
+    as->patches[as->patchCount++] = (Patch){as->count, offset, exit};
+    emit32(as, 0);
+}
+
+// Sets the rel32 at 'patch' to reach 'target'
+static void patchJump(Assembler* as, int patch, int target) {
+    int32_t distance = target - (patch + 4);
+    memcpy(&as->bytes[patch], &distance, sizeof(distance));
+}
+
+// mov eax, offset ; jmp <epilogue>
+static void emitExit(Assembler* as, int offset) {
+    emit(as, 0xB8);
+    emit32(as, (uint32_t)offset);
+    emit(as, 0xE9);
+    emit32(as, 0);
+    patchJump(as, as->count - 4, EPILOGUE);
+}
+
+// Second opcode bytes of 'jcc rel32', and the opcodes of 'jcc rel8'
+#define JE 0x84
+#define JNE 0x85
+#define JO 0x80
+#define JLE 0x8E
+#define JE_SHORT 0x74
+#define JNE_SHORT 0x75
+#define JMP_SHORT 0xEB
+
+// j<cc> rel32 to the exit stub for 'offset'
+static void emitExitJump(Assembler* as, uint8_t condition, int offset) {
+    EMIT(as, 0x0F, condition);
+    emitPatch(as, offset, true);
+}
+
+// j<cc> rel32 to the code of the instruction at 'target'
+static void emitBranch(Assembler* as, uint8_t condition, int target) {
+    EMIT(as, 0x0F, condition);
+    emitPatch(as, target, false);
+}
+
+// jmp rel32 to the code of the instruction at 'target'
+static void emitJump(Assembler* as, int target) {
+    emit(as, 0xE9);
+    emitPatch(as, target, false);
+}
+
+// cmp dword [r8 + slot], type ; jne <exit to offset>
+static void emitGuard(Assembler* as, int8_t slot, ValueType type, int offset) {
+    EMIT(as, 0x41, 0x83, 0x78, (uint8_t)slot, (uint8_t)type);
+    emitExitJump(as, JNE, offset);
+}
+
+// Sets ZF if both operands have the type, testing them with one branch:
+// mov eax, [r8 + TOP] ; xor eax, type ; mov ecx, [r8 + SECOND] ; xor ecx, type ; or eax, ecx
+static void emitPairTest(Assembler* as, ValueType type) {
+    EMIT(as, 0x41, 0x8B, 0x40, (uint8_t)TOP, 0x83, 0xF0, (uint8_t)type);
+    EMIT(as, 0x41, 0x8B, 0x48, (uint8_t)SECOND, 0x83, 0xF1, (uint8_t)type);
+    EMIT(as, 0x09, 0xC8);
+}
+
+static void emitPairGuard(Assembler* as, ValueType type, int offset) {
+    emitPairTest(as, type);
+    emitExitJump(as, JNE, offset);
+}
+
+// A short jump forward, to the label that patchShortJump() sets
+static int emitShortJump(Assembler* as, uint8_t opcode) {
+    emit(as, opcode);
+    emit(as, 0);
+    return as->count - 1;
+}
+
+static void patchShortJump(Assembler* as, int patch) {
+    as->bytes[patch] = (uint8_t)(as->count - (patch + 1));
+}
+
+// mov rax, address
+static void emitAddress(Assembler* as, const void* address) {
+    EMIT(as, 0x48, 0xB8);
+    emit64(as, (uint64_t)(uintptr_t)address);
+}
+
+/*
+ * Calls a helper with the VM's stack top, which it may move:
+ * mov [rbx], r8 ; mov rdi, rbx ; mov rax, helper ; call rax ; mov r8, [rbx]
+ */
+static void emitHelperCall(Assembler* as, void (*helper)(Value** stackTop)) {
+    uint64_t address;
+    memcpy(&address, &helper, sizeof(address));
+    EMIT(as, 0x4C, 0x89, 0x03, 0x48, 0x89, 0xDF);
+    EMIT(as, 0x48, 0xB8);
+    emit64(as, address);
+    EMIT(as, 0xFF, 0xD0, 0x4C, 0x8B, 0x03);
+}
+
+
+// What a template may assume about its operands
+typedef enum {
+    PROVEN_NUMBERS,     // unchecked forms: the compiler proved two doubles
+    NUMBERS,            // *_NUM forms: two doubles, or deoptimize
+    INTS,               // *_INT forms: two ints, or deoptimize
+    NUMBERS_OR_INTS,    // generic forms: two of either, or deoptimize
+} Operands;
+
+/*
+ * Starts the int case of a template. Returns the jump to the double case
+ * that follows, or -1 if the operands can only be ints.
+ */
+static int beginIntCase(Assembler* as, Operands operands, int offset) {
+    emitPairTest(as, VAL_INT);
+    if (operands == INTS) {
+        emitExitJump(as, JNE, offset);
+        return -1;
+    }
+    return emitShortJump(as, JNE_SHORT);
+}
+
+// Ends the int case, if any, and guards the double case
+static int beginNumberCase(Assembler* as, Operands operands, int toNumbers, int offset) {
+    int toEnd = -1;
+    if (toNumbers >= 0) {
+        toEnd = emitShortJump(as, JMP_SHORT);
+        patchShortJump(as, toNumbers);
+    }
+    if (operands != PROVEN_NUMBERS) emitPairGuard(as, VAL_NUMBER, offset);
+    return toEnd;
+}
+
+// movsd xmm0, [r8 + SECOND_AS] ; movsd xmm1, [r8 + TOP_AS]
+static void emitLoadOperands(Assembler* as) {
+    EMIT(as, 0xF2, 0x41, 0x0F, 0x10, 0x40, (uint8_t)SECOND_AS);
+    EMIT(as, 0xF2, 0x41, 0x0F, 0x10, 0x48, (uint8_t)TOP_AS);
+}
+
+// sub r8, 16
+static void emitPop(Assembler* as) {
+    EMIT(as, 0x49, 0x83, 0xE8, 0x10);
+}
+
+/*
+ * Values are moved through rcx and rdx, 8 bytes at a time: a store can
+ * forward to a load of the same size, while a 16-byte load of a value just
+ * written in halves would stall until the halves reach the cache.
+ */
+typedef enum {
+    BASE_RAX = 0,
+    BASE_R8 = 8,
+    BASE_R12 = 12,
+    BASE_R13 = 13,
+} Base;
+
+#define LOAD 0x8B
+#define STORE 0x89
+#define RCX 1
+#define RDX 2
+
+// mov <reg>, [base + displacement], or the store the other way
+static void emitMove(Assembler* as, uint8_t opcode, int reg, Base base, int32_t displacement) {
+    emit(as, base >= BASE_R8 ? 0x49 : 0x48);
+    emit(as, opcode);
+    emit(as, (uint8_t)(0x80 | reg << 3 | (base & 7)));
+    if ((base & 7) == 4) emit(as, 0x24);    // SIB byte for r12
+    emit32(as, (uint32_t)displacement);
+}
+
+static void emitLoadValue(Assembler* as, Base base, int32_t displacement) {
+    emitMove(as, LOAD, RCX, base, displacement);
+    emitMove(as, LOAD, RDX, base, displacement + 8);
+}
+
+static void emitStoreValue(Assembler* as, Base base, int32_t displacement) {
+    emitMove(as, STORE, RCX, base, displacement);
+    emitMove(as, STORE, RDX, base, displacement + 8);
+}
+
+// Pushes the value loaded by emitLoadValue()
+static void emitPushValue(Assembler* as) {
+    emitStoreValue(as, BASE_R8, 0);
+    EMIT(as, 0x49, 0x83, 0xC0, 0x10);       // add r8, 16
+}
+
+// mov qword [r8], type ; mov qword [r8 + 8], payload ; add r8, 16
+static void emitPushLiteral(Assembler* as, ValueType type, int32_t payload) {
+    EMIT(as, 0x49, 0xC7, 0x00);
+    emit32(as, (uint32_t)type);
+    EMIT(as, 0x49, 0xC7, 0x40, 0x08);
+    emit32(as, (uint32_t)payload);
+    EMIT(as, 0x49, 0x83, 0xC0, 0x10);
+}
+
+// Third opcode bytes of the scalar double operations (F2 0F xx)
+#define ADDSD 0x58
+#define SUBSD 0x5C
+#define MULSD 0x59
+#define DIVSD 0x5E
+
+// Second opcode bytes of setcc
+#define SETE 0x94
+#define SETA 0x97
+#define SETG 0x9F
+#define SETL 0x9C
+
+// Second opcode byte of 'imul r64, r/m64', which has two
+#define IMUL 0xAF
+
+// mov rax, [r8 + SECOND_AS] ; <op> rax, [r8 + TOP_AS] ; jo <exit> ;
+// mov [r8 + SECOND_AS], rax ; sub r8, 16
+static void emitIntArithmetic(Assembler* as, uint8_t intOp, int offset) {
+    EMIT(as, 0x49, 0x8B, 0x40, (uint8_t)SECOND_AS);
+    if (intOp == IMUL) {
+        EMIT(as, 0x49, 0x0F, IMUL, 0x40, (uint8_t)TOP_AS);
+    } else {
+        EMIT(as, 0x49, intOp, 0x40, (uint8_t)TOP_AS);
+    }
+    // On overflow the interpreter redoes the operation in doubles
+    emitExitJump(as, JO, offset);
+    EMIT(as, 0x49, 0x89, 0x40, (uint8_t)SECOND_AS);
+    emitPop(as);
+}
+
+/*
+ * Dividing two ints: an exact quotient stays an int, any other is divided
+ * in doubles, like the interpreter does. A zero or -1 divisor is left to it.
+ */
+static void emitIntDivision(Assembler* as, int offset) {
+    EMIT(as, 0x49, 0x8B, 0x48, (uint8_t)TOP_AS);        // mov rcx, [r8 + TOP_AS]
+    EMIT(as, 0x48, 0x85, 0xC9);                         // test rcx, rcx
+    emitExitJump(as, JE, offset);
+    EMIT(as, 0x48, 0x83, 0xF9, 0xFF);                   // cmp rcx, -1
+    emitExitJump(as, JE, offset);
+    EMIT(as, 0x49, 0x8B, 0x40, (uint8_t)SECOND_AS);     // mov rax, [r8 + SECOND_AS]
+    EMIT(as, 0x48, 0x99, 0x48, 0xF7, 0xF9);             // cqo ; idiv rcx
+    EMIT(as, 0x48, 0x85, 0xD2);                         // test rdx, rdx
+    int inexact = emitShortJump(as, JNE_SHORT);
+    EMIT(as, 0x49, 0x89, 0x40, (uint8_t)SECOND_AS);     // mov [r8 + SECOND_AS], rax
+    int toEnd = emitShortJump(as, JMP_SHORT);
+
+    // cvtsi2sd xmm0, [r8 + SECOND_AS] ; cvtsi2sd xmm1, [r8 + TOP_AS]
+    patchShortJump(as, inexact);
+    EMIT(as, 0xF2, 0x49, 0x0F, 0x2A, 0x40, (uint8_t)SECOND_AS);
+    EMIT(as, 0xF2, 0x49, 0x0F, 0x2A, 0x48, (uint8_t)TOP_AS);
+    EMIT(as, 0xF2, 0x0F, DIVSD, 0xC1);
+    EMIT(as, 0xF2, 0x41, 0x0F, 0x11, 0x40, (uint8_t)SECOND_AS);
+    EMIT(as, 0x49, 0xC7, 0x40, (uint8_t)SECOND);   // mov qword [r8 + SECOND], VAL_NUMBER
+    emit32(as, VAL_NUMBER);
+
+    patchShortJump(as, toEnd);
+    emitPop(as);
+}
+
+/*
+ * <op>sd xmm0, xmm1 ; movsd [r8 + SECOND_AS], xmm0 ; sub r8, 16, after the
+ * int case (add, sub or IMUL; 0 for a division) unless the operands are
+ * doubles.
+ */
+static void emitArithmetic(Assembler* as, uint8_t sseOp, uint8_t intOp,
+                           Operands operands, int offset) {
+    int toNumbers = -1;
+    if (operands == INTS || operands == NUMBERS_OR_INTS) {
+        toNumbers = beginIntCase(as, operands, offset);
+        if (intOp == 0) {
+            emitIntDivision(as, offset);
+        } else {
+            emitIntArithmetic(as, intOp, offset);
+        }
+        if (operands == INTS) return;
+    }
+
+    int toEnd = beginNumberCase(as, operands, toNumbers, offset);
+    emitLoadOperands(as);
+    EMIT(as, 0xF2, 0x0F, sseOp, 0xC1);
+    EMIT(as, 0xF2, 0x41, 0x0F, 0x11, 0x40, (uint8_t)SECOND_AS);
+    emitPop(as);
+    if (toEnd >= 0) patchShortJump(as, toEnd);
+}
+
+/*
+ * Stores al as a bool into the slot, in whole qwords:
+ * movzx eax, al ; mov [r8 + slot + 8], rax ; mov qword [r8 + slot], VAL_BOOL
+ */
+static void emitBoolAt(Assembler* as, int8_t slot) {
+    EMIT(as, 0x0F, 0xB6, 0xC0);
+    EMIT(as, 0x49, 0x89, 0x40, (uint8_t)(slot + 8));
+    EMIT(as, 0x49, 0xC7, 0x40, (uint8_t)slot);
+    emit32(as, VAL_BOOL);
+}
+
+// Stores al as a bool into the second slot, which becomes the top
+static void emitStoreBool(Assembler* as) {
+    emitBoolAt(as, SECOND);
+    emitPop(as);
+}
+
+// mov rax, [r8 + SECOND_AS] ; cmp rax, [r8 + TOP_AS] ; set<cc> al
+static void emitIntComparison(Assembler* as, uint8_t setcc) {
+    EMIT(as, 0x49, 0x8B, 0x40, (uint8_t)SECOND_AS);
+    EMIT(as, 0x49, 0x3B, 0x40, (uint8_t)TOP_AS);
+    EMIT(as, 0x0F, setcc, 0xC0);
+    emitStoreBool(as);
+}
+
+/*
+ * 'setcc' and 'intSetcc' are the second opcode bytes of the setcc on al
+ * after comparing doubles (unsigned flags) and ints (signed flags).
+ */
+static void emitComparison(Assembler* as, bool swap, uint8_t setcc, uint8_t intSetcc,
+                           Operands operands, int offset) {
+    int toNumbers = -1;
+    if (operands == INTS || operands == NUMBERS_OR_INTS) {
+        toNumbers = beginIntCase(as, operands, offset);
+        emitIntComparison(as, intSetcc);
+        if (operands == INTS) return;
+    }
+
+    int toEnd = beginNumberCase(as, operands, toNumbers, offset);
+    emitLoadOperands(as);
+    if (swap) {
+        EMIT(as, 0x66, 0x0F, 0x2E, 0xC8);   // ucomisd xmm1, xmm0
+    } else {
+        EMIT(as, 0x66, 0x0F, 0x2E, 0xC1);   // ucomisd xmm0, xmm1
+    }
+    EMIT(as, 0x0F, setcc, 0xC0);
+    emitStoreBool(as);
+    if (toEnd >= 0) patchShortJump(as, toEnd);
+}
+
+
+// The helpers that templates call. Like the interpreter, they work on the
+// VM's stack, whose top they get.
+
+static void printTop(Value** stackTop) {
+    Value value = *--*stackTop;
+    writeValue(vm.output, value);
+    writeOutput(vm.output, "\n", 1);
+}
+
+static void equalTop(Value** stackTop) {
+    Value b = *--*stackTop;
+    Value a = (*stackTop)[-1];
+    (*stackTop)[-1] = BOOL_VAL(valuesEqual(a, b));
+}
+
+
+/*
+ * Loads the address of the running fiber's global values or defined flags:
+ * mov rax, &vm.globals.<field> ; mov rax, [rax]
+ */
+static void emitGlobals(Assembler* as, const void* field) {
+    emitAddress(as, field);
+    EMIT(as, 0x48, 0x8B, 0x00);
+}
+
+// cmp byte [rax + slot], 0 ; je <exit>, on the defined flags
+static void emitDefinedGuard(Assembler* as, uint8_t slot, int offset) {
+    emitGlobals(as, &vm.globals.defined);
+    EMIT(as, 0x80, 0xB8);
+    emit32(as, slot);
+    emit(as, 0x00);
+    emitExitJump(as, JE, offset);
+}
+
+/*
+ * Branches to 'target' if the top of the stack is falsey (nil or false),
+ * or truthy if 'ifTrue' is set. The value stays on the stack.
+ */
+static void emitConditionalJump(Assembler* as, bool ifTrue, int target) {
+    EMIT(as, 0x41, 0x8B, 0x40, (uint8_t)TOP);           // mov eax, [r8 + TOP]
+    EMIT(as, 0x83, 0xF8, VAL_NIL);                      // cmp eax, VAL_NIL
+    int skip = -1;
+    if (ifTrue) {
+        skip = emitShortJump(as, JE_SHORT);
+        EMIT(as, 0x83, 0xF8, VAL_BOOL);                 // cmp eax, VAL_BOOL
+        emitBranch(as, JNE, target);
+    } else {
+        emitBranch(as, JE, target);
+        EMIT(as, 0x83, 0xF8, VAL_BOOL);
+        skip = emitShortJump(as, JNE_SHORT);
+    }
+    EMIT(as, 0x41, 0x80, 0x78, (uint8_t)TOP_AS, 0x00);  // cmp byte [r8 + TOP_AS], 0
+    emitBranch(as, ifTrue ? JNE : JE, target);
+    patchShortJump(as, skip);
+}
+
+
+// Bytes that follow each opcode
+static int operandLength(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_GET_COLUMN:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return 1;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_CALL_NATIVE:
+            return 2;
+        case OP_LOOP:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+
+/*
+ * Emits the epilogue and the prologue, then every instruction's template,
+ * noting where each one starts in 'starts'.
+ *
+ * Prologue: push rbx ; push r12 ; push r13 ; mov rbx, rdi ; mov r12, rsi ;
+ *           mov r13, rdx ; mov r8, [rdi] ; jmp rcx (the instruction to start at)
+ * Epilogue: mov [rbx], r8 ; pop r13 ; pop r12 ; pop rbx ; ret
+ *
+ * Three pushes after the return address leave the stack 16-byte aligned
+ * for the helper calls.
+ */
+static int translate(Assembler* as, Chunk* chunk, uint32_t* starts) {
+    markLine(as, chunk->lines[0]);
+    EMIT(as, 0x4C, 0x89, 0x03, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3);
+    int prologue = as->count;
+    EMIT(as, 0x53, 0x41, 0x54, 0x41, 0x55);
+    EMIT(as, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xD5);
+    EMIT(as, 0x4C, 0x8B, 0x07, 0xFF, 0xE1);
+
+    for (int offset = 0; offset < chunk->count;
+         offset += 1 + operandLength(chunk->code[offset])) {
+        uint8_t instruction = chunk->code[offset];
+        int length = operandLength(instruction);
+        uint8_t operand = length >= 1 ? chunk->code[offset + 1] : 0;
+        uint16_t jump = length >= 2 ? (uint16_t)((operand << 8) | chunk->code[offset + 2]) : 0;
+        starts[offset] = (uint32_t)as->count;
+        markLine(as, chunk->lines[offset]);
+
+        switch (instruction) {
+            case OP_CONSTANT:
+                emitLoadValue(as, BASE_R12, operand * (int32_t)sizeof(Value));
+                emitPushValue(as);
+                break;
+
+            case OP_NIL:   emitPushLiteral(as, VAL_NIL, 0); break;
+            case OP_TRUE:  emitPushLiteral(as, VAL_BOOL, 1); break;
+            case OP_FALSE: emitPushLiteral(as, VAL_BOOL, 0); break;
+            case OP_POP:   emitPop(as); break;
+
+            // Ints that overflow are left to the interpreter
+            case OP_ADD:          emitArithmetic(as, ADDSD, 0x03, NUMBERS_OR_INTS, offset); break;
+            case OP_ADD_NUM:      emitArithmetic(as, ADDSD, 0x03, NUMBERS, offset); break;
+            case OP_ADD_INT:      emitArithmetic(as, ADDSD, 0x03, INTS, offset); break;
+            case OP_SUBTRACT:     emitArithmetic(as, SUBSD, 0x2B, NUMBERS_OR_INTS, offset); break;
+            case OP_SUBTRACT_NUM: emitArithmetic(as, SUBSD, 0x2B, NUMBERS, offset); break;
+            case OP_SUBTRACT_INT: emitArithmetic(as, SUBSD, 0x2B, INTS, offset); break;
+            case OP_MULTIPLY:     emitArithmetic(as, MULSD, IMUL, NUMBERS_OR_INTS, offset); break;
+            case OP_MULTIPLY_NUM: emitArithmetic(as, MULSD, IMUL, NUMBERS, offset); break;
+            case OP_MULTIPLY_INT: emitArithmetic(as, MULSD, IMUL, INTS, offset); break;
+            case OP_DIVIDE:       emitArithmetic(as, DIVSD, 0, NUMBERS_OR_INTS, offset); break;
+            case OP_DIVIDE_NUM:   emitArithmetic(as, DIVSD, 0, NUMBERS, offset); break;
+
+            case OP_ADD_UNCHECKED:      emitArithmetic(as, ADDSD, 0, PROVEN_NUMBERS, offset); break;
+            case OP_SUBTRACT_UNCHECKED: emitArithmetic(as, SUBSD, 0, PROVEN_NUMBERS, offset); break;
+            case OP_MULTIPLY_UNCHECKED: emitArithmetic(as, MULSD, 0, PROVEN_NUMBERS, offset); break;
+            case OP_DIVIDE_UNCHECKED:   emitArithmetic(as, DIVSD, 0, PROVEN_NUMBERS, offset); break;
+
+            // 'seta' after ucomisd is false for unordered operands, like C's > and <
+            case OP_GREATER:
+                emitComparison(as, false, SETA, SETG, NUMBERS_OR_INTS, offset);
+                break;
+            case OP_GREATER_NUM:
+                emitComparison(as, false, SETA, SETG, NUMBERS, offset);
+                break;
+            case OP_GREATER_INT:
+                emitComparison(as, false, SETA, SETG, INTS, offset);
+                break;
+            case OP_GREATER_UNCHECKED:
+                emitComparison(as, false, SETA, SETG, PROVEN_NUMBERS, offset);
+                break;
+            case OP_LESS:
+                emitComparison(as, true, SETA, SETL, NUMBERS_OR_INTS, offset);
+                break;
+            case OP_LESS_NUM:
+                emitComparison(as, true, SETA, SETL, NUMBERS, offset);
+                break;
+            case OP_LESS_INT:
+                emitComparison(as, true, SETA, SETL, INTS, offset);
+                break;
+            case OP_LESS_UNCHECKED:
+                emitComparison(as, true, SETA, SETL, PROVEN_NUMBERS, offset);
+                break;
+
+            // Two ints or two doubles are compared here, anything else by valuesEqual()
+            case OP_EQUAL: {
+                emitPairTest(as, VAL_INT);
+                int toNumbers = emitShortJump(as, JNE_SHORT);
+                emitIntComparison(as, SETE);
+                int intDone = emitShortJump(as, JMP_SHORT);
+
+                patchShortJump(as, toNumbers);
+                emitPairTest(as, VAL_NUMBER);
+                int toOthers = emitShortJump(as, JNE_SHORT);
+                emitLoadOperands(as);
+                EMIT(as, 0x66, 0x0F, 0x2E, 0xC1);   // ucomisd xmm0, xmm1
+                EMIT(as, 0x0F, SETE, 0xC0);         // sete al
+                EMIT(as, 0x0F, 0x9B, 0xC1);         // setnp cl
+                EMIT(as, 0x20, 0xC8);               // and al, cl
+                emitStoreBool(as);
+                int numberDone = emitShortJump(as, JMP_SHORT);
+
+                patchShortJump(as, toOthers);
+                emitHelperCall(as, equalTop);
+                patchShortJump(as, intDone);
+                patchShortJump(as, numberDone);
+                break;
+            }
+
+            // xor qword [r8 + TOP_AS], 1 on a bool; anything else is false
+            // unless it is nil
+            case OP_NOT: {
+                EMIT(as, 0x41, 0x83, 0x78, (uint8_t)TOP, VAL_BOOL);
+                int notBool = emitShortJump(as, JNE_SHORT);
+                EMIT(as, 0x49, 0x83, 0x70, (uint8_t)TOP_AS, 0x01);
+                int toEnd = emitShortJump(as, JMP_SHORT);
+                patchShortJump(as, notBool);
+                EMIT(as, 0x41, 0x83, 0x78, (uint8_t)TOP, VAL_NIL);
+                EMIT(as, 0x0F, SETE, 0xC0);
+                emitBoolAt(as, TOP);
+                patchShortJump(as, toEnd);
+                break;
+            }
+
+            // neg qword [r8 + TOP_AS] on an int; only -INT64_MIN overflows
+            // (and stays as it was, for the interpreter to redo).
+            // btc qword [r8 + TOP_AS], 63 flips the sign bit of a double,
+            // exactly like -x.
+            case OP_NEGATE: {
+                EMIT(as, 0x41, 0x83, 0x78, (uint8_t)TOP, VAL_INT);
+                int toNumber = emitShortJump(as, JNE_SHORT);
+                EMIT(as, 0x49, 0xF7, 0x58, (uint8_t)TOP_AS);
+                emitExitJump(as, JO, offset);
+                int toEnd = emitShortJump(as, JMP_SHORT);
+                patchShortJump(as, toNumber);
+                emitGuard(as, TOP, VAL_NUMBER, offset);
+                EMIT(as, 0x49, 0x0F, 0xBA, 0x78, (uint8_t)TOP_AS, 0x3F);
+                patchShortJump(as, toEnd);
+                break;
+            }
+            case OP_NEGATE_UNCHECKED:
+                EMIT(as, 0x49, 0x0F, 0xBA, 0x78, (uint8_t)TOP_AS, 0x3F);
+                break;
+
+            case OP_JUMP:
+                emitJump(as, offset + 3 + jump);
+                break;
+            case OP_JUMP_IF_FALSE:
+                emitConditionalJump(as, false, offset + 3 + jump);
+                break;
+            case OP_JUMP_IF_TRUE:
+                emitConditionalJump(as, true, offset + 3 + jump);
+                break;
+
+            /*
+             * Counts down vm.ticks like SAFEPOINT() does. The back-edge that
+             * would take the last tick exits instead, so the interpreter's
+             * safepoint runs it.
+             */
+            case OP_LOOP: {
+                emitAddress(as, &vm.ticks);
+                EMIT(as, 0x48, 0x83, 0x38, 0x01);   // cmp qword [rax], 1
+                emitExitJump(as, JLE, offset);
+                EMIT(as, 0x48, 0xFF, 0x08);         // dec qword [rax]
+                emitAddress(as, &chunk->loops[chunk->code[offset + 3]].iterations);
+                EMIT(as, 0x48, 0xFF, 0x00);         // inc qword [rax]
+                emitJump(as, offset + 4 - jump);
+                break;
+            }
+
+            case OP_PRINT:
+                emitHelperCall(as, printTop);
+                break;
+
+            case OP_DEFINE_GLOBAL:
+                emitGlobals(as, &vm.globals.values);
+                emitLoadValue(as, BASE_R8, TOP);
+                emitStoreValue(as, BASE_RAX, operand * (int32_t)sizeof(Value));
+                emitPop(as);
+                emitGlobals(as, &vm.globals.defined);
+                EMIT(as, 0xC6, 0x80);               // mov byte [rax + slot], 1
+                emit32(as, operand);
+                emit(as, 0x01);
+                break;
+
+            // An undefined variable is reported by the interpreter
+            case OP_GET_GLOBAL:
+                emitDefinedGuard(as, operand, offset);
+                emitGlobals(as, &vm.globals.values);
+                emitLoadValue(as, BASE_RAX, operand * (int32_t)sizeof(Value));
+                emitPushValue(as);
+                break;
+            case OP_SET_GLOBAL:
+                emitDefinedGuard(as, operand, offset);
+                emitGlobals(as, &vm.globals.values);
+                emitLoadValue(as, BASE_R8, TOP);
+                emitStoreValue(as, BASE_RAX, operand * (int32_t)sizeof(Value));
+                break;
+
+            // The call's slots start at r13
+            case OP_GET_LOCAL:
+                emitLoadValue(as, BASE_R13, operand * (int32_t)sizeof(Value));
+                emitPushValue(as);
+                break;
+            case OP_SET_LOCAL:
+                emitLoadValue(as, BASE_R8, TOP);
+                emitStoreValue(as, BASE_R13, operand * (int32_t)sizeof(Value));
+                break;
+
+            default:
+                // Calls, natives, returns and batch columns
+                emitExit(as, offset);
+                break;
+        }
+    }
+    return prologue;
+}
+
+
+bool jitCompile(Chunk* chunk, const char* name, int length) {
+    Assembler as = {NULL, 0, 0, NULL, 0, 0, NULL, 0, 0};
+    uint32_t* starts = ALLOCATE(uint32_t, chunk->count);
+    int prologue = translate(&as, chunk, starts);
+
+    // Exit stubs for the type guards, and the jumps to them and to the
+    // instructions' code
+    for (int i = 0; i < as.patchCount; i++) {
+        Patch* patch = &as.patches[i];
+        if (patch->exit) {
+            patchJump(&as, patch->patch, as.count);
+            emitExit(&as, patch->offset);
+        } else {
+            patchJump(&as, patch->patch, (int)starts[patch->offset]);
+        }
+    }
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t size = ((size_t)as.count + pageSize - 1) / pageSize * pageSize;
+    void* code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bool mapped = code != MAP_FAILED;
+
+    if (mapped) {
+        memcpy(code, as.bytes, as.count);
+        if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(code, size);
+            mapped = false;
+        }
+    }
+
+    if (mapped && perfEnabled()) {
+        // The exit stubs count as the last line
+        char symbol[64];
+        snprintf(symbol, sizeof(symbol), "%.*s:%d-%d [jit]", length, name,
+                 as.lines[0].line, as.lines[as.lineCount - 1].line);
+        perfCodeLoad(code, (size_t)as.count, symbol, as.lines, as.lineCount);
+    }
+
+    FREE_ARRAY(uint8_t, as.bytes, as.capacity);
+    FREE_ARRAY(Patch, as.patches, as.patchCapacity);
+    FREE_ARRAY(PerfLine, as.lines, as.lineCapacity);
+    if (!mapped) {
+        FREE_ARRAY(uint32_t, starts, chunk->count);
+        return false;
+    }
+
+    JitCode* jit = ALLOCATE(JitCode, 1);
+    jit->code = code;
+    jit->size = size;
+    jit->starts = starts;
+    jit->count = chunk->count;
+    // ISO C has no conversion from object to function pointers
+    uint8_t* entry = jit->code + prologue;
+    memcpy(&jit->entry, &entry, sizeof(jit->entry));
+    chunk->jit = jit;
+    return true;
+}
+
+
+void jitFree(Chunk* chunk) {
+    JitCode* jit = chunk->jit;
+    if (jit == NULL) return;
+    munmap(jit->code, jit->size);
+    FREE_ARRAY(uint32_t, jit->starts, jit->count);
+    FREE(JitCode, jit);
+    chunk->jit = NULL;
+}
+
+#else
+
+// The JIT only targets Linux on x86-64; elsewhere chunks are interpreted.
+bool jitCompile(Chunk* chunk, const char* name, int length) {
+    (void)chunk;
+    (void)name;
+    (void)length;
+    return false;
+}
+
+void jitFree(Chunk* chunk) {
+    (void)chunk;
+}
+
+#endif
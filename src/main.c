@@ -3,116 +3,383 @@
 #include <string.h>
 
 #include "common.h"
+#include "image.h"
+#include "metrics.h"
+#include "perf.h"
+#include "profile.h"
+#include "scheduler.h"
 #include "vm.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MAVIX_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/**
+ * @brief Reads a line of any length from stdin, without its new line.
+ *
+ * The buffer grows (doubling) until the line fits and is kept for the next
+ * lines, so a session allocates only when a line is longer than all before.
+ *
+ * @param buffer The line buffer, NULL at first.
+ * @param capacity Its size in bytes, 0 at first.
+ * @return The length of the line, or -1 at the end of the input.
+ */
+static long readLine(char** buffer, size_t* capacity) {
+    size_t length = 0;
+    for (;;) {
+        if (*capacity < length + 2) {
+            *capacity = *capacity < 256 ? 256 : *capacity * 2;
+            *buffer = (char*) realloc(*buffer, *capacity);
+            if (*buffer == NULL) {
+                fprintf(stderr, "Not enough memory to read the line.\n");
+                exit(74);
+            }
+        }
+
+        if (!fgets(*buffer + length, (int)(*capacity - length), stdin)) {
+            if (length == 0) return -1;     // handle Ctrl+D (EOF)
+            break;                          // last line without a new line
+        }
+        length += strlen(*buffer + length);
+        if ((*buffer)[length - 1] == '\n') {
+            (*buffer)[--length] = '\0';
+            break;
+        }
+    }
+    return (long)length;
+}
+
+
 /**
  * @brief Starts the Read-Eval-Print Loop (REPL) for the Mavix language interpreter.
  * 
  * This function initializes and runs the REPL, allowing users to interactively
  * enter and evaluate Mavix language expressions. It continuously reads input
  * from the user, evaluates it, and prints the result until the user decides to exit.
+ * The lines are compiled into one session (see interpretLine()).
  */
 static void repl() {
-    char line[1024];    // buffer to hold user input
+    char* line = NULL;      // buffer to hold user input, grown as needed
+    size_t capacity = 0;
 
     printf("Mavix v0.1 [REPL mode]\n");
     printf("Type 'exit' or press Ctrl+D to quit.\n");
 
     for (;;) {
+        flushOutput(vm.output);     // show the previous result before prompting
         printf(">>> ");
 
-        if (!fgets(line, sizeof(line), stdin)) {
+        long length = readLine(&line, &capacity);
+        if (length < 0) {
             printf("\n");
-            break;      // handle Ctrl+D (EOF)
+            break;
         }
 
-        // Remove trailing new line (if present)
-        line[strcspn(line, "\n")] = '\0';
-
         // Exit command check
         if (strcmp(line, "exit") == 0) {
             printf("Exiting REPL.\n");
             break;
         }
 
-        interpret(line);
+        interpretLine(line, (size_t)length);
     }
+    free(line);
 }
 
 /**
- * @brief Reads the contents of a file and returns it as a string.
+ * @brief A script's source code, either mapped or read into memory.
+ *
+ * The bytes are not NUL-terminated: the scanner stops after 'length' bytes.
+ */
+typedef struct {
+    const char* bytes;
+    size_t length;
+    bool mapped;        // true: munmap() it, false: free() it
+} Source;
+
+
+/**
+ * @brief Reads the contents of a file into a heap buffer.
  *
- * This function opens the file specified by the given path, reads its contents,
- * and returns the contents as a dynamically allocated string. The caller is
- * responsible for freeing the allocated memory.
+ * Used for files that cannot be mapped, like pipes or empty files.
  *
  * @param path The path to the file to be read.
- * @return A pointer to the dynamically allocated string containing the file contents,
- *         or NULL if an error occurs (e.g., the file cannot be opened).
+ * @param file The opened file.
+ * @return The file contents. Exits the process on failure.
  */
-static char* readFile(const char* path) {
-    FILE* file = fopen(path, "rb");
-    
-    // Handle failure to open the file
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
-    }
+static Source readFile(const char* path, FILE* file) {
+    size_t capacity = 4096;
+    size_t length = 0;
+    char* buffer = (char*) malloc(capacity);
 
-    // Move to the end of the file to determine its size
-    fseek(file, 0L, SEEK_END);          
-    size_t fileSize = ftell(file);      // Get current position as the size
-    rewind(file);                       // Go back to the beginning for reading
+    for (;;) {
+        // Handle memory allocation failure
+        if (buffer == NULL) {
+            fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+            exit(74);
+        }
 
-    // Allocate memory for the file content (+1 for null terminator)
-    char* buffer = (char*) malloc(fileSize + 1);
+        length += fread(buffer + length, sizeof(char), capacity - length, file);
+        if (length < capacity) break;
 
-    // Handle memory allocation failure
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+        capacity *= 2;
+        buffer = (char*) realloc(buffer, capacity);
     }
 
-    // Read the entire file into the buffer
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
     // Handle file reading failure
-    if (bytesRead < fileSize) {
+    if (ferror(file)) {
         fprintf(stderr, "Could not read file \"%s\".\n", path);
         exit(74);
     }
-    // Null-terminate the string to safely treat it as a C string
-    buffer[bytesRead] = '\0';
 
+    return (Source){buffer, length, false};
+}
+
+
+/**
+ * @brief Loads a script without copying it.
+ *
+ * Regular files are mapped read-only into memory, so tokens point straight
+ * into the page cache and a large script is never held twice. Anything that
+ * cannot be mapped falls back to readFile().
+ *
+ * @param path The path to the file to be loaded.
+ * @return The file contents. Exits the process on failure.
+ */
+static Source loadFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+
+    // Handle failure to open the file
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+
+#ifdef MAVIX_MMAP
+    struct stat info;
+    if (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        size_t length = (size_t)info.st_size;
+        void* bytes = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+
+        if (bytes != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+            madvise(bytes, length, MADV_SEQUENTIAL);    // scanned once, front to back
+#endif
+            fclose(file);
+            return (Source){bytes, length, true};
+        }
+    }
+#endif
+
+    Source source = readFile(path, file);
     fclose(file);
+    return source;
+}
+
 
-    return buffer;
+static void unloadFile(Source* source) {
+#ifdef MAVIX_MMAP
+    if (source->mapped) {
+        munmap((void*)source->bytes, source->length);
+        return;
+    }
+#endif
+    free((void*)source->bytes);
 }
 
 
 
 static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    Source source = loadFile(path);
+    InterpretResult result = interpretSource(source.bytes, source.length);
+    unloadFile(&source);
 
     // handle edge cases
+    if (result != INTERPRET_OK) flushOutput(vm.output);
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (result != INTERPRET_OK) exit(70);  // runtime error or limit hit
+}
+
+
+/**
+ * @brief Runs several scripts at once, each in its own fiber.
+ *
+ * The scripts take turns on the scheduler's worker thread while this one
+ * only loads and submits them. Exits like runFile() if any of them failed.
+ */
+static void runFiles(const char* const* paths, int count, uint64_t slice) {
+    Scheduler scheduler;
+    initScheduler(&scheduler, slice);
+    bool started = startScheduler(&scheduler);
+
+    for (int i = 0; i < count; i++) {
+        Source source = loadFile(paths[i]);
+        submitScript(&scheduler, source.bytes, source.length);
+        unloadFile(&source);
+    }
+
+    if (started) {
+        joinScheduler(&scheduler);
+    } else {
+        closeScheduler(&scheduler);
+        runScheduler(&scheduler);
+    }
+
+    bool rejected = scheduler.rejected > 0;
+    bool failed = scheduler.failed > 0 || scheduler.killed > 0;
+    freeScheduler(&scheduler);
+
+    if (rejected) exit(65);
+    if (failed) exit(70);
+}
+
+
+// Where --profile writes the samples
+static FILE* profileFile = NULL;
+
+// Runs at exit, so scripts that fail are profiled too
+static void writeProfile() {
+    stopSampling();
+    writeFoldedStacks(profileFile);
+    fclose(profileFile);
+
+    if (droppedSamples() > 0) {
+        fprintf(stderr, "Profile: %llu sample(s) dropped.\n",
+                (unsigned long long)droppedSamples());
+    }
+}
+
+
+// Where --metrics writes the metrics
+static const char* metricsPath = NULL;
+
+// Compiled scripts for --cache. Never freed: --metrics reads it at exit.
+static ChunkCache chunkCache;
+
+static void writeMetricsFile() {
+    if (!exportMetrics(metricsPath)) {
+        fprintf(stderr, "Could not write metrics to \"%s\".\n", metricsPath);
+    }
 }
 
 
 int main(int argc, const char* argv[]) {
     initVM();
+    uint64_t slice = FIBER_SLICE;
+    int sampleHz = SAMPLE_HZ;
+    const char* imagePath = NULL;
+    const char* saveImagePath = NULL;
+
+    // Leading options
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--jit") == 0) {
+            vm.jit = true;
+        } else if (strcmp(argv[arg], "--profile-loops") == 0) {
+            vm.profileLoops = true;
+        } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+            vm.gcStats = true;
+        } else if (strcmp(argv[arg], "--gc-stop-the-world") == 0) {
+            vm.heap.incremental = false;
+        } else if (strncmp(argv[arg], "--gc-pause=", 11) == 0) {
+            // Upper bound of an incremental slice, in microseconds
+            vm.heap.pauseTargetNs = strtoull(argv[arg] + 11, NULL, 10) * 1000;
+        } else if (strncmp(argv[arg], "--fuel=", 7) == 0) {
+            // Back-edges and calls a script may make
+            vm.fuelLimit = strtoull(argv[arg] + 7, NULL, 10);
+        } else if (strncmp(argv[arg], "--timeout=", 10) == 0) {
+            // Wall-clock time a script may take, in milliseconds
+            vm.timeLimitNs = strtoull(argv[arg] + 10, NULL, 10) * 1000000;
+        } else if (strncmp(argv[arg], "--slice=", 8) == 0) {
+            // Back-edges and calls per turn when running several scripts
+            slice = strtoull(argv[arg] + 8, NULL, 10);
+        } else if (strncmp(argv[arg], "--profile=", 10) == 0) {
+            // Folded stacks of the sampling profiler, for flamegraphs
+            if (profileFile != NULL) fclose(profileFile);
+            profileFile = fopen(argv[arg] + 10, "w");
+            if (profileFile == NULL) {
+                fprintf(stderr, "Could not open file \"%s\".\n", argv[arg] + 10);
+                exit(74);
+            }
+        } else if (strncmp(argv[arg], "--profile-hz=", 13) == 0) {
+            sampleHz = atoi(argv[arg] + 13);
+        } else if (strncmp(argv[arg], "--metrics=", 10) == 0) {
+            // Prometheus text format, written at exit
+            if (metricsPath == NULL) atexit(writeMetricsFile);
+            metricsPath = argv[arg] + 10;
+        } else if (strncmp(argv[arg], "--metrics-socket=", 17) == 0) {
+            // Served for as long as the process runs
+            if (serveMetrics(argv[arg] + 17)) {
+                atexit(stopServingMetrics);
+            } else {
+                fprintf(stderr, "Could not serve metrics on \"%s\".\n", argv[arg] + 17);
+            }
+        } else if (strncmp(argv[arg], "--cache=", 8) == 0) {
+            // Scripts run again (as several fibers) are compiled once
+            size_t budget = strtoull(argv[arg] + 8, NULL, 10);
+            if (vm.cache == NULL) {
+                initChunkCache(&chunkCache, budget);
+                vm.cache = &chunkCache;
+                exportChunkCache(&chunkCache);
+            } else {
+                chunkCache.budget = budget;
+            }
+        } else if (strcmp(argv[arg], "--perf") == 0 ||
+                   strncmp(argv[arg], "--perf=", 7) == 0) {
+            // Symbols of the JIT's code for Linux perf: the map in /tmp, where
+            // perf looks, the jitdump there too or in the given directory
+            if (startPerf(argv[arg][6] == '=' ? argv[arg] + 7 : "/tmp")) {
+                atexit(stopPerf);
+            } else {
+                fprintf(stderr, "Could not write the perf map or jitdump.\n");
+            }
+        } else if (strncmp(argv[arg], "--image=", 8) == 0) {
+            // Globals and functions saved by --save-image, instead of a preamble
+            imagePath = argv[arg] + 8;
+        } else if (strncmp(argv[arg], "--save-image=", 13) == 0) {
+            // The globals and functions the script or session left behind
+            saveImagePath = argv[arg] + 13;
+        } else {
+            fprintf(stderr, "Unknown option \"%s\".\n", argv[arg]);
+            fprintf(stderr, "Usage: %s [--jit] [--profile-loops] [--gc-stats]\n"
+                            "       [--gc-stop-the-world] [--gc-pause=<us>] [--fuel=<n>]\n"
+                            "       [--timeout=<ms>] [--slice=<n>] [--profile=<file>]\n"
+                            "       [--profile-hz=<n>] [--perf[=<dir>]] [--metrics=<file>]\n"
+                            "       [--metrics-socket=<path>] [--cache=<bytes>]\n"
+                            "       [--image=<file>] [--save-image=<file>]\n"
+                            "       [script...]\n", argv[0]);
+            fprintf(stderr, "Run without arguments to enter interactive mode (REPL),\n"
+                            "with several scripts to run them side by side.\n");
+            exit(64);
+        }
+    }
 
-    if (argc == 1) {
+    // Fibers of several scripts start without globals
+    if ((imagePath != NULL || saveImagePath != NULL) && argc - arg > 1) {
+        fprintf(stderr, "Images only work with one script or the REPL.\n");
+        exit(64);
+    }
+    if (imagePath != NULL && !loadImage(imagePath)) exit(74);
+
+    if (profileFile != NULL) {
+        if (startSampling(sampleHz)) {
+            atexit(writeProfile);
+        } else {
+            fprintf(stderr, "Sampling is not available, no profile is written.\n");
+            fclose(profileFile);
+        }
+    }
+
+    if (arg == argc) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (arg == argc - 1) {
+        runFile(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: %s [script]\n", argv[0]);
-        fprintf(stderr, "Run without arguments to enter interactive mode (REPL).\n");
-        exit(64);
+        runFiles(argv + arg, argc - arg, slice);
     }
+    if (saveImagePath != NULL && !saveImage(saveImagePath)) exit(74);
 
     freeVM();
     return 0;
@@ -1,10 +1,22 @@
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "compiler.h"
 #include "memory.h"
+#include "metrics.h"
+#include "object.h"
+#include "vm.h"
 
 // Function for handling all dynamic memory management in "mavix"
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    if (newSize > oldSize) {
+        countMetric(METRIC_ALLOCATED_BYTES, newSize - oldSize);
+    } else {
+        countMetric(METRIC_FREED_BYTES, oldSize - newSize);
+    }
+
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -14,4 +26,572 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     // handle edge cases
     if (result == NULL) exit(1);
     return result;
-}
\ No newline at end of file
+}
+
+
+
+/*
+#####################################
+Objects
+#####################################
+*/
+
+// Objects in the nursery are 16-byte aligned, like malloc()'s
+#define ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+static size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+    }
+    return 0;   // Unreachable.
+}
+
+
+// Frees what the object owns, but not its own memory
+static void finalizeObject(Obj* object) {
+    switch (object->type) {
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            freeChunk(&function->chunk);
+            FREE_ARRAY(char, function->name, function->nameLength);
+            break;
+        }
+    }
+}
+
+
+static void freeObject(Obj* object) {
+    finalizeObject(object);
+    reallocate(object, objectSize(object), 0);
+}
+
+
+static uint64_t nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+static void pushObject(Obj*** stack, int* count, int* capacity, Obj* object) {
+    if (*capacity < *count + 1) {
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *stack = GROW_ARRAY(Obj*, *stack, oldCapacity, *capacity);
+    }
+    (*stack)[(*count)++] = object;
+}
+
+
+// Turns a white old object gray
+static void shade(Obj* object) {
+    if (!object->isOld || object->isMarked) return;
+    object->isMarked = true;
+    pushObject(&vm.heap.gray, &vm.heap.grayCount, &vm.heap.grayCapacity, object);
+}
+
+
+/* @note
+ * New old objects (promoted, or too large for the nursery) are gray while
+ * marking, so the marker still scans what they reference. While sweeping
+ * they are kept apart: the sweeper must not see them unmarked.
+ * */
+static void linkOld(Obj* object) {
+    Heap* heap = &vm.heap;
+    object->isMarked = false;
+
+    if (heap->phase == GC_SWEEPING) {
+        object->next = heap->fresh;
+        heap->fresh = object;
+        return;
+    }
+
+    object->next = heap->objects;
+    heap->objects = object;
+    if (heap->phase == GC_MARKING) shade(object);
+}
+
+
+Obj* allocateObject(size_t size, ObjType type) {
+    Heap* heap = &vm.heap;
+    size_t aligned = ALIGN(size);
+    Obj* object;
+
+    // Allocation pays for the incremental collection under way. This comes
+    // first: a slice may empty the nursery, which must not hold the new
+    // object before it is initialized and reachable.
+    heap->debt += aligned;
+    if (heap->phase != GC_IDLE && heap->debt >= GC_SLICE_BYTES) gcStep();
+
+    if (aligned > NURSERY_SIZE) {
+        // Too big to ever be moved cheaply: straight into the old generation
+        object = (Obj*)reallocate(NULL, 0, size);
+        object->type = type;
+        object->isOld = true;
+        linkOld(object);
+        heap->stats.oldBytes += size;
+    } else {
+        if (heap->nurseryTop + aligned > heap->nurseryEnd) collectGarbage(false);
+
+        object = (Obj*)heap->nurseryTop;
+        heap->nurseryTop += aligned;
+        heap->stats.nurseryBytes += aligned;
+        object->type = type;
+        object->isOld = false;
+        object->isMarked = false;
+        object->next = NULL;    // becomes the forwarding address when moved
+    }
+    object->isRemembered = false;
+    return object;
+}
+
+
+/* @note
+ * Two invariants meet here. Generational: an old object pointing into the
+ * nursery is remembered, the minor collection treats it as a root. Marking:
+ * a black object must never point to a white one, so while marking the new
+ * referent is shaded (the roots need no barrier, they are scanned again
+ * when marking finishes).
+ * */
+void writeBarrier(Obj* owner, Value value) {
+    if (!IS_OBJ(value) || !owner->isOld) return;
+    Heap* heap = &vm.heap;
+    Obj* referent = AS_OBJ(value);
+
+    if (heap->phase == GC_MARKING && owner->isMarked) shade(referent);
+
+    if (referent->isOld || owner->isRemembered) return;
+    pushObject(&heap->remembered, &heap->rememberedCount,
+               &heap->rememberedCapacity, owner);
+    owner->isRemembered = true;
+}
+
+
+void initHeap(Heap* heap) {
+    heap->nursery = ALLOCATE(uint8_t, NURSERY_SIZE);
+    heap->nurseryTop = heap->nursery;
+    heap->nurseryEnd = heap->nursery + NURSERY_SIZE;
+
+    heap->objects = NULL;
+    heap->nextMajor = FIRST_MAJOR_GC;
+
+    heap->remembered = NULL;
+    heap->rememberedCount = 0;
+    heap->rememberedCapacity = 0;
+    heap->gray = NULL;
+    heap->grayCount = 0;
+    heap->grayCapacity = 0;
+    heap->scan = NULL;
+    heap->scanCount = 0;
+    heap->scanCapacity = 0;
+
+    heap->incremental = true;
+    heap->pauseTargetNs = GC_PAUSE_TARGET_NS;
+    heap->phase = GC_IDLE;
+    heap->debt = 0;
+    heap->sweepLink = NULL;
+    heap->fresh = NULL;
+
+    memset(&heap->stats, 0, sizeof(heap->stats));
+}
+
+
+// Calls 'visit' on every object in the nursery, in allocation order
+static void walkNursery(Heap* heap, void (*visit)(Obj* object)) {
+    uint8_t* cursor = heap->nursery;
+    while (cursor < heap->nurseryTop) {
+        Obj* object = (Obj*)cursor;
+        cursor += ALIGN(objectSize(object));
+        visit(object);
+    }
+}
+
+
+// A moved object's copy owns its memory now
+static void finalizeUnmoved(Obj* object) {
+    if (object->next == NULL) finalizeObject(object);
+}
+
+
+static void freeList(Obj* object) {
+    while (object != NULL) {
+        Obj* next = object->next;
+        freeObject(object);
+        object = next;
+    }
+}
+
+
+void freeHeap(Heap* heap) {
+    freeList(heap->objects);
+    freeList(heap->fresh);
+    heap->objects = heap->fresh = NULL;
+    heap->phase = GC_IDLE;
+
+    walkNursery(heap, finalizeUnmoved);
+    FREE_ARRAY(uint8_t, heap->nursery, NURSERY_SIZE);
+    heap->nursery = heap->nurseryTop = heap->nurseryEnd = NULL;
+
+    FREE_ARRAY(Obj*, heap->remembered, heap->rememberedCapacity);
+    FREE_ARRAY(Obj*, heap->gray, heap->grayCapacity);
+    FREE_ARRAY(Obj*, heap->scan, heap->scanCapacity);
+    heap->remembered = heap->gray = heap->scan = NULL;
+    heap->rememberedCount = heap->rememberedCapacity = 0;
+    heap->grayCount = heap->grayCapacity = 0;
+    heap->scanCount = heap->scanCapacity = 0;
+}
+
+
+
+/*
+#####################################
+Collection
+#####################################
+*/
+
+// Whether markObject() moves nursery objects (minor) or marks old ones (major)
+static bool evacuating;
+
+
+// Moves a nursery object into the old generation, leaving its new address behind
+static Obj* evacuate(Obj* object) {
+    if (object->isOld) return object;
+    if (object->next != NULL) return object->next;     // moved already
+
+    size_t size = objectSize(object);
+    Obj* copy = (Obj*)reallocate(NULL, 0, size);
+    memcpy(copy, object, size);
+    copy->isOld = true;
+    linkOld(copy);
+
+    object->next = copy;
+    vm.heap.stats.promotedBytes += size;
+    vm.heap.stats.oldBytes += size;
+
+    // Its references may point into the nursery too
+    pushObject(&vm.heap.scan, &vm.heap.scanCount, &vm.heap.scanCapacity, copy);
+    return copy;
+}
+
+
+void markObject(Obj** slot) {
+    Obj* object = *slot;
+    if (object == NULL) return;
+
+    if (evacuating) {
+        *slot = evacuate(object);
+        return;
+    }
+    // Nursery objects are not part of a major collection
+    shade(object);
+}
+
+
+void markValue(Value* slot) {
+    if (IS_OBJ(*slot)) markObject(&slot->as.obj);
+}
+
+
+void markChunk(Chunk* chunk) {
+    for (int i = 0; i < chunk->constants.count; i++) {
+        markValue(&chunk->constants.values[i]);
+    }
+}
+
+
+static void blackenObject(Obj* object) {
+    switch (object->type) {
+        case OBJ_FUNCTION:
+            markChunk(&((ObjFunction*)object)->chunk);
+            break;
+    }
+}
+
+
+static void markCacheRoots(ChunkCache* cache) {
+    for (int i = 0; i < cache->bucketCount; i++) {
+        for (CacheEntry* entry = cache->buckets[i]; entry != NULL; entry = entry->next) {
+            markChunk(&entry->chunk);
+        }
+    }
+}
+
+
+// A suspended fiber's roots, like the running one's below
+static void markFiber(Fiber* fiber) {
+    for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) markValue(slot);
+
+    markObject((Obj**)&fiber->function);
+    for (int i = 0; i < fiber->frameCount; i++) markObject((Obj**)&fiber->frames[i].function);
+
+    for (int i = 0; i < vm.globals.count; i++) markValue(&fiber->globals[i]);
+    if (fiber->script != NULL) markChunk(fiber->script);
+}
+
+
+/* @note
+ * Roots: the stack, the running function and the suspended callers, the
+ * globals, the same for every other fiber, the chunks that are not objects
+ * themselves (the scripts being run, the cached chunks) and whatever the
+ * compiler is working on.
+ * */
+static void markRoots() {
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) markValue(slot);
+
+    markObject((Obj**)&vm.function);
+    for (int i = 0; i < vm.frameCount; i++) markObject((Obj**)&vm.frames[i].function);
+
+    // The running fiber's registers are in the VM, the others' in the fibers
+    for (Fiber* fiber = vm.fibers; fiber != NULL; fiber = fiber->next) {
+        if (fiber != vm.fiber) markFiber(fiber);
+    }
+
+    for (int i = 0; i < vm.globals.count; i++) markValue(&vm.globals.values[i]);
+
+    if (vm.script != NULL) markChunk(vm.script);
+    markChunk(&vm.session);
+    if (vm.cache != NULL) markCacheRoots(vm.cache);
+    markCompilerRoots();
+}
+
+
+static void recordPause(uint64_t pause) {
+    GcStats* stats = &vm.heap.stats;
+    stats->lastPauseNs = pause;
+    stats->totalPauseNs += pause;
+    stats->pauses++;
+    if (pause > stats->maxPauseNs) stats->maxPauseNs = pause;
+
+    int bucket = 0;
+    for (uint64_t micros = pause / 1000; micros > 1 && bucket < PAUSE_BUCKETS - 1; micros >>= 1) {
+        bucket++;
+    }
+    stats->pauseHistogram[bucket]++;
+}
+
+
+static void minorCollection() {
+    Heap* heap = &vm.heap;
+    evacuating = true;
+
+    markRoots();
+    // Old objects that were given nursery references since the last collection
+    for (int i = 0; i < heap->rememberedCount; i++) {
+        heap->remembered[i]->isRemembered = false;
+        blackenObject(heap->remembered[i]);
+    }
+    heap->rememberedCount = 0;
+    while (heap->scanCount > 0) blackenObject(heap->scan[--heap->scanCount]);
+
+    walkNursery(heap, finalizeUnmoved);
+    heap->nurseryTop = heap->nursery;
+    heap->stats.nurseryBytes = 0;
+    evacuating = false;
+
+    // The running chunk belongs to a function that may have moved
+    if (vm.function != NULL) vm.chunk = &vm.function->chunk;
+    heap->stats.minorCollections++;
+}
+
+
+static void startMajor() {
+    Heap* heap = &vm.heap;
+    heap->phase = GC_MARKING;
+    heap->debt = 0;
+    markRoots();
+    requestSafepoint();     // back-edges and calls start paying for slices
+}
+
+
+/* @note
+ * Scans gray objects until none is left or the deadline passes, but always
+ * at least 'minimum' bytes of them: marking must outpace the allocation
+ * that paid for the slice (new objects start gray), or it never finishes.
+ * The pause target is therefore a soft bound.
+ * */
+static bool markSome(uint64_t deadline, size_t minimum) {
+    Heap* heap = &vm.heap;
+    size_t scanned = 0;
+
+    while (heap->grayCount > 0) {
+        for (int i = 0; i < 64 && heap->grayCount > 0; i++) {
+            Obj* object = heap->gray[--heap->grayCount];
+            scanned += objectSize(object);
+            blackenObject(object);
+        }
+        if (scanned >= minimum && nanoseconds() >= deadline) break;
+    }
+    return heap->grayCount == 0;
+}
+
+
+/* @note
+ * The only non-incremental step: nursery objects and roots are not covered
+ * by the barrier, so the nursery is emptied (its survivors become gray) and
+ * the roots are marked again, then tracing finishes. Its cost depends on the
+ * roots and on what changed since the last slice, not on the heap size.
+ * */
+static void finishMarking() {
+    Heap* heap = &vm.heap;
+    minorCollection();
+    markRoots();
+    markSome(UINT64_MAX, 0);
+
+    heap->phase = GC_SWEEPING;
+    heap->sweepLink = &heap->objects;
+}
+
+
+static void forget(Obj* object) {
+    Heap* heap = &vm.heap;
+    for (int i = 0; i < heap->rememberedCount; i++) {
+        if (heap->remembered[i] == object) {
+            heap->remembered[i] = heap->remembered[--heap->rememberedCount];
+            return;
+        }
+    }
+}
+
+
+// Sweeps objects until the end of the list or the deadline (but at least
+// 'minimum' bytes of them, like markSome()).
+static bool sweepSome(uint64_t deadline, size_t minimum) {
+    Heap* heap = &vm.heap;
+    size_t swept = 0;
+    int count = 0;
+
+    while (*heap->sweepLink != NULL) {
+        Obj* object = *heap->sweepLink;
+        size_t size = objectSize(object);
+        swept += size;
+
+        if (object->isMarked) {
+            object->isMarked = false;
+            heap->sweepLink = &object->next;
+        } else {
+            *heap->sweepLink = object->next;
+            if (object->isRemembered) forget(object);
+
+            heap->stats.oldBytes -= size;
+            heap->stats.freedBytes += size;
+            freeObject(object);
+        }
+
+        if (++count % 64 == 0 && swept >= minimum && nanoseconds() >= deadline) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void finishMajor() {
+    Heap* heap = &vm.heap;
+
+    // Objects promoted meanwhile join the old generation
+    while (heap->fresh != NULL) {
+        Obj* object = heap->fresh;
+        heap->fresh = object->next;
+        object->next = heap->objects;
+        heap->objects = object;
+    }
+
+    heap->phase = GC_IDLE;
+    heap->sweepLink = NULL;
+    heap->nextMajor = heap->stats.oldBytes * HEAP_GROW_FACTOR;
+    if (heap->nextMajor < FIRST_MAJOR_GC) heap->nextMajor = FIRST_MAJOR_GC;
+    heap->stats.majorCollections++;
+}
+
+
+// Advances the major collection until the deadline; returns true when done.
+static bool advanceMajor(uint64_t deadline, size_t minimum) {
+    Heap* heap = &vm.heap;
+    if (heap->phase == GC_MARKING) {
+        if (!markSome(deadline, minimum)) return false;
+        finishMarking();
+    }
+    if (heap->phase == GC_SWEEPING) {
+        if (!sweepSome(deadline, minimum)) return false;
+        finishMajor();
+    }
+    return true;
+}
+
+
+void gcStep() {
+    Heap* heap = &vm.heap;
+    if (heap->phase == GC_IDLE) return;
+
+    uint64_t start = nanoseconds();
+    size_t minimum = heap->debt * 2;
+    heap->debt = 0;
+    advanceMajor(start + heap->pauseTargetNs, minimum);
+
+    heap->stats.slices++;
+    recordPause(nanoseconds() - start);
+}
+
+
+void gcSafepoint(uint64_t ticks) {
+    Heap* heap = &vm.heap;
+    heap->debt += ticks * GC_SAFEPOINT_DEBT;
+    if (heap->debt >= GC_SLICE_BYTES) gcStep();
+}
+
+
+void collectGarbage(bool major) {
+    Heap* heap = &vm.heap;
+    uint64_t start = nanoseconds();
+
+    minorCollection();
+
+    if (heap->phase == GC_IDLE &&
+        (major || heap->stats.oldBytes > heap->nextMajor)) {
+        startMajor();
+        // The slices follow as the program allocates or runs
+        if (heap->incremental && !major) {
+            recordPause(nanoseconds() - start);
+            return;
+        }
+    }
+
+    // An explicit major collection completes the one under way
+    if (heap->phase != GC_IDLE && (major || !heap->incremental)) {
+        advanceMajor(UINT64_MAX, 0);
+    }
+    recordPause(nanoseconds() - start);
+}
+
+
+void printGcStats(FILE* file) {
+    GcStats* stats = &vm.heap.stats;
+
+    fprintf(file, "== gc ==\n");
+    fprintf(file, "collections  %llu minor, %llu major, %llu slices\n",
+            (unsigned long long)stats->minorCollections,
+            (unsigned long long)stats->majorCollections,
+            (unsigned long long)stats->slices);
+    fprintf(file, "pauses       %.3f ms total, %.3f ms max, %.3f ms mean\n",
+            stats->totalPauseNs / 1e6, stats->maxPauseNs / 1e6,
+            stats->pauses == 0 ? 0.0 : stats->totalPauseNs / 1e6 / (double)stats->pauses);
+    fprintf(file, "heap         %zu bytes old, %zu bytes in the nursery\n",
+            stats->oldBytes, stats->nurseryBytes);
+    fprintf(file, "promoted     %zu bytes, freed %zu bytes\n",
+            stats->promotedBytes, stats->freedBytes);
+
+    // Pause histogram, from the shortest to the longest pause seen
+    int first = 0;
+    int last = PAUSE_BUCKETS - 1;
+    while (first < last && stats->pauseHistogram[first] == 0) first++;
+    while (last > first && stats->pauseHistogram[last] == 0) last--;
+    for (int i = first; i <= last && stats->pauses > 0; i++) {
+        if (i == PAUSE_BUCKETS - 1) {
+            fprintf(file, "  >= %6llu us  %llu\n", 1ULL << i,
+                    (unsigned long long)stats->pauseHistogram[i]);
+        } else {
+            fprintf(file, "  < %7llu us  %llu\n", 2ULL << i,
+                    (unsigned long long)stats->pauseHistogram[i]);
+        }
+    }
+}
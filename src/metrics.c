@@ -0,0 +1,355 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MAVIX_METRICS_SOCKET
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+_Thread_local MetricShard* metricShard = NULL;
+
+// Every shard ever registered, newest first
+static _Atomic(MetricShard*) shards = NULL;
+
+// See exportChunkCache()
+static _Atomic(ChunkCache*) exportedCache = NULL;
+
+// Upper bounds of the histograms' buckets but the last (+Inf)
+static const uint64_t chunkByteBounds[HISTOGRAM_BUCKETS - 1] = {
+    16, 64, 256, 1024, 4096, 16384, 65536,
+};
+static const uint64_t constantBounds[HISTOGRAM_BUCKETS - 1] = {
+    0, 1, 4, 16, 64, 128, 256,
+};
+
+static const char* errorKindNames[ERROR_KIND_COUNT] = {
+    [ERROR_TYPE] = "type",
+    [ERROR_UNDEFINED] = "undefined_variable",
+    [ERROR_CALL] = "call",
+    [ERROR_STACK_OVERFLOW] = "stack_overflow",
+    [ERROR_NATIVE] = "native",
+    [ERROR_FUEL] = "out_of_fuel",
+    [ERROR_DEADLINE] = "deadline",
+};
+
+
+/* @note
+ * Shards are allocated with calloc() rather than reallocate(), which counts
+ * its bytes into a shard itself. Pushing one is the only write to the list,
+ * so readers can walk it at any time.
+ * */
+MetricShard* registerShard() {
+    MetricShard* shard = calloc(1, sizeof(MetricShard));
+    if (shard == NULL) exit(1);
+
+    MetricShard* head = atomic_load_explicit(&shards, memory_order_relaxed);
+    do {
+        shard->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&shards, &head, shard,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    metricShard = shard;
+    return shard;
+}
+
+
+static void observe(Histogram* histogram, const uint64_t* bounds, uint64_t value) {
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && value > bounds[bucket]) bucket++;
+    addCount(&histogram->counts[bucket], 1);
+    addCount(&histogram->sum, value);
+}
+
+
+void observeChunk(int bytes, int constants) {
+    MetricShard* shard = currentShard();
+    observe(&shard->chunkBytes, chunkByteBounds, (uint64_t)bytes);
+    observe(&shard->chunkConstants, constantBounds, (uint64_t)constants);
+}
+
+
+uint64_t metricClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+static uint64_t load(const atomic_uint_fast64_t* counter) {
+    return atomic_load_explicit((atomic_uint_fast64_t*)counter, memory_order_relaxed);
+}
+
+static MetricShard* firstShard() {
+    return atomic_load_explicit(&shards, memory_order_acquire);
+}
+
+
+uint64_t metricValue(Metric metric) {
+    uint64_t total = 0;
+    for (MetricShard* shard = firstShard(); shard != NULL; shard = shard->next) {
+        total += load(&shard->counters[metric]);
+    }
+    return total;
+}
+
+
+uint64_t runtimeErrors(ErrorKind kind) {
+    uint64_t total = 0;
+    for (MetricShard* shard = firstShard(); shard != NULL; shard = shard->next) {
+        total += load(&shard->errors[kind]);
+    }
+    return total;
+}
+
+
+
+/*
+#####################################
+Exposition
+#####################################
+*/
+
+static void writeHeader(FILE* file, const char* name, const char* type, const char* help) {
+    fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+static void writeCounter(FILE* file, const char* name, const char* help, Metric metric) {
+    writeHeader(file, name, "counter", help);
+    fprintf(file, "%s %" PRIu64 "\n", name, metricValue(metric));
+}
+
+
+static void writeGauge(FILE* file, const char* name, const char* help, uint64_t value) {
+    writeHeader(file, name, "gauge", help);
+    fprintf(file, "%s %" PRIu64 "\n", name, value);
+}
+
+
+// 'histogram' is the offset of the Histogram within a shard
+static void writeHistogram(FILE* file, const char* name, const char* help,
+                           size_t histogram, const uint64_t* bounds) {
+    uint64_t counts[HISTOGRAM_BUCKETS] = {0};
+    uint64_t sum = 0;
+    for (MetricShard* shard = firstShard(); shard != NULL; shard = shard->next) {
+        Histogram* part = (Histogram*)((char*)shard + histogram);
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) counts[i] += load(&part->counts[i]);
+        sum += load(&part->sum);
+    }
+
+    writeHeader(file, name, "histogram", help);
+    uint64_t cumulative = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        cumulative += counts[i];
+        if (i < HISTOGRAM_BUCKETS - 1) {
+            fprintf(file, "%s_bucket{le=\"%" PRIu64 "\"} %" PRIu64 "\n",
+                    name, bounds[i], cumulative);
+        } else {
+            fprintf(file, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, cumulative);
+        }
+    }
+    fprintf(file, "%s_sum %" PRIu64 "\n%s_count %" PRIu64 "\n", name, sum, name, cumulative);
+}
+
+
+void exportChunkCache(ChunkCache* cache) {
+    atomic_store(&exportedCache, cache);
+}
+
+
+void writeMetrics(FILE* file) {
+#ifdef COUNT_INSTRUCTIONS
+    writeCounter(file, "mavix_instructions_total",
+                 "Bytecode instructions executed.", METRIC_INSTRUCTIONS);
+#endif
+    writeCounter(file, "mavix_ticks_total",
+                 "Back-edges and calls executed.", METRIC_TICKS);
+
+    writeCounter(file, "mavix_compilations_total",
+                 "Scripts and expressions compiled.", METRIC_COMPILES);
+    writeCounter(file, "mavix_compile_errors_total",
+                 "Compilations that failed.", METRIC_COMPILE_ERRORS);
+    writeHeader(file, "mavix_compile_seconds_total", "counter",
+                "Time spent compiling.");
+    fprintf(file, "mavix_compile_seconds_total %.9f\n",
+            (double)metricValue(METRIC_COMPILE_NS) / 1e9);
+
+    ChunkCache* cache = atomic_load(&exportedCache);
+    if (cache != NULL) {
+        ChunkCacheStats stats = chunkCacheStats(cache);
+        writeHeader(file, "mavix_chunk_cache_hits_total", "counter",
+                    "Scripts found compiled in the chunk cache.");
+        fprintf(file, "mavix_chunk_cache_hits_total %" PRIu64 "\n", stats.hits);
+        writeHeader(file, "mavix_chunk_cache_misses_total", "counter",
+                    "Scripts compiled into the chunk cache.");
+        fprintf(file, "mavix_chunk_cache_misses_total %" PRIu64 "\n", stats.misses);
+        writeHeader(file, "mavix_chunk_cache_evictions_total", "counter",
+                    "Chunks evicted to stay within the cache's budget.");
+        fprintf(file, "mavix_chunk_cache_evictions_total %" PRIu64 "\n", stats.evictions);
+        writeGauge(file, "mavix_chunk_cache_entries", "Chunks in the cache.",
+                   (uint64_t)stats.count);
+        writeGauge(file, "mavix_chunk_cache_bytes", "Bytes charged against the cache's budget.",
+                   (uint64_t)stats.bytes);
+    }
+
+    writeHistogram(file, "mavix_chunk_bytes",
+                   "Bytecode size of each compiled function and script.",
+                   offsetof(MetricShard, chunkBytes), chunkByteBounds);
+    writeHistogram(file, "mavix_chunk_constants",
+                   "Constant pool size of each compiled function and script.",
+                   offsetof(MetricShard, chunkConstants), constantBounds);
+
+    writeCounter(file, "mavix_allocated_bytes_total",
+                 "Bytes allocated through reallocate().", METRIC_ALLOCATED_BYTES);
+    writeCounter(file, "mavix_freed_bytes_total",
+                 "Bytes freed through reallocate().", METRIC_FREED_BYTES);
+
+    writeHeader(file, "mavix_runtime_errors_total", "counter", "Runtime errors by kind.");
+    for (int kind = 0; kind < ERROR_KIND_COUNT; kind++) {
+        fprintf(file, "mavix_runtime_errors_total{kind=\"%s\"} %" PRIu64 "\n",
+                errorKindNames[kind], runtimeErrors((ErrorKind)kind));
+    }
+}
+
+
+bool exportMetrics(const char* path) {
+    size_t length = strlen(path);
+    char* temporary = malloc(length + 5);
+    if (temporary == NULL) return false;
+    memcpy(temporary, path, length);
+    memcpy(temporary + length, ".tmp", 5);
+
+    FILE* file = fopen(temporary, "w");
+    bool written = file != NULL;
+    if (written) {
+        writeMetrics(file);
+        written = fclose(file) == 0 && rename(temporary, path) == 0;
+        if (!written) remove(temporary);
+    }
+    free(temporary);
+    return written;
+}
+
+
+
+/*
+#####################################
+Unix socket
+#####################################
+*/
+
+#ifdef MAVIX_METRICS_SOCKET
+
+static struct {
+    int socket;             // -1: not serving
+    pthread_t thread;
+    char path[sizeof(((struct sockaddr_un*)NULL)->sun_path)];
+} server = {-1, 0, ""};
+
+
+// Reads the request, if the client sends one, so closing does not cut it off
+static void skipRequest(int client) {
+    struct timeval timeout = {0, 100000};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char request[4096];
+    size_t count = 0;
+    while (count < sizeof(request) - 1) {
+        ssize_t received = recv(client, request + count, sizeof(request) - 1 - count, 0);
+        if (received <= 0) break;
+        count += (size_t)received;
+        request[count] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL) break;
+    }
+}
+
+
+static void respond(int client) {
+    char* body = NULL;
+    size_t length = 0;
+    FILE* file = open_memstream(&body, &length);
+    if (file == NULL) return;
+    writeMetrics(file);
+    fclose(file);
+
+    char header[128];
+    int headerLength = snprintf(header, sizeof(header),
+                                "HTTP/1.0 200 OK\r\n"
+                                "Content-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\n\r\n", length);
+    send(client, header, (size_t)headerLength, MSG_NOSIGNAL);
+    send(client, body, length, MSG_NOSIGNAL);
+    free(body);
+}
+
+
+static void* serve(void* unused) {
+    (void)unused;
+    for (;;) {
+        int client = accept(server.socket, NULL, NULL);
+        if (client < 0) break;      // shut down by stopServingMetrics()
+        skipRequest(client);
+        respond(client);
+        close(client);
+    }
+    return NULL;
+}
+
+
+bool serveMetrics(const char* path) {
+    struct sockaddr_un address;
+    if (server.socket >= 0 || strlen(path) >= sizeof(address.sun_path)) return false;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) return false;
+    unlink(path);       // left behind by an earlier process
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, 8) != 0) {
+        close(listener);
+        return false;
+    }
+
+    server.socket = listener;
+    strcpy(server.path, path);
+    if (pthread_create(&server.thread, NULL, serve, NULL) != 0) {
+        close(listener);
+        unlink(path);
+        server.socket = -1;
+        return false;
+    }
+    return true;
+}
+
+
+void stopServingMetrics() {
+    if (server.socket < 0) return;
+    shutdown(server.socket, SHUT_RDWR);     // wakes up accept()
+    pthread_join(server.thread, NULL);
+    close(server.socket);
+    unlink(server.path);
+    server.socket = -1;
+}
+
+#else
+
+bool serveMetrics(const char* path) {
+    (void)path;
+    return false;
+}
+
+
+void stopServingMetrics() {
+}
+
+#endif
@@ -0,0 +1,158 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "native.h"
+#include "vm.h"
+
+// Why the last native failed, until the VM reports it
+static char errorMessage[256];
+
+
+int defineNative(const char* name, int arity, NativeFn function) {
+    Natives* natives = &vm.natives;
+    int length = (int)strlen(name);
+
+    int slot = nativeSlot(name, length);
+    if (slot < 0) {
+        if (natives->count == NATIVES_MAX) return -1;
+        slot = natives->count++;
+        natives->names[slot] = name;
+        natives->lengths[slot] = length;
+    }
+    natives->arities[slot] = arity;
+    natives->functions[slot] = function;
+    return slot;
+}
+
+
+int nativeSlot(const char* name, int length) {
+    Natives* natives = &vm.natives;
+    for (int i = 0; i < natives->count; i++) {
+        if (natives->lengths[i] == length &&
+            memcmp(natives->names[i], name, length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+void nativeError(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(errorMessage, sizeof(errorMessage), format, args);
+    va_end(args);
+}
+
+
+const char* nativeErrorMessage() {
+    return errorMessage;
+}
+
+
+
+/*
+#####################################
+Core natives
+#####################################
+*/
+
+static bool numericArguments(int argCount, Value* args, const char* name) {
+    for (int i = 0; i < argCount; i++) {
+        if (!IS_NUMERIC(args[i])) {
+            nativeError("%s() expects numbers.", name);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Seconds of processor time used so far
+static bool clockNative(int argCount, Value* args, Value* result) {
+    (void)argCount;
+    (void)args;
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+
+static bool sqrtNative(int argCount, Value* args, Value* result) {
+    if (!numericArguments(argCount, args, "sqrt")) return false;
+    *result = NUMBER_VAL(sqrt(TO_DOUBLE(args[0])));
+    return true;
+}
+
+
+// Ints stay ints, except for INT64_MIN (like negation)
+static bool absNative(int argCount, Value* args, Value* result) {
+    if (!numericArguments(argCount, args, "abs")) return false;
+    if (IS_INT(args[0])) {
+        int64_t value = AS_INT(args[0]);
+        if (value >= 0) {
+            *result = args[0];
+        } else {
+            *result = value == INT64_MIN ? NUMBER_VAL(-(double)value) : INT_VAL(-value);
+        }
+        return true;
+    }
+    *result = NUMBER_VAL(fabs(AS_NUMBER(args[0])));
+    return true;
+}
+
+
+static bool floorNative(int argCount, Value* args, Value* result) {
+    if (!numericArguments(argCount, args, "floor")) return false;
+    *result = IS_INT(args[0]) ? args[0] : NUMBER_VAL(floor(AS_NUMBER(args[0])));
+    return true;
+}
+
+
+/* @note
+ * min() and max() take any number of arguments (at least one) and return
+ * one of them unchanged. Mixed ints and doubles are compared exactly, and a
+ * NaN among them is the result.
+ * */
+static bool extremum(int argCount, Value* args, Value* result,
+                     const char* name, int sign) {
+    if (argCount == 0) {
+        nativeError("%s() expects at least one argument.", name);
+        return false;
+    }
+    if (!numericArguments(argCount, args, name)) return false;
+
+    Value best = args[0];
+    for (int i = 1; i < argCount; i++) {
+        int order = compareNumbers(args[i], best);
+        if (order == UNORDERED) {
+            if (isnan(TO_DOUBLE(args[i]))) best = args[i];
+            break;
+        }
+        if (order * sign > 0) {
+            best = args[i];
+        }
+    }
+    *result = best;
+    return true;
+}
+
+static bool minNative(int argCount, Value* args, Value* result) {
+    return extremum(argCount, args, result, "min", -1);
+}
+
+static bool maxNative(int argCount, Value* args, Value* result) {
+    return extremum(argCount, args, result, "max", 1);
+}
+
+
+void defineCoreNatives() {
+    defineNative("clock", 0, clockNative);
+    defineNative("sqrt", 1, sqrtNative);
+    defineNative("abs", 1, absNative);
+    defineNative("floor", 1, floorNative);
+    defineNative("min", -1, minNative);
+    defineNative("max", -1, maxNative);
+}
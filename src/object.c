@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#define ALLOCATE_OBJ(type, objectType) \
+    (type*)allocateObject(sizeof(type), objectType)
+
+
+ObjFunction* newFunction(const char* name, int length) {
+    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    function->arity = 0;
+    initChunk(&function->chunk);
+
+    function->name = ALLOCATE(char, length);
+    memcpy(function->name, name, length);
+    function->nameLength = length;
+    return function;
+}
+
+
+void printObject(Value value) {
+    switch (OBJ_TYPE(value)) {
+        case OBJ_FUNCTION: {
+            ObjFunction* function = AS_FUNCTION(value);
+            printf("<fn %.*s>", function->nameLength, function->name);
+            break;
+        }
+    }
+}
+
+
+void writeObject(OutputSink* sink, Value value) {
+    switch (OBJ_TYPE(value)) {
+        case OBJ_FUNCTION: {
+            ObjFunction* function = AS_FUNCTION(value);
+            writeOutput(sink, "<fn ", 4);
+            writeOutput(sink, function->name, (size_t)function->nameLength);
+            writeOutput(sink, ">", 1);
+            break;
+        }
+    }
+}
@@ -0,0 +1,259 @@
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "output.h"
+
+__extension__ typedef unsigned __int128 uint128_t;
+
+
+// The sink is the buffer: stdio must not hold output back behind stderr
+static void writeFile(void* context, const char* bytes, size_t length) {
+    fwrite(bytes, 1, length, (FILE*)context);
+    fflush((FILE*)context);
+}
+
+
+void initOutputSink(OutputSink* sink, OutputFn flush, void* context) {
+    sink->count = 0;
+    sink->flush = flush;
+    sink->context = context;
+    sink->capacity = flush == NULL ? 0 : OUTPUT_BUFFER_SIZE;
+    sink->buffer = flush == NULL ? NULL : GROW_ARRAY(char, NULL, 0, sink->capacity);
+}
+
+void initFileSink(OutputSink* sink, FILE* file) {
+    initOutputSink(sink, writeFile, file);
+}
+
+void initMemorySink(OutputSink* sink) {
+    initOutputSink(sink, NULL, NULL);
+}
+
+void freeOutputSink(OutputSink* sink) {
+    flushOutput(sink);
+    FREE_ARRAY(char, sink->buffer, sink->capacity);
+    sink->buffer = NULL;
+    sink->capacity = 0;
+    sink->count = 0;
+}
+
+
+void flushOutput(OutputSink* sink) {
+    // A memory sink keeps its output until the embedder takes it
+    if (sink->flush == NULL || sink->count == 0) return;
+    sink->flush(sink->context, sink->buffer, sink->count);
+    sink->count = 0;
+}
+
+
+void writeOutput(OutputSink* sink, const char* bytes, size_t length) {
+    if (sink->capacity < sink->count + length) {
+        if (sink->flush == NULL) {
+            size_t oldCapacity = sink->capacity;
+            while (sink->capacity < sink->count + length) {
+                sink->capacity = GROW_CAPACITY(sink->capacity);
+            }
+            sink->buffer = GROW_ARRAY(char, sink->buffer, oldCapacity, sink->capacity);
+        } else {
+            flushOutput(sink);
+            // Too big to buffer at all: hand it over directly
+            if (length > sink->capacity) {
+                sink->flush(sink->context, bytes, length);
+                return;
+            }
+        }
+    }
+
+    memcpy(sink->buffer + sink->count, bytes, length);
+    sink->count += length;
+}
+
+
+/*
+#####################################
+Number formatting
+#####################################
+*/
+
+static uint128_t powerOfTen(int exponent) {
+    uint128_t power = 1;
+    while (exponent-- > 0) power *= 10;
+    return power;
+}
+
+
+/**
+ * Computes m * 2^e * 10^k rounded half-to-even (like printf), using exact
+ * 128-bit integer arithmetic.
+ *
+ * @return false when an intermediate value does not fit in 128 bits.
+ */
+static bool scaleAndRound(uint64_t m, int e, int k, uint64_t* result) {
+    uint128_t numerator = m;
+    uint128_t denominator = 1;
+
+    if (e >= 0) {
+        if (e > 74) return false;           // m < 2^53
+        numerator <<= e;
+    } else {
+        if (-e > 127) return false;
+        denominator <<= -e;
+    }
+
+    if (k >= 0) {
+        if (k > 38) return false;
+        uint128_t power = powerOfTen(k);
+        if (numerator > ~(uint128_t)0 / power) return false;
+        numerator *= power;
+    } else {
+        if (-k > 38) return false;
+        uint128_t power = powerOfTen(-k);
+        if (denominator > ~(uint128_t)0 / power) return false;
+        denominator *= power;
+    }
+
+    uint128_t quotient = numerator / denominator;
+    uint128_t remainder = numerator % denominator;
+    uint128_t rest = denominator - remainder;
+    if (remainder > rest || (remainder == rest && (quotient & 1))) quotient++;
+
+    if (quotient > UINT64_MAX) return false;
+    *result = (uint64_t)quotient;
+    return true;
+}
+
+
+/* @note
+ * %g prints 6 significant digits: the value rounded to an integer in
+ * [10^5, 10^6) times a power of ten, X being the exponent of the first digit.
+ * Fixed notation is used for -4 <= X < 6, scientific notation otherwise, and
+ * trailing zeros of the fraction are removed in both.
+ *
+ * The rounding is done exactly on the binary value, so the output matches
+ * printf digit for digit. Values outside about [1e-17, 1e38] (and subnormals,
+ * infinities and NaNs) are left to snprintf().
+ * */
+int formatDouble(double value, char* buffer) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    bool negative = (bits >> 63) != 0;
+    int biased = (int)((bits >> 52) & 0x7FF);
+    uint64_t fraction = bits & 0x000FFFFFFFFFFFFFULL;
+
+    if (biased == 0 && fraction == 0) {
+        strcpy(buffer, negative ? "-0" : "0");
+        return negative ? 2 : 1;
+    }
+    if (biased == 0 || biased == 0x7FF) return snprintf(buffer, 32, "%g", value);
+
+    uint64_t m = fraction | (1ULL << 52);
+    int e = biased - 1075;      // value = m * 2^e
+
+    // floor(log10(2^(biased - 1023))), which is X or X - 1
+    int exponent = ((biased - 1023) * 78913) >> 18;
+    uint64_t digits = 0;
+
+    for (int attempt = 0;; attempt++) {
+        if (attempt == 3 || !scaleAndRound(m, e, 5 - exponent, &digits)) {
+            return snprintf(buffer, 32, "%g", value);
+        }
+        // Also catches rounding up to 10^6, e.g. 999999.5
+        if (digits >= 1000000) {
+            exponent++;
+        } else if (digits < 100000) {
+            exponent--;
+        } else {
+            break;
+        }
+    }
+
+    char text[6];
+    for (int i = 5; i >= 0; i--) {
+        text[i] = (char)('0' + digits % 10);
+        digits /= 10;
+    }
+    int significant = 6;
+    while (significant > 1 && text[significant - 1] == '0') significant--;
+
+    char* out = buffer;
+    if (negative) *out++ = '-';
+
+    if (exponent >= -4 && exponent < 6) {
+        if (exponent >= 0) {
+            for (int i = 0; i <= exponent; i++) *out++ = text[i];
+            if (significant > exponent + 1) {
+                *out++ = '.';
+                for (int i = exponent + 1; i < significant; i++) *out++ = text[i];
+            }
+        } else {
+            *out++ = '0';
+            *out++ = '.';
+            for (int i = 0; i < -exponent - 1; i++) *out++ = '0';
+            for (int i = 0; i < significant; i++) *out++ = text[i];
+        }
+    } else {
+        *out++ = text[0];
+        if (significant > 1) {
+            *out++ = '.';
+            for (int i = 1; i < significant; i++) *out++ = text[i];
+        }
+
+        *out++ = 'e';
+        *out++ = exponent < 0 ? '-' : '+';
+        int magnitude = exponent < 0 ? -exponent : exponent;
+        if (magnitude >= 100) *out++ = (char)('0' + magnitude / 100);
+        *out++ = (char)('0' + magnitude / 10 % 10);
+        *out++ = (char)('0' + magnitude % 10);
+    }
+
+    *out = '\0';
+    return (int)(out - buffer);
+}
+
+
+// Formats an int like printf("%" PRId64)
+static int formatInt(int64_t value, char* buffer) {
+    char reversed[20];
+    int count = 0;
+    // Negating in unsigned arithmetic also handles INT64_MIN
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+
+    do {
+        reversed[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0);
+
+    int length = 0;
+    if (value < 0) buffer[length++] = '-';
+    while (count > 0) buffer[length++] = reversed[--count];
+    buffer[length] = '\0';
+    return length;
+}
+
+
+void writeValue(OutputSink* sink, Value value) {
+    char text[32];
+    switch (value.type) {
+        case VAL_BOOL:
+            if (AS_BOOL(value)) {
+                writeOutput(sink, "true", 4);
+            } else {
+                writeOutput(sink, "false", 5);
+            }
+            break;
+        case VAL_NIL:
+            writeOutput(sink, "nil", 3);
+            break;
+        case VAL_NUMBER:
+            writeOutput(sink, text, (size_t)formatDouble(AS_NUMBER(value), text));
+            break;
+        case VAL_INT:
+            writeOutput(sink, text, (size_t)formatInt(AS_INT(value), text));
+            break;
+        case VAL_OBJ:
+            writeObject(sink, value);
+            break;
+    }
+}
@@ -0,0 +1,233 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "perf.h"
+
+#ifdef MAVIX_PERF
+
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* @note
+ * The jitdump format is documented in the Linux sources, in
+ * tools/perf/Documentation/jitdump-specification.txt. A header is followed
+ * by records, each starting with a prefix that gives its kind and size. The
+ * debug info of some code has to come before the record that loads it.
+ *
+ * perf only finds the file through an executable mapping of it, which
+ * therefore stays until stopPerf().
+ * */
+#define JITDUMP_MAGIC 0x4A695444        // "JiTD"
+#define JITDUMP_VERSION 1
+
+enum {
+    JIT_CODE_LOAD = 0,
+    JIT_CODE_DEBUG_INFO = 2,
+    JIT_CODE_CLOSE = 3,
+};
+
+#if defined(__x86_64__)
+#define JITDUMP_MACHINE EM_X86_64
+#elif defined(__aarch64__)
+#define JITDUMP_MACHINE EM_AARCH64
+#else
+#define JITDUMP_MACHINE EM_NONE
+#endif
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          // of this header
+    uint32_t machine;       // ELF e_machine
+    uint32_t pad;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+} JitDumpHeader;
+
+typedef struct {
+    uint32_t id;
+    uint32_t size;          // of the whole record
+    uint64_t timestamp;
+} JitDumpRecord;
+
+// A JIT_CODE_LOAD record, followed by the name (with its NUL) and the code
+typedef struct {
+    JitDumpRecord record;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t address;
+    uint64_t size;
+    uint64_t index;         // tells code loaded at the same address apart
+} JitCodeLoad;
+
+// A JIT_CODE_DEBUG_INFO record, followed by its entries
+typedef struct {
+    JitDumpRecord record;
+    uint64_t address;
+    uint64_t count;
+} JitDebugInfo;
+
+// Followed by the source file's name, with its NUL
+typedef struct {
+    uint64_t address;
+    int32_t line;
+    int32_t discriminator;
+} JitDebugEntry;
+
+// The scripts have no file names to give
+#define SOURCE_NAME "script"
+
+static struct {
+    FILE* map;              // /tmp/perf-<pid>.map
+    FILE* dump;             // jit-<pid>.dump
+    void* marker;           // the executable mapping of the dump
+    size_t markerSize;
+    uint64_t loads;
+} perf = {NULL, NULL, NULL, 0, 0};
+
+
+// perf record -k mono stamps its samples with the same clock
+static uint64_t timestamp() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+static bool openDump(const char* directory) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/jit-%d.dump", directory, (int)getpid());
+    perf.dump = fopen(path, "w+");
+    if (perf.dump == NULL) return false;
+
+    perf.markerSize = (size_t)sysconf(_SC_PAGESIZE);
+    perf.marker = mmap(NULL, perf.markerSize, PROT_READ | PROT_EXEC, MAP_PRIVATE,
+                       fileno(perf.dump), 0);
+    if (perf.marker == MAP_FAILED) {
+        perf.marker = NULL;
+        fclose(perf.dump);
+        perf.dump = NULL;
+        remove(path);
+        return false;
+    }
+
+    JitDumpHeader header = {JITDUMP_MAGIC, JITDUMP_VERSION, sizeof(JitDumpHeader),
+                            JITDUMP_MACHINE, 0, (uint32_t)getpid(), timestamp(), 0};
+    fwrite(&header, sizeof(header), 1, perf.dump);
+    fflush(perf.dump);
+    return true;
+}
+
+
+bool startPerf(const char* directory) {
+    if (perfEnabled()) return true;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    perf.map = fopen(path, "w");
+
+    openDump(directory);
+    return perfEnabled();
+}
+
+
+void stopPerf() {
+    if (perf.map != NULL) fclose(perf.map);
+    perf.map = NULL;
+
+    if (perf.dump != NULL) {
+        JitDumpRecord close = {JIT_CODE_CLOSE, sizeof(JitDumpRecord), timestamp()};
+        fwrite(&close, sizeof(close), 1, perf.dump);
+        munmap(perf.marker, perf.markerSize);
+        fclose(perf.dump);
+    }
+    perf.dump = NULL;
+    perf.marker = NULL;
+}
+
+
+bool perfEnabled() {
+    return perf.map != NULL || perf.dump != NULL;
+}
+
+
+static void writeDebugInfo(uint64_t address, const PerfLine* lines, int lineCount) {
+    size_t entrySize = sizeof(JitDebugEntry) + sizeof(SOURCE_NAME);
+    JitDebugInfo info;
+    info.record = (JitDumpRecord){JIT_CODE_DEBUG_INFO,
+                                  (uint32_t)(sizeof(info) + entrySize * (size_t)lineCount),
+                                  timestamp()};
+    info.address = address;
+    info.count = (uint64_t)lineCount;
+    fwrite(&info, sizeof(info), 1, perf.dump);
+
+    for (int i = 0; i < lineCount; i++) {
+        JitDebugEntry entry = {address + lines[i].offset, lines[i].line, 0};
+        fwrite(&entry, sizeof(entry), 1, perf.dump);
+        fwrite(SOURCE_NAME, sizeof(SOURCE_NAME), 1, perf.dump);
+    }
+}
+
+
+void perfCodeLoad(const void* code, size_t size, const char* name,
+                  const PerfLine* lines, int lineCount) {
+    uint64_t address = (uint64_t)(uintptr_t)code;
+
+    if (perf.map != NULL) {
+        fprintf(perf.map, "%" PRIx64 " %zx %s\n", address, size, name);
+        fflush(perf.map);
+    }
+
+    if (perf.dump != NULL) {
+        if (lines != NULL && lineCount > 0) writeDebugInfo(address, lines, lineCount);
+
+        size_t nameSize = strlen(name) + 1;
+        JitCodeLoad load;
+        load.record = (JitDumpRecord){JIT_CODE_LOAD,
+                                      (uint32_t)(sizeof(load) + nameSize + size),
+                                      timestamp()};
+        load.pid = (uint32_t)getpid();
+        load.tid = (uint32_t)syscall(SYS_gettid);
+        load.vma = address;
+        load.address = address;
+        load.size = size;
+        load.index = perf.loads++;
+
+        fwrite(&load, sizeof(load), 1, perf.dump);
+        fwrite(name, nameSize, 1, perf.dump);
+        fwrite(code, size, 1, perf.dump);
+        fflush(perf.dump);
+    }
+}
+
+#else
+
+// perf is Linux only
+bool startPerf(const char* directory) {
+    (void)directory;
+    return false;
+}
+
+void stopPerf() {
+}
+
+bool perfEnabled() {
+    return false;
+}
+
+void perfCodeLoad(const void* code, size_t size, const char* name,
+                  const PerfLine* lines, int lineCount) {
+    (void)code;
+    (void)size;
+    (void)name;
+    (void)lines;
+    (void)lineCount;
+}
+
+#endif
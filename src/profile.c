@@ -0,0 +1,351 @@
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "profile.h"
+#include "vm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MAVIX_SAMPLER
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+
+static int compareHotness(const void* a, const void* b) {
+    const LoopStats* left = (const LoopStats*)a;
+    const LoopStats* right = (const LoopStats*)b;
+    if (left->iterations != right->iterations) {
+        return left->iterations < right->iterations ? 1 : -1;
+    }
+    return left->index - right->index;      // stable for equal counts
+}
+
+
+int hottestLoops(Chunk* chunk, LoopStats* stats, int max) {
+    if (chunk->loopCount == 0 || max <= 0) return 0;
+
+    LoopStats* all = GROW_ARRAY(LoopStats, NULL, 0, chunk->loopCount);
+    for (int i = 0; i < chunk->loopCount; i++) {
+        LoopProfile* loop = &chunk->loops[i];
+        all[i] = (LoopStats){i, loop->header, loop->line, loop->iterations};
+    }
+    qsort(all, (size_t)chunk->loopCount, sizeof(LoopStats), compareHotness);
+
+    int count = chunk->loopCount < max ? chunk->loopCount : max;
+    for (int i = 0; i < count; i++) stats[i] = all[i];
+
+    FREE_ARRAY(LoopStats, all, chunk->loopCount);
+    return count;
+}
+
+
+uint64_t totalIterations(Chunk* chunk) {
+    uint64_t total = 0;
+    for (int i = 0; i < chunk->loopCount; i++) total += chunk->loops[i].iterations;
+    return total;
+}
+
+
+void resetLoopCounters(Chunk* chunk) {
+    for (int i = 0; i < chunk->loopCount; i++) chunk->loops[i].iterations = 0;
+}
+
+
+void printLoopProfile(Chunk* chunk, FILE* file) {
+    if (chunk->loopCount == 0) return;
+
+    LoopStats* stats = GROW_ARRAY(LoopStats, NULL, 0, chunk->loopCount);
+    int count = hottestLoops(chunk, stats, chunk->loopCount);
+    uint64_t total = totalIterations(chunk);
+
+    fprintf(file, "== loop profile ==\n");
+    for (int i = 0; i < count && stats[i].iterations > 0; i++) {
+        fprintf(file, "loop %-3d line %-5d @%04d %12" PRIu64 " iterations (%5.1f%%)\n",
+                stats[i].index, stats[i].line, stats[i].header, stats[i].iterations,
+                100.0 * (double)stats[i].iterations / (double)total);
+    }
+
+    FREE_ARRAY(LoopStats, stats, chunk->loopCount);
+}
+
+
+
+/*
+#####################################
+Sampling profiler
+#####################################
+*/
+
+/* @note
+ * The signal handler may not allocate, so the samples are counted in fixed
+ * tables: each distinct stack once, as (name, line) frames, with the names
+ * copied out of the functions (which the collector moves and frees). A
+ * sample that does not fit anymore is only counted as dropped.
+ * */
+#define SAMPLE_STACKS 4096              // distinct stacks (a power of two)
+#define SAMPLE_FRAMES (1 << 18)         // frames of all of them
+#define SAMPLE_NAMES 1024               // distinct function names (a power of two)
+#define SAMPLE_NAME_BYTES (1 << 16)
+
+// FNV-1a over whole frames, for the stacks (names use hashBytes())
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// A frame is its name's index in the high half and its line in the low one
+#define SAMPLE_FRAME(name, line)    (((uint64_t)(name) << 32) | (uint32_t)(line))
+#define FRAME_NAME(frame)           ((uint32_t)((frame) >> 32))
+#define FRAME_LINE(frame)           ((uint32_t)(frame))
+
+typedef struct {
+    uint64_t hash;
+    uint32_t start;         // first frame in the sampler's frames
+    uint32_t depth;
+    uint64_t count;         // 0: unused
+} SampledStack;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t start;         // first byte in the sampler's nameBytes
+    uint32_t length;        // 0: unused
+} SampledName;
+
+static struct {
+    SampledStack stacks[SAMPLE_STACKS];
+    int stackCount;
+    uint64_t frames[SAMPLE_FRAMES];
+    uint32_t frameCount;
+
+    SampledName names[SAMPLE_NAMES];
+    int nameCount;
+    char nameBytes[SAMPLE_NAME_BYTES];
+    uint32_t nameByteCount;
+
+    uint64_t dropped;
+    atomic_flag busy;       // a sample is being taken
+    bool running;
+#ifdef MAVIX_SAMPLER
+    struct sigaction previous;
+#endif
+} sampler = {.busy = ATOMIC_FLAG_INIT};
+
+
+// Index of the name in the sampler's table, which copies it the first time
+static int64_t internName(const char* name, int length) {
+    uint64_t hash = hashBytes(name, (size_t)length);
+    uint32_t index = (uint32_t)hash & (SAMPLE_NAMES - 1);
+
+    for (;;) {
+        SampledName* entry = &sampler.names[index];
+        if (entry->length == 0) break;
+        if (entry->hash == hash && entry->length == (uint32_t)length &&
+            memcmp(sampler.nameBytes + entry->start, name, (size_t)length) == 0) {
+            return index;
+        }
+        index = (index + 1) & (SAMPLE_NAMES - 1);
+    }
+
+    // Kept at most 3/4 full, so the search above always ends
+    if (sampler.nameCount >= SAMPLE_NAMES * 3 / 4 ||
+        sampler.nameByteCount + (uint32_t)length > SAMPLE_NAME_BYTES) {
+        return -1;
+    }
+    SampledName* entry = &sampler.names[index];
+    entry->hash = hash;
+    entry->start = sampler.nameByteCount;
+    entry->length = (uint32_t)length;
+    memcpy(sampler.nameBytes + entry->start, name, (size_t)length);
+    sampler.nameByteCount += (uint32_t)length;
+    sampler.nameCount++;
+    return index;
+}
+
+
+/* @note
+ * A caller's ip points past its call, the running function's past the
+ * instruction being run: either way the byte before it gives the line. The
+ * sample may interrupt a call or a return halfway, so the ip is checked
+ * against the chunk (line 0 when it lies outside).
+ * */
+static int64_t sampleFrame(ObjFunction* function, const uint8_t* ip) {
+    Chunk* chunk = function != NULL ? &function->chunk : vm.script;
+    int64_t name = function != NULL ? internName(function->name, function->nameLength)
+                                    : internName("script", 6);
+    if (name < 0) return -1;
+
+    int line = 0;
+    if (chunk != NULL && chunk->count > 0 &&
+        ip >= chunk->code && ip <= chunk->code + chunk->count) {
+        line = chunk->lines[ip > chunk->code ? ip - chunk->code - 1 : 0];
+    }
+    return (int64_t)SAMPLE_FRAME(name, line > 0 ? line : 0);
+}
+
+
+// Counts one more sample of the stack, adding the stack if it is new
+static bool countStack(const uint64_t* frames, int depth) {
+    uint64_t hash = FNV_OFFSET;
+    for (int i = 0; i < depth; i++) {
+        hash ^= frames[i];
+        hash *= FNV_PRIME;
+    }
+    uint32_t index = (uint32_t)hash & (SAMPLE_STACKS - 1);
+    size_t size = (size_t)depth * sizeof(uint64_t);
+
+    for (;;) {
+        SampledStack* entry = &sampler.stacks[index];
+        if (entry->count == 0) break;
+        if (entry->hash == hash && entry->depth == (uint32_t)depth &&
+            memcmp(sampler.frames + entry->start, frames, size) == 0) {
+            entry->count++;
+            return true;
+        }
+        index = (index + 1) & (SAMPLE_STACKS - 1);
+    }
+
+    if (sampler.stackCount >= SAMPLE_STACKS * 3 / 4 ||
+        sampler.frameCount + (uint32_t)depth > SAMPLE_FRAMES) {
+        return false;
+    }
+    SampledStack* entry = &sampler.stacks[index];
+    entry->hash = hash;
+    entry->start = sampler.frameCount;
+    entry->depth = (uint32_t)depth;
+    entry->count = 1;
+    memcpy(sampler.frames + entry->start, frames, size);
+    sampler.frameCount += (uint32_t)depth;
+    sampler.stackCount++;
+    return true;
+}
+
+
+/* @note
+ * Runs in the SIGPROF handler, on whichever thread was using the CPU: the
+ * VM's while a script runs. It reads the registers as they are, without
+ * synchronizing, and only calls async-signal-safe functions.
+ * */
+static void takeSample() {
+    uint64_t frames[FRAMES_MAX + 1];
+    int depth = 0;
+    int64_t frame = 0;
+
+    if (vm.script == NULL) {
+        // Compiling, collecting after the run, or waiting
+        frame = internName("(outside scripts)", 17);
+        if (frame >= 0) frames[depth++] = SAMPLE_FRAME(frame, 0);
+    } else {
+        int callers = vm.frameCount;
+        if (callers < 0 || callers > FRAMES_MAX) callers = 0;
+        for (int i = 0; i < callers; i++) {
+            frame = sampleFrame(vm.frames[i].function, vm.frames[i].ip);
+            if (frame < 0) break;
+            frames[depth++] = (uint64_t)frame;
+        }
+        if (frame >= 0) {
+            frame = sampleFrame(vm.function, vm.ip);
+            if (frame >= 0) frames[depth++] = (uint64_t)frame;
+        }
+    }
+
+    // A name that did not fit leaves the stack incomplete
+    if (frame < 0 || !countStack(frames, depth)) sampler.dropped++;
+}
+
+
+#ifdef MAVIX_SAMPLER
+
+static void handleSignal(int signal) {
+    (void)signal;
+    // Another thread may still be taking the previous one
+    if (atomic_flag_test_and_set(&sampler.busy)) return;
+    takeSample();
+    atomic_flag_clear(&sampler.busy);
+}
+
+
+bool startSampling(int hz) {
+    if (sampler.running || hz <= 0) return false;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleSignal;
+    action.sa_flags = SA_RESTART;       // reads and waits go on after a sample
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &sampler.previous) != 0) return false;
+
+    // The kernel may deliver less often than this (at most once per tick)
+    long interval = 1000000L / hz > 0 ? 1000000L / hz : 1;
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval / 1000000L;
+    timer.it_interval.tv_usec = interval % 1000000L;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        sigaction(SIGPROF, &sampler.previous, NULL);
+        return false;
+    }
+
+    sampler.running = true;
+    return true;
+}
+
+
+void stopSampling() {
+    if (!sampler.running) return;
+
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &sampler.previous, NULL);
+    sampler.running = false;
+}
+
+#else
+
+bool startSampling(int hz) {
+    (void)hz;
+    return false;
+}
+
+
+void stopSampling() {
+}
+
+#endif
+
+
+void resetSamples() {
+    memset(sampler.stacks, 0, sizeof(sampler.stacks));
+    memset(sampler.names, 0, sizeof(sampler.names));
+    sampler.stackCount = 0;
+    sampler.frameCount = 0;
+    sampler.nameCount = 0;
+    sampler.nameByteCount = 0;
+    sampler.dropped = 0;
+}
+
+
+uint64_t writeFoldedStacks(FILE* file) {
+    uint64_t total = 0;
+    for (int i = 0; i < SAMPLE_STACKS; i++) {
+        SampledStack* stack = &sampler.stacks[i];
+        if (stack->count == 0) continue;
+
+        for (uint32_t j = 0; j < stack->depth; j++) {
+            uint64_t frame = sampler.frames[stack->start + j];
+            SampledName* name = &sampler.names[FRAME_NAME(frame)];
+            fprintf(file, "%s%.*s", j > 0 ? ";" : "", (int)name->length,
+                    sampler.nameBytes + name->start);
+            if (FRAME_LINE(frame) > 0) fprintf(file, ":%" PRIu32, FRAME_LINE(frame));
+        }
+        fprintf(file, " %" PRIu64 "\n", stack->count);
+        total += stack->count;
+    }
+    return total;
+}
+
+
+uint64_t droppedSamples() {
+    return sampler.dropped;
+}
@@ -6,20 +6,31 @@
 #include <string.h>
 
 #include "common.h"
+#include "memory.h"
 #include "scanner.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MAVIX_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
 typedef struct {
     const char* start;      // beginning of current lexeme
     const char* current;    // points to current char being looked at
+    const char* end;        // one past the last char (no terminator needed)
     int line;               // 
 } Scanner;
 
-Scanner scanner;        // Global instance of the scanner
+// One scanner per thread, so that pieces of a source can be scanned in
+// parallel (see tokenizeParallel())
+_Thread_local Scanner scanner;
 
 // Initializes the scanner with the source code
-void initScanner(const char* source) {
+void initScanner(const char* source, size_t length) {
     scanner.start = source;
     scanner.current = source;
+    scanner.end = source + length;
     scanner.line = 1;           // Line number starts at 1
 }
 
@@ -35,9 +46,9 @@ static bool isDigit(char c) {
     return c >= '0' && c <= '9';
 }
 
-// Returns true if we've reached the end of the source string
+// Returns true if we've reached the end of the source
 static bool isAtEnd() {
-    return *scanner.current == '\0';
+    return scanner.current >= scanner.end;
 }
 
 
@@ -46,13 +57,14 @@ static char advance() {
     return scanner.current[-1];     // Return the character we just passed
 }
 
-// Look at the current characer without consuming it
+// Look at the current characer without consuming it ('\0' at the end)
 static char peek() {
+    if (isAtEnd())  return '\0';
     return *scanner.current;
 }
 
 static char peekNext() {
-    if (isAtEnd())  return '\0';
+    if (scanner.current + 1 >= scanner.end)  return '\0';
     return scanner.current[1];      // looks one char ahead
 }
 
@@ -96,10 +108,14 @@ static Token errorToken(const char* message) {
  * @brief Skips over any whitespace characters in the input.
  *
  * This function advances the input pointer past any whitespace characters
- * (such as spaces, tabs, and newlines) until it encounters a non-whitespace
- * character or the end of the input.
+ * (such as spaces, tabs, and newlines) and comments until it encounters a
+ * non-whitespace character or the end of the input.
+ *
+ * @return An error message for an unterminated block comment (with
+ *         scanner.start set to the comment's opening slash-star), NULL
+ *         otherwise.
  */
-static void skipWhitespace() {
+static const char* skipWhitespace() {
     for (;;) {
         char c = peek();
         switch (c) {
@@ -124,9 +140,11 @@ static void skipWhitespace() {
                     while (peek() != '\n' && !isAtEnd()) advance();
                 }
                 // multi-line comments 
-                else if (peek() == '*') {
+                else if (peekNext() == '*') {
+                    const char* comment = scanner.current;
+                    bool terminated = false;
+                    advance();      // consume '/'
                     advance();      // consume '*'
-                    advance();      // move past the '/'
 
                     while (!isAtEnd()) {    
                         if (peek() == '\n') scanner.line++;     // trace newlines
@@ -134,6 +152,7 @@ static void skipWhitespace() {
                         if (peek() == '*' && peekNext() == '/') {
                             advance();      // consume '*'
                             advance();      // consume '/'
+                            terminated = true;
                             break;          // exit the loop after finding '*/'
                         }
                         
@@ -141,17 +160,17 @@ static void skipWhitespace() {
                     }
                     
                     // unterminated comment error
-                    if (isAtEnd()) {
-                        // printf("Error: Unterminated multi-line comment error");
-                        errorToken("Unterminated multiline comment error.");
+                    if (!terminated) {
+                        scanner.start = comment;
+                        return "Unterminated multiline comment error.";
                     }
                 } else {
-                        return;     // not a comment, return
+                        return NULL;    // not a comment, return
                     }
                 
                 break;
             default:
-                return;
+                return NULL;
         }
     }
 }
@@ -319,7 +338,8 @@ Token scanToken() {
      * Thus, we set scanner.start to point to the current character so we remember where the 
      * lexeme we’re about to scan starts.
      */
-    skipWhitespace();
+    const char* error = skipWhitespace();
+    if (error != NULL) return errorToken(error);
     scanner.start = scanner.current;    // Mark the start of the next lexeme
 
     // Returns EOF, if we've reached the end of the input
@@ -369,3 +389,328 @@ Token scanToken() {
     // If not known matched, return an error token
     return errorToken("Unexpected character.");
 }
+
+
+
+/*
+#####################################
+Token streams
+#####################################
+*/
+
+void initTokenStream(TokenStream* stream) {
+    stream->count = 0;
+    stream->capacity = 0;
+    stream->types = NULL;
+    stream->offsets = NULL;
+    stream->lengths = NULL;
+    stream->lines = NULL;
+    stream->source = NULL;
+    stream->messages = NULL;
+    stream->messageCount = 0;
+    stream->messageCapacity = 0;
+}
+
+
+void freeTokenStream(TokenStream* stream) {
+    FREE_ARRAY(uint8_t, stream->types, stream->capacity);
+    FREE_ARRAY(uint32_t, stream->offsets, stream->capacity);
+    FREE_ARRAY(uint32_t, stream->lengths, stream->capacity);
+    FREE_ARRAY(int, stream->lines, stream->capacity);
+    FREE_ARRAY(const char*, stream->messages, stream->messageCapacity);
+    initTokenStream(stream);
+}
+
+
+static void reserveTokens(TokenStream* stream, int capacity) {
+    int oldCapacity = stream->capacity;
+    stream->types = GROW_ARRAY(uint8_t, stream->types, oldCapacity, capacity);
+    stream->offsets = GROW_ARRAY(uint32_t, stream->offsets, oldCapacity, capacity);
+    stream->lengths = GROW_ARRAY(uint32_t, stream->lengths, oldCapacity, capacity);
+    stream->lines = GROW_ARRAY(int, stream->lines, oldCapacity, capacity);
+    stream->capacity = capacity;
+}
+
+
+static uint32_t addMessage(TokenStream* stream, const char* message) {
+    if (stream->messageCapacity < stream->messageCount + 1) {
+        int oldCapacity = stream->messageCapacity;
+        stream->messageCapacity = GROW_CAPACITY(oldCapacity);
+        stream->messages = GROW_ARRAY(const char*, stream->messages,
+                                      oldCapacity, stream->messageCapacity);
+    }
+    stream->messages[stream->messageCount] = message;
+    return (uint32_t)stream->messageCount++;
+}
+
+
+static void appendToken(TokenStream* stream, TokenType type, uint32_t offset,
+                        uint32_t length, int line) {
+    if (stream->capacity < stream->count + 1) {
+        reserveTokens(stream, GROW_CAPACITY(stream->capacity));
+    }
+
+    int index = stream->count++;
+    stream->types[index] = (uint8_t)type;
+    stream->offsets[index] = offset;
+    stream->lengths[index] = length;
+    stream->lines[index] = line;
+}
+
+
+/**
+ * @brief Scans from offset 'from' and appends the tokens starting before 'stop'.
+ *
+ * @param line The line number at 'from'.
+ * @return The offset of the first token at or after 'stop' (the source
+ *         length once the EOF token has been appended).
+ */
+static size_t scanRange(TokenStream* stream, const char* source, size_t length,
+                        size_t from, size_t stop, int line) {
+    initScanner(source, length);
+    scanner.current = source + from;
+    scanner.line = line;
+
+    for (;;) {
+        Token token = scanToken();
+        size_t offset = (size_t)(scanner.start - source);
+        if (offset >= stop) return offset;
+
+        uint32_t tokenLength = token.type == TOKEN_ERROR
+            ? addMessage(stream, token.start)
+            : (uint32_t)token.length;
+        appendToken(stream, token.type, (uint32_t)offset, tokenLength, token.line);
+
+        if (token.type == TOKEN_EOF) return length;
+    }
+}
+
+
+/* @note
+ * The whole source is scanned in one tight loop that only stores the four
+ * fields of each token. Estimating one token per four bytes of source avoids
+ * most regrowth of the arrays.
+ * */
+bool tokenize(const char* source, size_t length, TokenStream* stream) {
+    // Token indexes are ints, and every token but EOF takes at least a byte
+    if (length >= INT32_MAX) return false;
+
+    stream->source = source;
+    stream->count = 0;
+    stream->messageCount = 0;
+
+    int estimate = (int)(length / 4) + 16;
+    if (stream->capacity < estimate) reserveTokens(stream, estimate);
+
+    scanRange(stream, source, length, 0, length + 1, 1);
+    return true;
+}
+
+
+Token streamToken(const TokenStream* stream, int index) {
+    if (index >= stream->count) index = stream->count - 1;
+
+    Token token;
+    token.type = (TokenType)stream->types[index];
+    token.line = stream->lines[index];
+
+    if (token.type == TOKEN_ERROR) {
+        token.start = stream->messages[stream->lengths[index]];
+        token.length = (int)strlen(token.start);
+    } else {
+        token.start = stream->source + stream->offsets[index];
+        token.length = (int)stream->lengths[index];
+    }
+    return token;
+}
+
+
+
+/*
+#####################################
+Parallel scanning
+#####################################
+*/
+
+#ifdef MAVIX_THREADS
+
+// A piece of the source, starting just after a newline
+typedef struct {
+    const char* source;
+    size_t length;
+    size_t from;            // first byte of the piece
+    size_t stop;            // first byte of the next piece
+    TokenStream tokens;     // scanned speculatively, lines relative to 'from'
+    size_t resume;          // offset of the first token at or after 'stop'
+    int newlines;           // newlines in the piece
+} Piece;
+
+
+static void* scanPiece(void* argument) {
+    Piece* piece = (Piece*)argument;
+
+    initTokenStream(&piece->tokens);
+    piece->tokens.source = piece->source;
+    reserveTokens(&piece->tokens, (int)((piece->stop - piece->from) / 4) + 16);
+
+    // Assume the piece starts outside of any string or comment
+    piece->resume = scanRange(&piece->tokens, piece->source, piece->length,
+                              piece->from, piece->stop, 1);
+
+    const char* end = piece->source +
+        (piece->stop < piece->length ? piece->stop : piece->length);
+    const char* newline = piece->source + piece->from;
+    piece->newlines = 0;
+    while ((newline = memchr(newline, '\n', (size_t)(end - newline))) != NULL) {
+        piece->newlines++;
+        newline++;
+    }
+    return NULL;
+}
+
+
+// Index of the token starting at 'offset', or -1
+static int findToken(const TokenStream* tokens, size_t offset) {
+    int low = 0;
+    int high = tokens->count - 1;
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        if (tokens->offsets[middle] == offset) return middle;
+        if (tokens->offsets[middle] < offset) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return -1;
+}
+
+
+static int countNewlines(const char* from, const char* to) {
+    int count = 0;
+    while ((from = memchr(from, '\n', (size_t)(to - from))) != NULL) {
+        count++;
+        from++;
+    }
+    return count;
+}
+
+
+/* @note
+ * Every piece is scanned on its own thread as if it started outside of any
+ * string or block comment. The pieces are then stitched in order: the
+ * previous piece tells where the serial scanner would really continue. The
+ * scanner's state is just its position, so if a speculative token starts
+ * exactly there, it and every token after it are what the serial scanner
+ * produces (dropping any tokens before it, which were scanned inside a
+ * string or comment). Otherwise the piece is rescanned serially from that
+ * position. Lines are made absolute by adding the newlines of the previous
+ * pieces.
+ * */
+bool tokenizeParallel(const char* source, size_t length, int threadCount,
+                      TokenStream* stream) {
+    if (threadCount <= 0) threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadCount > MAX_SCAN_THREADS) threadCount = MAX_SCAN_THREADS;
+    if (threadCount <= 1 || length >= INT32_MAX) {
+        return tokenize(source, length, stream);
+    }
+
+    // Split at the first newline after each 1/threadCount of the source.
+    // The last piece runs past the end, so that it also gets the EOF token.
+    Piece pieces[MAX_SCAN_THREADS];
+    int pieceCount = 0;
+    size_t from = 0;
+    while (from <= length) {
+        size_t target = length / threadCount * (pieceCount + 1);
+        size_t stop = length + 1;
+
+        if (pieceCount < threadCount - 1 && target < length) {
+            if (target < from) target = from;
+            const char* newline = memchr(source + target, '\n', length - target);
+            if (newline != NULL && (size_t)(newline - source) + 1 < length) {
+                stop = (size_t)(newline - source) + 1;
+            }
+        }
+
+        // The tokens are set up by scanPiece(), on the piece's own thread
+        pieces[pieceCount++] = (Piece){
+            .source = source,
+            .length = length,
+            .from = from,
+            .stop = stop,
+            .tokens = {.count = 0},
+            .resume = 0,
+            .newlines = 0,
+        };
+        from = stop;
+    }
+
+    pthread_t threads[MAX_SCAN_THREADS];
+    bool started[MAX_SCAN_THREADS];
+    for (int i = 1; i < pieceCount; i++) {
+        started[i] = pthread_create(&threads[i], NULL, scanPiece, &pieces[i]) == 0;
+    }
+    scanPiece(&pieces[0]);
+    for (int i = 1; i < pieceCount; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            scanPiece(&pieces[i]);
+        }
+    }
+
+    int total = 0;
+    for (int i = 0; i < pieceCount; i++) total += pieces[i].tokens.count;
+
+    stream->source = source;
+    stream->count = 0;
+    stream->messageCount = 0;
+    if (stream->capacity < total) reserveTokens(stream, total);
+
+    size_t resume = 0;      // where the serial scanner continues
+    int lineBase = 0;       // newlines before the current piece
+
+    for (int i = 0; i < pieceCount; i++) {
+        Piece* piece = &pieces[i];
+        TokenStream* tokens = &piece->tokens;
+        int first = findToken(tokens, resume);
+        int lineOffset = lineBase;
+
+        if (first < 0) {
+            // Misspeculated: the piece starts inside a string or comment
+            int line = 1 + lineBase +
+                countNewlines(source + piece->from, source + resume);
+            tokens->count = 0;
+            tokens->messageCount = 0;
+            piece->resume = scanRange(tokens, source, length, resume, piece->stop, line);
+            first = 0;
+            lineOffset = 0;
+        }
+
+        for (int t = first; t < tokens->count; t++) {
+            TokenType type = (TokenType)tokens->types[t];
+            uint32_t tokenLength = type == TOKEN_ERROR
+                ? addMessage(stream, tokens->messages[tokens->lengths[t]])
+                : tokens->lengths[t];
+            appendToken(stream, type, tokens->offsets[t], tokenLength,
+                        tokens->lines[t] + lineOffset);
+        }
+
+        resume = piece->resume;
+        lineBase += piece->newlines;
+        freeTokenStream(tokens);
+    }
+
+    return true;
+}
+
+#else
+
+// Without threads the source is scanned serially.
+bool tokenizeParallel(const char* source, size_t length, int threadCount,
+                      TokenStream* stream) {
+    (void)threadCount;
+    return tokenize(source, length, stream);
+}
+
+#endif
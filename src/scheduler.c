@@ -0,0 +1,208 @@
+#include <string.h>
+
+#include "memory.h"
+#include "scheduler.h"
+
+#ifdef MAVIX_SCHEDULER_THREAD
+#define LOCK(scheduler)     pthread_mutex_lock(&(scheduler)->lock)
+#define UNLOCK(scheduler)   pthread_mutex_unlock(&(scheduler)->lock)
+#define SIGNAL(scheduler)   pthread_cond_signal(&(scheduler)->wake)
+#else
+#define LOCK(scheduler)     ((void)0)
+#define UNLOCK(scheduler)   ((void)0)
+#define SIGNAL(scheduler)   ((void)0)
+#endif
+
+
+void initScheduler(Scheduler* scheduler, uint64_t slice) {
+    scheduler->head = NULL;
+    scheduler->tail = NULL;
+    scheduler->slice = slice;
+    scheduler->inbox = NULL;
+    scheduler->inboxTail = NULL;
+    scheduler->closed = false;
+
+    scheduler->completed = 0;
+    scheduler->failed = 0;
+    scheduler->killed = 0;
+    scheduler->rejected = 0;
+    scheduler->switches = 0;
+
+#ifdef MAVIX_SCHEDULER_THREAD
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->wake, NULL);
+    scheduler->started = false;
+#endif
+}
+
+
+static void freeSubmission(Submission* submission) {
+    FREE_ARRAY(char, submission->source, submission->length);
+    FREE(Submission, submission);
+}
+
+
+void freeScheduler(Scheduler* scheduler) {
+    while (scheduler->head != NULL) {
+        Fiber* fiber = scheduler->head;
+        scheduler->head = fiber->nextReady;
+        freeFiber(fiber);
+    }
+    scheduler->tail = NULL;
+
+    while (scheduler->inbox != NULL) {
+        Submission* submission = scheduler->inbox;
+        scheduler->inbox = submission->next;
+        freeSubmission(submission);
+    }
+    scheduler->inboxTail = NULL;
+
+#ifdef MAVIX_SCHEDULER_THREAD
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->wake);
+#endif
+}
+
+
+void submitScript(Scheduler* scheduler, const char* source, size_t length) {
+    Submission* submission = ALLOCATE(Submission, 1);
+    submission->source = ALLOCATE(char, length);
+    memcpy(submission->source, source, length);
+    submission->length = length;
+    submission->next = NULL;
+
+    LOCK(scheduler);
+    if (scheduler->inboxTail != NULL) {
+        scheduler->inboxTail->next = submission;
+    } else {
+        scheduler->inbox = submission;
+    }
+    scheduler->inboxTail = submission;
+    SIGNAL(scheduler);
+    UNLOCK(scheduler);
+}
+
+
+void closeScheduler(Scheduler* scheduler) {
+    LOCK(scheduler);
+    scheduler->closed = true;
+    SIGNAL(scheduler);
+    UNLOCK(scheduler);
+}
+
+
+static void makeReady(Scheduler* scheduler, Fiber* fiber) {
+    fiber->nextReady = NULL;
+    if (scheduler->tail != NULL) {
+        scheduler->tail->nextReady = fiber;
+    } else {
+        scheduler->head = fiber;
+    }
+    scheduler->tail = fiber;
+}
+
+
+/* @note
+ * Takes the whole inbox under the lock and compiles it outside of it, so
+ * submitting threads never wait for the compiler. Waits for submissions
+ * only when there is nothing else to run.
+ *
+ * @return false once the scheduler is closed and the inbox is empty.
+ * */
+static bool takeSubmissions(Scheduler* scheduler, bool wait) {
+    LOCK(scheduler);
+#ifdef MAVIX_SCHEDULER_THREAD
+    while (wait && scheduler->inbox == NULL && !scheduler->closed) {
+        pthread_cond_wait(&scheduler->wake, &scheduler->lock);
+    }
+#else
+    (void)wait;
+#endif
+    Submission* submission = scheduler->inbox;
+    scheduler->inbox = NULL;
+    scheduler->inboxTail = NULL;
+    bool open = !scheduler->closed;
+    UNLOCK(scheduler);
+
+    bool taken = submission != NULL;
+    while (submission != NULL) {
+        Submission* next = submission->next;
+        // The compiled chunk keeps no pointers into the source
+        Fiber* fiber = newFiber(submission->source, submission->length);
+        if (fiber != NULL) {
+            makeReady(scheduler, fiber);
+        } else {
+            scheduler->rejected++;
+        }
+        freeSubmission(submission);
+        submission = next;
+    }
+    return open || taken;
+}
+
+
+void runScheduler(Scheduler* scheduler) {
+    for (;;) {
+        bool idle = scheduler->head == NULL;
+        if (!takeSubmissions(scheduler, idle) && scheduler->head == NULL) break;
+        if (scheduler->head == NULL) continue;
+
+        Fiber* fiber = scheduler->head;
+        scheduler->head = fiber->nextReady;
+        if (scheduler->head == NULL) scheduler->tail = NULL;
+
+        scheduler->switches++;
+        InterpretResult result = resumeFiber(fiber, scheduler->slice);
+        if (result == INTERPRET_YIELD) {
+            makeReady(scheduler, fiber);
+            continue;
+        }
+
+        if (result == INTERPRET_OK) {
+            scheduler->completed++;
+        } else if (result == INTERPRET_RUNTIME_ERROR) {
+            scheduler->failed++;
+        } else {
+            scheduler->killed++;
+        }
+        freeFiber(fiber);
+    }
+    flushOutput(vm.output);
+}
+
+
+#ifdef MAVIX_SCHEDULER_THREAD
+
+static void* work(void* scheduler) {
+    runScheduler((Scheduler*)scheduler);
+    return NULL;
+}
+
+
+bool startScheduler(Scheduler* scheduler) {
+    scheduler->started = pthread_create(&scheduler->worker, NULL, work, scheduler) == 0;
+    return scheduler->started;
+}
+
+
+void joinScheduler(Scheduler* scheduler) {
+    closeScheduler(scheduler);
+    if (scheduler->started) pthread_join(scheduler->worker, NULL);
+    scheduler->started = false;
+}
+
+#else
+
+// Without threads the scripts run when the scheduler is joined
+bool startScheduler(Scheduler* scheduler) {
+    (void)scheduler;
+    return false;
+}
+
+
+void joinScheduler(Scheduler* scheduler) {
+    closeScheduler(scheduler);
+    runScheduler(scheduler);
+}
+
+#endif
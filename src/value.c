@@ -1,6 +1,9 @@
+#include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
 
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 
 void initValueArray(ValueArray* array) {
@@ -37,6 +40,8 @@ void printValue(Value value) {
             break;
         case VAL_NIL: printf("nil"); break;
         case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_INT: printf("%" PRId64, AS_INT(value)); break;
+        case VAL_OBJ: printObject(value); break;
     }
 }
 
@@ -49,11 +54,61 @@ void printValue(Value value) {
  * @return true if the two Value objects are equal, false otherwise.
  */
 bool valuesEqual(Value a, Value b) {
+  // An int and a double are equal when they denote exactly the same number
+  if (IS_NUMERIC(a) && IS_NUMERIC(b) && a.type != b.type) {
+    return compareNumbers(a, b) == 0;
+  }
+
   if (a.type != b.type) return false;
   switch (a.type) {
     case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:    return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+    case VAL_INT:    return AS_INT(a) == AS_INT(b);
+    case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
     default:         return false; // Unreachable.
   }
+}
+
+
+// Compares an int with a double exactly. The int is never rounded to a
+// double, so e.g. 2^53 + 1 and 2^53 compare as different numbers.
+static int compareIntDouble(int64_t i, double d) {
+  if (isnan(d)) return UNORDERED;
+  if (d >= 9223372036854775808.0) return -1;     // beyond INT64_MAX
+  if (d < -9223372036854775808.0) return 1;      // below INT64_MIN
+
+  int64_t whole = (int64_t)d;                    // truncates toward zero
+  if (i < whole) return -1;
+  if (i > whole) return 1;
+
+  double fraction = d - (double)whole;
+  if (fraction > 0) return -1;
+  if (fraction < 0) return 1;
+  return 0;
+}
+
+
+/**
+ * Compares two numeric values (ints, doubles or a mix of both).
+ *
+ * @return -1, 0 or 1 when a is less than, equal to or greater than b,
+ *         or UNORDERED when either operand is NaN.
+ */
+int compareNumbers(Value a, Value b) {
+  if (IS_INT(a) && IS_INT(b)) {
+    return (AS_INT(a) > AS_INT(b)) - (AS_INT(a) < AS_INT(b));
+  }
+  if (IS_INT(a)) return compareIntDouble(AS_INT(a), AS_NUMBER(b));
+  if (IS_INT(b)) {
+    int order = compareIntDouble(AS_INT(b), AS_NUMBER(a));
+    return order == UNORDERED ? UNORDERED : -order;
+  }
+
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+  if (x < y) return -1;
+  if (x > y) return 1;
+  if (x == y) return 0;
+  return UNORDERED;
 }
\ No newline at end of file
@@ -5,14 +5,46 @@
 #include "vm.h"
 #include "debug.h"
 #include "compiler.h"
+#include "image.h"
+#include "jit.h"
+#include "memory.h"
+#include "metrics.h"
+#include "profile.h"
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 VM vm;
+static OutputSink standardOutput;
+
+// Back-edges and calls between two runs of the safepoint's slow path when
+// neither a collection nor a fiber's slice needs them
+#define SAFEPOINT_INTERVAL (1 << 20)
+// ... and at most between two looks at the clock when there is a deadline
+#define DEADLINE_INTERVAL 1024
 
 static void resetStack() {
     vm.stackTop = vm.stack;
+    vm.slots = vm.stack;
+    vm.frameCount = 0;
+}
+
+
+// Prints where the function (NULL for the script) was at 'ip'
+static void printTraceLine(ObjFunction* function, uint8_t* ip) {
+    Chunk* chunk = function != NULL ? &function->chunk : vm.script;
+    // A call stopped at a safepoint has not run the callee's first instruction
+    size_t instruction = ip > chunk->code ? ip - chunk->code - 1 : 0;
+    int line = chunk->lines[instruction];
+
+    if (function == NULL) {
+        fprintf(stderr, "[line %d] in script\n", line);
+    } else {
+        fprintf(stderr, "[line %d] in %.*s()\n", line,
+                function->nameLength, function->name);
+    }
 }
 
 /**
@@ -22,29 +54,325 @@ static void resetStack() {
  * using a format string and a variable number of arguments (similar to printf).
  * It is typically used to display errors that occur during the execution of the virtual machine.
  *
+ * @param kind   What went wrong, for the metrics.
  * @param format The format string for the error message.
  * @param ...    Additional arguments to be formatted into the message.
  */
-static void runtimeError(const char* format, ...) {
+static void runtimeError(ErrorKind kind, const char* format, ...) {
+    countRuntimeError(kind);
+    flushOutput(vm.output);     // keep earlier output before the message
+
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
+    // The running function, then its callers, innermost first
+    printTraceLine(vm.function, vm.ip);
+    for (int i = vm.frameCount - 1; i >= 0; i--) {
+        printTraceLine(vm.frames[i].function, vm.frames[i].ip);
+    }
     resetStack();
 }
 
 
+/*
+#####################################
+Safepoints
+#####################################
+*/
+
+static uint64_t nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+// When a run starting now has to stop, UINT64_MAX for never
+static uint64_t deadlineFromNow() {
+    if (vm.timeLimitNs == UINT64_MAX) return UINT64_MAX;
+    return nanoseconds() + vm.timeLimitNs;
+}
+
+
+// Starts the countdown to the next slow path of the safepoint
+static void armSafepoint() {
+    uint64_t ticks = SAFEPOINT_INTERVAL;
+    // Same pace as charging GC_SAFEPOINT_DEBT on every tick
+    if (vm.heap.phase != GC_IDLE) ticks = GC_SLICE_BYTES / GC_SAFEPOINT_DEBT;
+    if (vm.fiber->deadline != UINT64_MAX && ticks > DEADLINE_INTERVAL) ticks = DEADLINE_INTERVAL;
+    if (vm.slice < ticks) ticks = vm.slice;
+    // The tick after the last one paid for stops the fiber
+    if (vm.fiber->fuel < ticks - 1) ticks = vm.fiber->fuel + 1;
+    vm.ticks = (int64_t)ticks;
+    vm.armed = (int64_t)ticks;
+}
+
+
+// Counts the ticks of a run that no safepoint charged
+static void settleTicks() {
+    countMetric(METRIC_TICKS, (uint64_t)(vm.armed - vm.ticks));
+    vm.armed = vm.ticks;
+}
+
+
+void requestSafepoint() {
+    vm.armed -= vm.ticks - 1;
+    vm.ticks = 1;
+}
+
+
+/* @note
+ * Slow path of a back-edge or call, once vm.ticks ran out. The ticks since
+ * the last run are charged at once: to the collection under way, to the
+ * fiber's fuel and to its slice. The clock is only read here, and
+ * armSafepoint() makes sure that happens often enough.
+ *
+ * @return INTERPRET_OK to go on, INTERPRET_YIELD when the fiber used up its
+ * slice, or the limit it ran into (after reporting it).
+ * */
+static InterpretResult safepoint() {
+    Fiber* fiber = vm.fiber;
+    uint64_t elapsed = (uint64_t)(vm.armed - vm.ticks);
+    countMetric(METRIC_TICKS, elapsed);
+    if (vm.heap.phase != GC_IDLE) gcSafepoint(elapsed);
+
+    if (fiber->fuel != UINT64_MAX) {
+        if (elapsed > fiber->fuel) {
+            fiber->fuel = 0;
+            runtimeError(ERROR_FUEL, "Out of fuel.");
+            return INTERPRET_OUT_OF_FUEL;
+        }
+        fiber->fuel -= elapsed;
+    }
+    if (fiber->deadline != UINT64_MAX && nanoseconds() >= fiber->deadline) {
+        runtimeError(ERROR_DEADLINE, "Deadline exceeded.");
+        return INTERPRET_TIMEOUT;
+    }
+
+    InterpretResult result = INTERPRET_OK;
+    if (vm.slice != UINT64_MAX) {
+        vm.slice -= elapsed;
+        if (vm.slice == 0) result = INTERPRET_YIELD;
+    }
+    armSafepoint();
+    return result;
+}
+
+
+
+/*
+#####################################
+Fibers
+#####################################
+*/
+
+static void initFiber(Fiber* fiber, int capacity) {
+    fiber->stack = GROW_ARRAY(Value, NULL, 0, capacity);
+    fiber->stackCapacity = capacity;
+    fiber->stackTop = fiber->stack;
+    fiber->slots = fiber->stack;
+    fiber->frameCount = 0;
+    fiber->function = NULL;
+    fiber->script = NULL;
+    fiber->ip = NULL;
+    for (int i = 0; i < GLOBALS_MAX; i++) {
+        fiber->globals[i] = NIL_VAL;
+        fiber->defined[i] = false;
+    }
+    initChunk(&fiber->code);
+    fiber->cached = NULL;
+    fiber->fuel = vm.fuelLimit;
+    fiber->deadline = deadlineFromNow();
+    fiber->done = false;
+    fiber->nextReady = NULL;
+
+    fiber->prev = NULL;
+    fiber->next = vm.fibers;
+    if (vm.fibers != NULL) vm.fibers->prev = fiber;
+    vm.fibers = fiber;
+}
+
+
+// Saves the running fiber's registers and loads the other one's
+static void switchFiber(Fiber* fiber) {
+    Fiber* from = vm.fiber;
+    from->ip = vm.ip;
+    from->slots = vm.slots;
+    from->function = vm.function;
+    from->script = vm.script;
+    from->frameCount = vm.frameCount;
+    from->stackTop = vm.stackTop;
+
+    vm.fiber = fiber;
+    vm.ip = fiber->ip;
+    vm.slots = fiber->slots;
+    vm.function = fiber->function;
+    vm.script = fiber->script;
+    vm.chunk = fiber->function != NULL ? &fiber->function->chunk : fiber->script;
+    vm.frames = fiber->frames;
+    vm.frameCount = fiber->frameCount;
+    vm.stack = fiber->stack;
+    vm.stackTop = fiber->stackTop;
+    vm.stackLimit = fiber->stack + fiber->stackCapacity;
+    vm.globals.values = fiber->globals;
+    vm.globals.defined = fiber->defined;
+}
+
+
+/* @note
+ * Fibers start with a small stack, which grows when a call may not fit.
+ * Everything pointing into it (the registers and the callers' slots) is
+ * moved along.
+ * */
+static bool growStack() {
+    Fiber* fiber = vm.fiber;
+    if (fiber->stackCapacity >= VALUE_STACK_MAX) return false;
+
+    int capacity = fiber->stackCapacity * 2;
+    if (capacity > VALUE_STACK_MAX) capacity = VALUE_STACK_MAX;
+    Value* stack = GROW_ARRAY(Value, NULL, 0, capacity);
+    memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    vm.slots = stack + (vm.slots - vm.stack);
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+
+    FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+    fiber->stack = stack;
+    fiber->stackCapacity = capacity;
+    vm.stack = stack;
+    vm.stackLimit = stack + capacity;
+    return true;
+}
+
+
+Fiber* newFiber(const char* source, size_t length) {
+    Fiber* fiber = ALLOCATE(Fiber, 1);
+    initFiber(fiber, FIBER_STACK_MIN);
+
+    if (vm.cache != NULL) {
+        // Fibers running the same script share its chunk
+        fiber->cached = acquireChunk(vm.cache, source, length);
+        if (fiber->cached == NULL) {
+            freeFiber(fiber);
+            return NULL;
+        }
+        fiber->script = &fiber->cached->chunk;
+    } else {
+        if (!compile(source, length, &fiber->code)) {
+            freeFiber(fiber);
+            return NULL;
+        }
+        fiber->script = &fiber->code;
+    }
+    fiber->ip = fiber->script->code;
+    return fiber;
+}
+
+
+void freeFiber(Fiber* fiber) {
+    if (fiber->prev != NULL) {
+        fiber->prev->next = fiber->next;
+    } else {
+        vm.fibers = fiber->next;
+    }
+    if (fiber->next != NULL) fiber->next->prev = fiber->prev;
+
+    if (fiber->cached != NULL) releaseChunk(vm.cache, fiber->cached);
+    freeChunk(&fiber->code);
+    FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+    FREE(Fiber, fiber);
+}
+
+
+
+// Makes the top-level chunk the running code, with no callers.
+static void enterScript(Chunk* chunk) {
+    vm.script = chunk;
+    vm.chunk = chunk;
+    vm.ip = chunk->code;
+    vm.function = NULL;
+    vm.slots = vm.stack;
+    vm.frameCount = 0;
+
+    // Every run gets the whole of the limits
+    vm.fiber->fuel = vm.fuelLimit;
+    vm.fiber->deadline = deadlineFromNow();
+    vm.slice = UINT64_MAX;
+    armSafepoint();
+}
+
+
 void initVM() {
+    vm.fibers = NULL;
+    vm.fuelLimit = UINT64_MAX;
+    vm.timeLimitNs = UINT64_MAX;
+    initFiber(&vm.main, VALUE_STACK_MAX);
+    vm.fiber = &vm.main;
+    vm.frames = vm.main.frames;
+    vm.stack = vm.main.stack;
+    vm.stackLimit = vm.stack + VALUE_STACK_MAX;
+    vm.globals.values = vm.main.globals;
+    vm.globals.defined = vm.main.defined;
     resetStack();
+    vm.jit = false;
+    vm.cache = NULL;
+    vm.profileLoops = false;
+    vm.globals.count = 0;
+    vm.natives.count = 0;
+    defineCoreNatives();
+    vm.script = NULL;
+    vm.function = NULL;
+    initChunk(&vm.session);
+    vm.gcStats = false;
+    initHeap(&vm.heap);
+    vm.slice = UINT64_MAX;
+    armSafepoint();
+
+    initFileSink(&standardOutput, stdout);
+    vm.output = &standardOutput;
 }
 
 void freeVM() {
+    flushOutput(vm.output);
+    freeOutputSink(&standardOutput);
+
+    for (int i = 0; i < vm.globals.count; i++) {
+        FREE_ARRAY(char, vm.globals.names[i], vm.globals.lengths[i]);
+    }
+    vm.globals.count = 0;
+
+    while (vm.fibers != &vm.main) freeFiber(vm.fibers);
+    FREE_ARRAY(Value, vm.main.stack, vm.main.stackCapacity);
+    freeChunk(&vm.session);
+
+    if (vm.gcStats) printGcStats(stderr);
+    freeHeap(&vm.heap);
+    unloadImage();
+}
+
+
+int globalSlot(const char* name, int length) {
+    Globals* globals = &vm.globals;
+    for (int i = 0; i < globals->count; i++) {
+        if (globals->lengths[i] == length &&
+            memcmp(globals->names[i], name, length) == 0) {
+            return i;
+        }
+    }
+    if (globals->count == GLOBALS_MAX) return -1;
 
+    // The name is copied: the source it came from may go away
+    int slot = globals->count++;
+    globals->names[slot] = GROW_ARRAY(char, NULL, 0, length);
+    memcpy(globals->names[slot], name, length);
+    globals->lengths[slot] = length;
+    return slot;
 }
 
 void push(Value value ) {
@@ -66,6 +394,95 @@ static bool isFalsey(Value value) {
 }
 
 
+/* @note
+ * The callee and its arguments are already on the stack, and they become
+ * the first slots of the new function: nothing is copied. Only the caller's
+ * three registers are saved in the next frame.
+ * */
+static bool call(ObjFunction* function, int argCount) {
+    if (argCount != function->arity) {
+        runtimeError(ERROR_CALL, "Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+    if (vm.frameCount == FRAMES_MAX ||
+        (vm.stackTop + STACK_MAX > vm.stackLimit && !growStack())) {
+        runtimeError(ERROR_STACK_OVERFLOW, "Stack overflow.");
+        return false;
+    }
+
+    CallFrame* frame = &vm.frames[vm.frameCount++];
+    frame->function = vm.function;
+    frame->ip = vm.ip;
+    frame->slots = vm.slots;
+
+    vm.function = function;
+    vm.chunk = &function->chunk;
+    vm.ip = function->chunk.code;
+    vm.slots = vm.stackTop - argCount - 1;
+    return true;
+}
+
+
+/* @note
+ * The callee replaces the running function instead of being stacked on top
+ * of it: the callee and its arguments are moved down over the current
+ * frame's slots and no CallFrame is used. The callee returns straight to
+ * our caller, so recursion in tail position runs in constant space.
+ * */
+static bool tailCall(Value callee, int argCount) {
+    if (!IS_FUNCTION(callee)) {
+        runtimeError(ERROR_CALL, "Can only call functions.");
+        return false;
+    }
+
+    ObjFunction* function = AS_FUNCTION(callee);
+    if (argCount != function->arity) {
+        runtimeError(ERROR_CALL, "Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+
+    Value* callSlots = vm.stackTop - argCount - 1;
+    memmove(vm.slots, callSlots, sizeof(Value) * (argCount + 1));
+    vm.stackTop = vm.slots + argCount + 1;
+
+    vm.function = function;
+    vm.chunk = &function->chunk;
+    vm.ip = function->chunk.code;
+    return true;
+}
+
+
+static bool callValue(Value callee, int argCount) {
+    if (IS_FUNCTION(callee)) return call(AS_FUNCTION(callee), argCount);
+
+    runtimeError(ERROR_CALL, "Can only call functions.");
+    return false;
+}
+
+
+/* @note
+ * With --jit, a chunk runs as machine code from its first instruction, and
+ * again after each instruction the machine code leaves to the interpreter:
+ * calls and returns, natives, and back-edges that took the slow path. After
+ * a failed type check the interpreter carries on up to the next of those.
+ * The code is made on the chunk's first run and stays with the chunk.
+ * */
+static void runJit() {
+    Chunk* chunk = vm.chunk;
+    if (chunk->jit == NULL) {
+        bool compiled = vm.function != NULL
+            ? jitCompile(chunk, vm.function->name, vm.function->nameLength)
+            : jitCompile(chunk, "script", 6);
+        if (!compiled) {
+            vm.jit = false;     // not available on this platform
+            return;
+        }
+    }
+    int offset = (int)(vm.ip - chunk->code);
+    vm.ip = chunk->code + jitRun(chunk, offset, &vm.stackTop, vm.slots);
+}
+
+
 /**
  * Executes the main interpreter loop for the virtual machine.
  *
@@ -86,19 +503,161 @@ static InterpretResult run() {
  *  Returns the Value at that index. 
  * */
 #define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+// Reads a big-endian 16-bit operand (jump offsets)
+#define READ_SHORT() \
+    (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
+
+/* @note
+ * Quickening: the generic form rewrites its own opcode byte (the one just read)
+ * into the specialized form once it has seen number operands, so later
+ * executions of the same site skip the per-operand checks.
+ * */
+#define QUICKEN(specializedOp) \
+    do { \
+        vm.ip[-1] = (specializedOp); \
+        vm.chunk->quickened++; \
+    } while (false)
 
-#define BINARY_OP(valueType, op) \
+/* @note
+ * Generic arithmetic. Two ints stay on integers and fall back to double
+ * arithmetic when 'overflows' (a __builtin_*_overflow) reports an overflow.
+ * Mixed int/double operands are widened to doubles. Both same-typed cases
+ * quicken to their specialized forms.
+ * */
+#define ARITH_OP(op, overflows, numberOp, intOp) \
     do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers."); \
+        if (IS_INT(peek(0)) && IS_INT(peek(1))) { \
+            QUICKEN(intOp); \
+            INT_ARITH(op, overflows); \
+            break; \
+        } \
+        if (!IS_NUMERIC(peek(0)) || !IS_NUMERIC(peek(1))) { \
+            runtimeError(ERROR_TYPE, "Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
+      if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) QUICKEN(numberOp); \
+      double b = TO_DOUBLE(peek(0)); \
+      double a = TO_DOUBLE(peek(1)); \
+      vm.stackTop -= 2; \
+      push(NUMBER_VAL(a op b)); \
+    } while (false)
+
+#define INT_ARITH(op, overflows) \
+    do { \
+      int64_t b = AS_INT(pop()); \
+      int64_t a = AS_INT(pop()); \
+      int64_t result; \
+      if (overflows(a, b, &result)) { \
+          push(NUMBER_VAL((double)a op (double)b)); \
+      } else { \
+          push(INT_VAL(result)); \
+      } \
+    } while (false)
+
+/* @note
+ * Generic comparison. Mixed int/double operands are compared exactly through
+ * compareNumbers(), which never rounds the int.
+ * */
+#define COMPARE_OP(op, numberOp, intOp) \
+    do { \
+        if (IS_INT(peek(0)) && IS_INT(peek(1))) { \
+            QUICKEN(intOp); \
+            int64_t b = AS_INT(pop()); \
+            int64_t a = AS_INT(pop()); \
+            push(BOOL_VAL(a op b)); \
+            break; \
+        } \
+        if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) { \
+            QUICKEN(numberOp); \
+            double b = AS_NUMBER(pop()); \
+            double a = AS_NUMBER(pop()); \
+            push(BOOL_VAL(a op b)); \
+            break; \
+        } \
+        if (!IS_NUMERIC(peek(0)) || !IS_NUMERIC(peek(1))) { \
+            runtimeError(ERROR_TYPE, "Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+      Value b = pop(); \
+      Value a = pop(); \
+      int order = compareNumbers(a, b); \
+      push(BOOL_VAL(order != UNORDERED && order op 0)); \
+    } while (false)
+
+/* @note
+ * Specialized form: a single combined guard. If it fails, the site is rewritten
+ * back to the generic opcode and the instruction is re-dispatched, so the generic
+ * path reports the error (or re-specializes later).
+ * */
+#define DEOPTIMIZE(genericOp) \
+    do { \
+        vm.ip[-1] = (genericOp); \
+        vm.chunk->quickened--; \
+        vm.ip--; \
+    } while (false)
+
+#define BINARY_OP_NUM(valueType, op, genericOp) \
+    do { \
+        if (!IS_NUMBER_PAIR(peek(0), peek(1))) { \
+            DEOPTIMIZE(genericOp); \
+            break; \
+        } \
       double b = AS_NUMBER(pop()); \
       double a = AS_NUMBER(pop()); \
       push(valueType(a op b)); \
     } while (false)
 
+#define INT_ARITH_OP(op, overflows, genericOp) \
+    do { \
+        if (!IS_INT_PAIR(peek(0), peek(1))) { \
+            DEOPTIMIZE(genericOp); \
+            break; \
+        } \
+      INT_ARITH(op, overflows); \
+    } while (false)
+
+#define INT_COMPARE_OP(op, genericOp) \
+    do { \
+        if (!IS_INT_PAIR(peek(0), peek(1))) { \
+            DEOPTIMIZE(genericOp); \
+            break; \
+        } \
+      int64_t b = AS_INT(pop()); \
+      int64_t a = AS_INT(pop()); \
+      push(BOOL_VAL(a op b)); \
+    } while (false)
+
+/* @note
+ * Back-edges and calls count vm.ticks down, and only when it runs out does
+ * safepoint() run (see there). A fiber that has to yield is suspended at
+ * the instruction after the jump or the call, so it makes progress with
+ * every turn, however short.
+ * */
+#define SAFEPOINT() (--vm.ticks > 0 ? INTERPRET_OK : safepoint())
+
+// Where the JIT's code is entered (see runJit())
+#define JIT_ENTER() \
+    do { \
+        if (vm.jit) runJit(); \
+    } while (false)
+
+// Unchecked form: the compiler proved both operands are (double) numbers
+#define BINARY_OP_UNCHECKED(valueType, op) \
+    do { \
+      double b = AS_NUMBER(pop()); \
+      double a = AS_NUMBER(pop()); \
+      push(valueType(a op b)); \
+    } while (false)
+
+#ifdef COUNT_INSTRUCTIONS
+    // Slows dispatch down by a fifth to a third, hence only in builds that ask
+    MetricShard* shard = currentShard();
+#endif
+
     for (;;) {
+#ifdef COUNT_INSTRUCTIONS
+        addCount(&shard->counters[METRIC_INSTRUCTIONS], 1);
+#endif
     
     // For diagnostic logging 
 /* 
@@ -134,13 +693,75 @@ executing it.
                 push(BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
+            case OP_GREATER:  COMPARE_OP(>, OP_GREATER_NUM, OP_GREATER_INT); break;
+            case OP_LESS:     COMPARE_OP(<, OP_LESS_NUM, OP_LESS_INT); break;
+
+            case OP_ADD:
+                ARITH_OP(+, __builtin_add_overflow, OP_ADD_NUM, OP_ADD_INT);
+                break;
+            case OP_SUBTRACT:
+                ARITH_OP(-, __builtin_sub_overflow, OP_SUBTRACT_NUM, OP_SUBTRACT_INT);
+                break;
+            case OP_MULTIPLY:
+                ARITH_OP(*, __builtin_mul_overflow, OP_MULTIPLY_NUM, OP_MULTIPLY_INT);
+                break;
+
+            /*
+            @note
+            Dividing two ints only yields an int when the division is exact, so
+            7 / 2 is still 3.5. Everything else is a double division.
+            */
+            case OP_DIVIDE: {
+                if (!IS_NUMERIC(peek(0)) || !IS_NUMERIC(peek(1))) {
+                    runtimeError(ERROR_TYPE, "Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (IS_INT(peek(0)) && IS_INT(peek(1))) {
+                    int64_t b = AS_INT(peek(0));
+                    int64_t a = AS_INT(peek(1));
+                    if (b != 0 && !(a == INT64_MIN && b == -1) && a % b == 0) {
+                        vm.stackTop -= 2;
+                        push(INT_VAL(a / b));
+                        break;
+                    }
+                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                    QUICKEN(OP_DIVIDE_NUM);
+                }
+                double b = TO_DOUBLE(peek(0));
+                double a = TO_DOUBLE(peek(1));
+                vm.stackTop -= 2;
+                push(NUMBER_VAL(a / b));
+                break;
+            }
 
-            case OP_ADD:        BINARY_OP(NUMBER_VAL, +); break;
-            case OP_SUBTRACT:   BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY:   BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:     BINARY_OP(NUMBER_VAL, /); break;
+            case OP_GREATER_NUM:  BINARY_OP_NUM(BOOL_VAL, >, OP_GREATER); break;
+            case OP_LESS_NUM:     BINARY_OP_NUM(BOOL_VAL, <, OP_LESS); break;
+
+            case OP_ADD_NUM:      BINARY_OP_NUM(NUMBER_VAL, +, OP_ADD); break;
+            case OP_SUBTRACT_NUM: BINARY_OP_NUM(NUMBER_VAL, -, OP_SUBTRACT); break;
+            case OP_MULTIPLY_NUM: BINARY_OP_NUM(NUMBER_VAL, *, OP_MULTIPLY); break;
+            case OP_DIVIDE_NUM:   BINARY_OP_NUM(NUMBER_VAL, /, OP_DIVIDE); break;
+
+            case OP_GREATER_INT:  INT_COMPARE_OP(>, OP_GREATER); break;
+            case OP_LESS_INT:     INT_COMPARE_OP(<, OP_LESS); break;
+
+            case OP_ADD_INT:
+                INT_ARITH_OP(+, __builtin_add_overflow, OP_ADD);
+                break;
+            case OP_SUBTRACT_INT:
+                INT_ARITH_OP(-, __builtin_sub_overflow, OP_SUBTRACT);
+                break;
+            case OP_MULTIPLY_INT:
+                INT_ARITH_OP(*, __builtin_mul_overflow, OP_MULTIPLY);
+                break;
+
+            case OP_GREATER_UNCHECKED:  BINARY_OP_UNCHECKED(BOOL_VAL, >); break;
+            case OP_LESS_UNCHECKED:     BINARY_OP_UNCHECKED(BOOL_VAL, <); break;
+
+            case OP_ADD_UNCHECKED:      BINARY_OP_UNCHECKED(NUMBER_VAL, +); break;
+            case OP_SUBTRACT_UNCHECKED: BINARY_OP_UNCHECKED(NUMBER_VAL, -); break;
+            case OP_MULTIPLY_UNCHECKED: BINARY_OP_UNCHECKED(NUMBER_VAL, *); break;
+            case OP_DIVIDE_UNCHECKED:   BINARY_OP_UNCHECKED(NUMBER_VAL, /); break;
             case OP_NOT:
                 push(BOOL_VAL(isFalsey(pop())));
                 break;
@@ -151,24 +772,179 @@ executing it.
             stack. It negates that, then pushes the result back on for later instructions to use.
             */
             case OP_NEGATE:     
+                if (IS_INT(peek(0))) {
+                    int64_t a = AS_INT(pop());
+                    // -INT64_MIN does not fit, so it is promoted to a double
+                    push(a == INT64_MIN ? NUMBER_VAL(-(double)a) : INT_VAL(-a));
+                    break;
+                }
                 if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
+                    runtimeError(ERROR_TYPE, "Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 } 
                 push(NUMBER_VAL(-AS_NUMBER(pop())));
                 break;
 
+            case OP_NEGATE_UNCHECKED:
+                vm.stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1]));
+                break;
+
+            case OP_GET_COLUMN: {
+                const double* column = vm.columns[READ_BYTE()];
+                push(NUMBER_VAL(column[vm.row]));
+                break;
+            }
+
+            case OP_POP:
+                pop();
+                break;
+
+            case OP_JUMP: {
+                uint16_t offset = READ_SHORT();
+                vm.ip += offset;
+                break;
+            }
+
+            // The condition stays on the stack: it is the value of a
+            // short-circuited and/or, otherwise the code pops it
+            case OP_JUMP_IF_FALSE: {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(peek(0))) vm.ip += offset;
+                break;
+            }
+            case OP_JUMP_IF_TRUE: {
+                uint16_t offset = READ_SHORT();
+                if (!isFalsey(peek(0))) vm.ip += offset;
+                break;
+            }
+
+            // Back-edge of a loop: counts the iteration for the profile
+            case OP_LOOP: {
+                uint16_t offset = READ_SHORT();
+                vm.chunk->loops[READ_BYTE()].iterations++;
+                // Checked before jumping, so a limit is reported on this line
+                InterpretResult status = SAFEPOINT();
+                vm.ip -= offset;
+                if (status != INTERPRET_OK) return status;
+                JIT_ENTER();
+                break;
+            }
+
+            case OP_PRINT:
+                writeValue(vm.output, pop());
+                writeOutput(vm.output, "\n", 1);
+                break;
+
+            case OP_DEFINE_GLOBAL: {
+                uint8_t slot = READ_BYTE();
+                vm.globals.values[slot] = pop();
+                vm.globals.defined[slot] = true;
+                break;
+            }
+            case OP_GET_GLOBAL: {
+                uint8_t slot = READ_BYTE();
+                if (!vm.globals.defined[slot]) {
+                    runtimeError(ERROR_UNDEFINED, "Undefined variable '%.*s'.",
+                                 vm.globals.lengths[slot], vm.globals.names[slot]);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                push(vm.globals.values[slot]);
+                break;
+            }
+            // Assignment is an expression: the value stays on the stack
+            case OP_SET_GLOBAL: {
+                uint8_t slot = READ_BYTE();
+                if (!vm.globals.defined[slot]) {
+                    runtimeError(ERROR_UNDEFINED, "Undefined variable '%.*s'.",
+                                 vm.globals.lengths[slot], vm.globals.names[slot]);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                vm.globals.values[slot] = peek(0);
+                break;
+            }
+
+            case OP_GET_LOCAL:
+                push(vm.slots[READ_BYTE()]);
+                break;
+            case OP_SET_LOCAL:
+                vm.slots[READ_BYTE()] = peek(0);
+                break;
+
+            case OP_CALL: {
+                int argCount = READ_BYTE();
+                if (!callValue(peek(argCount), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                InterpretResult status = SAFEPOINT();
+                if (status != INTERPRET_OK) return status;
+                JIT_ENTER();
+                break;
+            }
+
+            case OP_TAIL_CALL: {
+                int argCount = READ_BYTE();
+                if (!tailCall(peek(argCount), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                InterpretResult status = SAFEPOINT();
+                if (status != INTERPRET_OK) return status;
+                JIT_ENTER();
+                break;
+            }
+
+            // The native works on its arguments where they are, and its
+            // result takes the place of the first one
+            case OP_CALL_NATIVE: {
+                NativeFn native = vm.natives.functions[READ_BYTE()];
+                int argCount = READ_BYTE();
+                Value* args = vm.stackTop - argCount;
+                Value result;
+                if (!native(argCount, args, &result)) {
+                    runtimeError(ERROR_NATIVE, "%s", nativeErrorMessage());
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                vm.stackTop = args;
+                push(result);
+                JIT_ENTER();
+                break;
+            }
+
             case OP_RETURN: {
-                printValue(pop());
-                printf("\n");
-                return INTERPRET_OK;
+                Value result = pop();
+                if (vm.frameCount == 0) {
+                    vm.result = result;
+                    return INTERPRET_OK;
+                }
+
+                // Drop the callee's slots (the callee itself included)
+                vm.stackTop = vm.slots;
+                push(result);
+
+                CallFrame* frame = &vm.frames[--vm.frameCount];
+                vm.function = frame->function;
+                vm.chunk = frame->function != NULL ? &frame->function->chunk : vm.script;
+                vm.ip = frame->ip;
+                vm.slots = frame->slots;
+                JIT_ENTER();
+                break;
             }
         }
     }
 
 #undef READ_BYTE
 #undef READ_CONSTANT
-#undef BINARY_OP
+#undef READ_SHORT
+#undef QUICKEN
+#undef ARITH_OP
+#undef INT_ARITH
+#undef COMPARE_OP
+#undef DEOPTIMIZE
+#undef BINARY_OP_NUM
+#undef INT_ARITH_OP
+#undef INT_COMPARE_OP
+#undef BINARY_OP_UNCHECKED
+#undef SAFEPOINT
+#undef JIT_ENTER
 }
 
 
@@ -184,19 +960,139 @@ executing it.
  * @return InterpretResult The result of interpreting the source code.
  */
 InterpretResult interpret(const char* source) {
-    Chunk chunk;
-    initChunk(&chunk);
+    return interpretSource(source, strlen(source));
+}
+
+
+/**
+ * @brief Interprets 'length' bytes of source code.
+ *
+ * The source does not have to be NUL-terminated, so it can be e.g. a file
+ * mapped straight into memory.
+ *
+ * @param source The source code to interpret.
+ * @param length The length of the source in bytes.
+ * @return InterpretResult The result of interpreting the source code.
+ */
+InterpretResult interpretSource(const char* source, size_t length) {
+    Chunk local;
+    Chunk* chunk = &local;
+    CacheEntry* cached = NULL;
+
+    if (vm.cache != NULL) {
+        // Sources seen before skip the scanner and compiler entirely
+        cached = acquireChunk(vm.cache, source, length);
+        if (cached == NULL) return INTERPRET_COMPILE_ERROR;
+        chunk = &cached->chunk;
+        resetLoopCounters(chunk);   // counted by the earlier runs
+    } else {
+        initChunk(&local);
+        if (!compile(source, length, &local)) {
+            freeChunk(&local);
+            return INTERPRET_COMPILE_ERROR;
+        }
+    }
 
-    if (!compile(source, &chunk)) {
-        freeChunk(&chunk);
+    enterScript(chunk);
+
+    // The machine code runs as far as it can, then the interpreter takes over
+    if (vm.jit) runJit();
+
+    // Scripts print with 'print' (a trailing expression is printed too)
+    InterpretResult result = run();
+    settleTicks();
+    if (vm.profileLoops) {
+        flushOutput(vm.output);     // the profile follows the script's output
+        printLoopProfile(chunk, stderr);
+    }
+    vm.script = NULL;       // no longer a root once it is released
+
+    if (cached != NULL) {
+        releaseChunk(vm.cache, cached);
+    } else {
+        freeChunk(&local);
+    }
+    return result;
+}
+
+
+
+/* @note
+ * A line's code is dead once it ran: nothing jumps back into it, and the
+ * functions it defined have chunks of their own. So when earlier lines have
+ * used up half of the constant or loop slots (256 each), the session starts
+ * over at the beginning of the chunk, keeping its memory. A line that does
+ * not compile is rolled back.
+ * */
+#define SESSION_RESET (UINT8_COUNT / 2)
+
+InterpretResult interpretLine(const char* source, size_t length) {
+    Chunk* session = &vm.session;
+    if (session->constants.count > SESSION_RESET || session->loopCount > SESSION_RESET) {
+        truncateChunk(session, 0, 0, 0);
+    }
+
+    int start = session->count;
+    int constants = session->constants.count;
+    int loops = session->loopCount;
+    jitFree(session);       // its machine code would not cover the new line
+    if (!compile(source, length, session)) {
+        truncateChunk(session, start, constants, loops);
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+    enterScript(session);
+    vm.ip = session->code + start;
 
     InterpretResult result = run();
+    settleTicks();
+    vm.script = NULL;
+    return result;
+}
 
-    freeChunk(&chunk);
+
+
+/* @note
+ * The fiber runs on the VM in place of the caller (the main fiber, normally),
+ * whose registers are put back afterwards.
+ * */
+InterpretResult resumeFiber(Fiber* fiber, uint64_t slice) {
+    if (fiber->done) return INTERPRET_OK;
+
+    Fiber* caller = vm.fiber;
+    switchFiber(fiber);
+    vm.slice = slice > 0 ? slice : 1;
+    armSafepoint();
+
+    InterpretResult result = run();
+    settleTicks();
+    if (result != INTERPRET_YIELD) fiber->done = true;
+
+    switchFiber(caller);
+    vm.slice = UINT64_MAX;
+    armSafepoint();
     return result;
 }
+
+
+
+/**
+ * @brief Runs an already compiled chunk from its first instruction.
+ *
+ * Unlike interpret(), the value returned by the chunk is handed back to the
+ * caller instead of being printed. Input columns (vm.columns / vm.row) must be
+ * set up by the caller if the chunk reads any.
+ *
+ * @param chunk The chunk to run. It may be run many times (e.g. once per row).
+ * @param result Receives the returned value when the run succeeds.
+ * @return InterpretResult The result of running the chunk.
+ */
+InterpretResult evaluate(Chunk* chunk, Value* result) {
+    enterScript(chunk);
+
+    InterpretResult status = run();
+    settleTicks();
+    vm.script = NULL;       // the caller owns the chunk
+    if (status == INTERPRET_OK) *result = vm.result;
+    return status;
+}
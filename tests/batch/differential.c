@@ -0,0 +1,159 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "batch.h"
+#include "compiler.h"
+
+/* @note
+ * Runs expressions over columns of awkward doubles (NaN, both zeros, both
+ * infinities, values near the int limits) with runBatch() and with
+ * evaluate() row by row, and checks that every row gets the same type and
+ * the same bits. The rows span more than one batch and end in a partial one.
+ * Expressions that fail must fail both ways.
+ *
+ * The one exception: with NaNs on both sides, C leaves it to the compiler
+ * which of them an operator returns, so there any NaN will do.
+ *
+ * Run by ctest as batch/differential.
+ * */
+
+#define ROWS (BATCH_LANES * 2 + 37)
+#define COLUMNS 3
+
+static const char* names[COLUMNS] = {"x", "y", "z"};
+
+static const char* expressions[] = {
+    "x + y", "x - y", "x * y", "x / y", "-x", "x * 0", "-0 * x", "x - x",
+    "x < y", "x <= y", "x > y", "x >= y", "x == y", "x != y", "!(x < y)",
+    "x < y and y < z", "x < y or z > 0", "x and y", "x > 0 or nil",
+    "(x + 1) * (y - 2) / 3", "x * y + z", "x + y == y + x", "z / 3",
+    "x + 9223372036854775807", "9223372036854775807 + 1", "7 / 2", "6 / 2",
+    "-(-9223372036854775807 - 1)", "1 / 0", "0 / 0", "x == nil", "true", "nil",
+    NULL,
+};
+
+// Fail on the first row both ways
+static const char* failing[] = {"x + nil", "-nil", "x < true", NULL};
+
+
+// Same type and same bits (valuesEqual() has NaN != NaN and -0 == 0)
+static bool sameValue(Value a, Value b) {
+    if (a.type != b.type) return false;
+    switch (a.type) {
+        case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NIL:    return true;
+        case VAL_NUMBER: return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+        case VAL_INT:    return AS_INT(a) == AS_INT(b);
+        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    }
+    return false;
+}
+
+
+static void fillColumns(double columns[COLUMNS][ROWS]) {
+    const double specials[] = {
+        0.0, -0.0, 1.0, -1.0, 0.5, 3.0, -7.25, 1e308, -1e308, 5e-324,
+        INFINITY, -INFINITY, NAN, -NAN, 9007199254740992.0, 9007199254740993.0,
+        9.2233720368547758e18, -9.2233720368547758e18,
+    };
+    int count = (int)(sizeof(specials) / sizeof(specials[0]));
+    for (int row = 0; row < ROWS; row++) {
+        columns[0][row] = specials[row % count];
+        columns[1][row] = specials[(row / count) % count];
+        columns[2][row] = row * 0.25 - 100;
+    }
+}
+
+
+// Returns the number of rows that differ
+static int check(const char* source, const double* const* columns) {
+    static Value batched[ROWS];
+    static Value scalar[ROWS];
+
+    Chunk chunk;
+    initChunk(&chunk);
+    if (!compileColumns(source, strlen(source), names, COLUMNS, &chunk)) {
+        printf("%s: does not compile\n", source);
+        freeChunk(&chunk);
+        return 1;
+    }
+
+    // Batches first, then rows (which quicken the chunk), then batches of
+    // the quickened chunk
+    int mismatches = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        InterpretResult result = runBatch(&chunk, columns, ROWS, batched);
+        if (result != INTERPRET_OK) {
+            printf("%s: runBatch() failed\n", source);
+            mismatches++;
+            break;
+        }
+
+        vm.columns = columns;
+        for (int row = 0; row < ROWS; row++) {
+            vm.row = (size_t)row;
+            if (evaluate(&chunk, &scalar[row]) != INTERPRET_OK) {
+                printf("%s: row %d fails on the scalar VM\n", source, row);
+                mismatches++;
+                break;
+            }
+            bool eitherNan = isnan(columns[0][row]) && isnan(columns[1][row]) &&
+                             IS_NUMBER(batched[row]) && isnan(AS_NUMBER(batched[row])) &&
+                             IS_NUMBER(scalar[row]) && isnan(AS_NUMBER(scalar[row]));
+            if (!sameValue(batched[row], scalar[row]) && !eitherNan) {
+                printf("%s, pass %d, row %d (x = %g, y = %g): ", source, pass, row,
+                       columns[0][row], columns[1][row]);
+                printValue(batched[row]);
+                printf(" batched, ");
+                printValue(scalar[row]);
+                printf(" scalar\n");
+                mismatches++;
+            }
+        }
+    }
+
+    freeChunk(&chunk);
+    return mismatches;
+}
+
+
+static int checkFailing(const char* source, const double* const* columns) {
+    static Value results[ROWS];
+
+    Chunk chunk;
+    initChunk(&chunk);
+    compileColumns(source, strlen(source), names, COLUMNS, &chunk);
+
+    InterpretResult batched = runBatch(&chunk, columns, ROWS, results);
+    vm.columns = columns;
+    vm.row = 0;
+    InterpretResult scalar = evaluate(&chunk, &results[0]);
+    freeChunk(&chunk);
+
+    if (batched == INTERPRET_RUNTIME_ERROR && scalar == INTERPRET_RUNTIME_ERROR) return 0;
+    printf("%s: %d batched, %d scalar, both should be runtime errors\n",
+           source, (int)batched, (int)scalar);
+    return 1;
+}
+
+
+int main() {
+    static double storage[COLUMNS][ROWS];
+    fillColumns(storage);
+    const double* columns[COLUMNS] = {storage[0], storage[1], storage[2]};
+
+    initVM();
+    int mismatches = 0;
+    int count = 0;
+    for (int i = 0; expressions[i] != NULL; i++, count++) {
+        mismatches += check(expressions[i], columns);
+    }
+    for (int i = 0; failing[i] != NULL; i++, count++) {
+        mismatches += checkFailing(failing[i], columns);
+    }
+    freeVM();
+
+    printf("%d expressions over %d rows: %d mismatches\n", count, ROWS, mismatches);
+    return mismatches == 0 ? 0 : 1;
+}
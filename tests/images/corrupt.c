@@ -0,0 +1,249 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "object.h"
+#include "vm.h"
+
+/* @note
+ * Saves an image of a preamble, then corrupts one field of one function
+ * record at a time, as a bad disk or a hand-edited file might, and loads
+ * each copy in a fresh VM: all of them must be refused as "truncated or
+ * corrupt" rather than crash or be installed. 'inner' is only reachable
+ * through the constants of 'outer', so its checks need the walk through
+ * the constants. The intact copy, and one where a function is among its
+ * own constants, must load.
+ *
+ * The records are found in the file by their contents: each one is
+ * followed by its name, which tells where the image's pointers point.
+ *
+ * Run by ctest as images/corrupt.
+ * */
+
+static const char* preamble =
+    "fun outer(n) {\n"
+    "    fun inner(m) { return m + 1; }\n"
+    "    var sum = 0;\n"
+    "    for (var i = 0; i < n; i = i + 1) sum = sum + inner(i);\n"
+    "    return sum;\n"
+    "}\n";
+
+typedef struct {
+    uint8_t* bytes;
+    size_t size;
+    uint64_t base;          // address the pointers in the file are for
+    uint64_t outer;         // offsets of the records
+    uint64_t inner;
+} Image;
+
+typedef void (*Corruption)(Image* image);
+
+
+// Offset of the record of the function called 'name', or 0
+static uint64_t findFunction(Image* image, const char* name) {
+    int length = (int)strlen(name);
+    for (uint64_t offset = 16; offset + sizeof(ObjFunction) + (uint64_t)length <= image->size;
+         offset += 16) {
+        ObjFunction record;
+        memcpy(&record, image->bytes + offset, sizeof(record));
+        if (record.obj.type == OBJ_FUNCTION && record.obj.isMarked && record.obj.isOld &&
+            record.nameLength == length &&
+            memcmp(image->bytes + offset + sizeof(ObjFunction), name, (size_t)length) == 0) {
+            image->base = (uint64_t)(uintptr_t)record.name - (offset + sizeof(ObjFunction));
+            return offset;
+        }
+    }
+    return 0;
+}
+
+
+static uint64_t offsetOf(Image* image, const void* pointer) {
+    return (uint64_t)(uintptr_t)pointer - image->base;
+}
+
+static void* pointerTo(Image* image, uint64_t offset) {
+    return (void*)(uintptr_t)(image->base + offset);
+}
+
+static ObjFunction* record(Image* image, uint64_t offset) {
+    return (ObjFunction*)(image->bytes + offset);
+}
+
+// The first constant of 'outer' is 'inner'
+static Value* firstConstant(Image* image, ObjFunction* outer) {
+    return (Value*)(image->bytes + offsetOf(image, outer->chunk.constants.values));
+}
+
+
+static void hugeCount(Image* image) {
+    ObjFunction* inner = record(image, image->inner);
+    inner->chunk.count = inner->chunk.capacity = 1 << 30;
+}
+
+static void codeAtTheEnd(Image* image) {
+    ObjFunction* inner = record(image, image->inner);
+    inner->chunk.code = pointerTo(image, image->size - 2);
+}
+
+static void linesMisaligned(Image* image) {
+    ObjFunction* inner = record(image, image->inner);
+    inner->chunk.lines = pointerTo(image, offsetOf(image, inner->chunk.lines) + 1);
+}
+
+static void withMachineCode(Image* image) {
+    ObjFunction* inner = record(image, image->inner);
+    inner->chunk.jit = (struct JitCode*)pointerTo(image, 16);
+}
+
+static void young(Image* image) {
+    ObjFunction* inner = record(image, image->inner);
+    inner->obj.isOld = false;
+}
+
+static void loopsPastTheEnd(Image* image) {
+    ObjFunction* outer = record(image, image->outer);
+    outer->chunk.loops = pointerTo(image, offsetOf(image, outer->chunk.loops) + image->size);
+}
+
+static void negativeLoopCount(Image* image) {
+    ObjFunction* outer = record(image, image->outer);
+    outer->chunk.loopCount = outer->chunk.loopCapacity = -1;
+}
+
+static void tooManyConstants(Image* image) {
+    ObjFunction* outer = record(image, image->outer);
+    outer->chunk.constants.count = outer->chunk.constants.capacity = 300;
+}
+
+static void constantsBeforeTheImage(Image* image) {
+    ObjFunction* outer = record(image, image->outer);
+    outer->chunk.constants.values = (Value*)(uintptr_t)(image->base - 64);
+}
+
+static void nameTooLong(Image* image) {
+    ObjFunction* outer = record(image, image->outer);
+    outer->nameLength = (int)image->size;
+}
+
+static void constantNotAFunction(Image* image) {
+    ObjFunction* outer = record(image, image->outer);
+    firstConstant(image, outer)->as.obj = pointerTo(image, offsetOf(image, outer->chunk.code));
+}
+
+static void constantOfNoType(Image* image) {
+    ObjFunction* outer = record(image, image->outer);
+    firstConstant(image, outer)->type = (ValueType)42;
+}
+
+static void itsOwnConstant(Image* image) {
+    ObjFunction* outer = record(image, image->outer);
+    firstConstant(image, outer)->as.obj = pointerTo(image, image->outer);
+}
+
+
+static const struct {
+    const char* name;
+    Corruption corrupt;
+    bool loads;
+} cases[] = {
+    {"a huge code count", hugeCount, false},
+    {"code running past the end", codeAtTheEnd, false},
+    {"misaligned lines", linesMisaligned, false},
+    {"machine code", withMachineCode, false},
+    {"a young function", young, false},
+    {"loops past the end", loopsPastTheEnd, false},
+    {"a negative loop count", negativeLoopCount, false},
+    {"too many constants", tooManyConstants, false},
+    {"constants before the image", constantsBeforeTheImage, false},
+    {"a name too long", nameTooLong, false},
+    {"a constant that is not a function", constantNotAFunction, false},
+    {"a constant of no type", constantOfNoType, false},
+    {"nothing", NULL, true},
+    {"a function among its own constants", itsOwnConstant, true},
+};
+
+
+// Loads 'path' in a fresh VM, with what it prints to stderr in 'error'
+static bool loadCaptured(const char* path, char* error, size_t size) {
+    FILE* file = tmpfile();
+    fflush(stderr);
+    int savedErr = dup(2);
+    dup2(fileno(file), 2);
+
+    initVM();
+    bool loaded = loadImage(path);
+    if (loaded) loaded = interpret("outer(4);") == INTERPRET_OK;
+    freeVM();
+    fflush(stderr);
+
+    dup2(savedErr, 2);
+    close(savedErr);
+    rewind(file);
+    size_t length = fread(error, 1, size - 1, file);
+    error[length] = '\0';
+    fclose(file);
+    return loaded;
+}
+
+
+int main() {
+    char path[] = "/tmp/mavix-image-XXXXXX";
+    int descriptor = mkstemp(path);
+    if (descriptor < 0) return 1;
+    close(descriptor);
+
+    initVM();
+    bool saved = interpret(preamble) == INTERPRET_OK && saveImage(path);
+    freeVM();
+
+    Image image = {NULL, 0, 0, 0, 0};
+    FILE* file = saved ? fopen(path, "rb") : NULL;
+    if (file != NULL) {
+        fseek(file, 0, SEEK_END);
+        image.size = (size_t)ftell(file);
+        rewind(file);
+        image.bytes = malloc(image.size);
+        if (fread(image.bytes, 1, image.size, file) != image.size) image.size = 0;
+        fclose(file);
+    }
+    image.outer = image.size > 0 ? findFunction(&image, "outer") : 0;
+    uint64_t base = image.base;
+    image.inner = image.size > 0 ? findFunction(&image, "inner") : 0;
+    if (image.outer == 0 || image.inner == 0 || image.base != base) {
+        printf("could not save the image, or find its functions\n");
+        remove(path);
+        return 1;
+    }
+
+    int failures = 0;
+    int count = (int)(sizeof(cases) / sizeof(cases[0]));
+    uint8_t* copy = malloc(image.size);
+    for (int i = 0; i < count; i++) {
+        memcpy(copy, image.bytes, image.size);
+        Image corrupted = image;
+        corrupted.bytes = copy;
+        if (cases[i].corrupt != NULL) cases[i].corrupt(&corrupted);
+
+        file = fopen(path, "wb");
+        if (file == NULL || fwrite(copy, 1, image.size, file) != image.size) failures++;
+        if (file != NULL) fclose(file);
+
+        char error[256];
+        bool loaded = loadCaptured(path, error, sizeof(error));
+        if (loaded != cases[i].loads ||
+            (!loaded && strstr(error, ": truncated or corrupt.") == NULL)) {
+            printf("%s: %s, should %s\n%s", cases[i].name, loaded ? "loads" : "refused",
+                   cases[i].loads ? "load" : "be refused as corrupt", error);
+            failures++;
+        }
+    }
+
+    printf("%d images with %zu bytes: %d failures\n", count, image.size, failures);
+    free(copy);
+    free(image.bytes);
+    remove(path);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,90 @@
+#!/bin/sh
+# Checks what --perf=<directory> wrote: the lines of /tmp/perf-<pid>.map, and
+# the framing of jit-<pid>.dump in the directory (the header, then records
+# whose sizes add up to the file, one code load per line of the map, the
+# last record closing the file). Moves the map into the directory, as
+# perf.map, for the test's own expectations.
+#
+# Usage: check_perf.sh <directory>
+
+directory=$1
+dump=$(ls "$directory"/jit-*.dump 2> /dev/null | head -n 1)
+if [ -z "$dump" ]; then
+    echo "no jitdump in $directory"
+    exit 1
+fi
+pid=${dump##*/jit-}
+pid=${pid%.dump}
+
+map=/tmp/perf-$pid.map
+if [ ! -s "$map" ]; then
+    echo "no $map"
+    exit 1
+fi
+mv "$map" "$directory/perf.map" || exit 1
+map=$directory/perf.map
+
+bad=$(grep -Ev '^[0-9a-f]+ [0-9a-f]+ [A-Za-z_][A-Za-z0-9_]*:[0-9]+-[0-9]+ \[jit\]$' "$map")
+if [ -n "$bad" ]; then
+    echo "malformed lines in the perf map:"
+    echo "$bad"
+    exit 1
+fi
+
+# The code sizes in the map, in decimal, in the order of the loads
+sizes=$(while read -r address size name; do printf '%d ' "0x$size"; done < "$map")
+
+od -An -v -tu1 "$dump" | awk -v pid="$pid" -v sizes="$sizes" '
+    function fail(message) {
+        print "jitdump: " message
+        failed = 1
+        exit 1
+    }
+    # Little-endian unsigned integer of "width" bytes at "offset"
+    function u(offset, width,    value, i) {
+        value = 0
+        for (i = width - 1; i >= 0; i--) value = value * 256 + bytes[offset + i]
+        return value
+    }
+    { for (i = 1; i <= NF; i++) bytes[count++] = $i }
+    END {
+        if (failed) exit 1
+        if (count < 40) fail("shorter than its header")
+        if (u(0, 4) != 1248416836) fail("bad magic")
+        if (u(4, 4) != 1) fail("version " u(4, 4))
+        if (u(8, 4) != 40) fail("header size " u(8, 4))
+        if (u(20, 4) != pid) fail("pid " u(20, 4) ", not " pid)
+
+        expected = split(sizes, codeSizes, " ")
+        loads = 0
+        closed = 0
+        for (offset = 40; offset < count; offset += size) {
+            if (closed) fail("a record after JIT_CODE_CLOSE")
+            id = u(offset, 4)
+            size = u(offset + 4, 4)
+            if (size < 16 || offset + size > count) fail("record at " offset ": size " size)
+
+            if (id == 0) {
+                # JIT_CODE_LOAD: 56 bytes, the name with its NUL, the code
+                codeSize = u(offset + 40, 8)
+                end = offset + 56
+                while (end < offset + size && bytes[end] != 0) end++
+                if (end + 1 + codeSize != offset + size) fail("load at " offset ": size " size)
+                if (u(offset + 24, 8) != u(offset + 32, 8)) fail("load at " offset ": vma")
+                if (u(offset + 48, 8) != loads) fail("load at " offset ": index")
+                loads++
+                if (codeSize != codeSizes[loads]) fail("load " loads ": code size " codeSize)
+            } else if (id == 2) {
+                # JIT_CODE_DEBUG_INFO: 32 bytes, then 16 per entry and "script"
+                entries = u(offset + 24, 8)
+                if (entries == 0 || size != 32 + entries * 23) fail("debug info at " offset)
+            } else if (id == 3) {
+                if (size != 16) fail("close at " offset ": size " size)
+                closed = 1
+            } else {
+                fail("record at " offset ": unknown id " id)
+            }
+        }
+        if (!closed) fail("not closed")
+        if (loads != expected) fail(loads " loads, " expected " lines in the map")
+    }'
@@ -0,0 +1,131 @@
+#!/bin/sh
+# Runs one test script and checks it against the expectations in its
+# comments. A directive may follow code on the same line.
+#
+#   // expect: <line>               the next line of stdout
+#   // expect runtime error: <text> stderr contains the text; exit status 70
+#   // expect error: <text>         stderr contains the text
+#   // expect exit: <status>        the exit status (otherwise 0, or 70 above)
+#   // expect in <file>: <text>     a file the run wrote to {work} contains
+#                                   the text
+#   // args: <options>              put before the script on the command line;
+#                                   {work} is a scratch directory
+#   // stdin                        feed the script to the REPL instead; the
+#                                   banner and the prompts are not compared
+#   // image: <preamble>            save an image of the preamble first, and
+#                                   run the script with it (--image)
+#   // compare: <options>           run it again with these options added:
+#                                   stdout and the exit status must not change
+#   // check: <command>             a shell command (with {work} replaced)
+#                                   that must succeed after the run, before
+#                                   the 'expect in' files are checked
+#
+# Without an error directive, stderr must stay empty. Paths in directives
+# are relative to the script's directory, where mavix runs.
+#
+# Usage: run_test.sh <mavix> <script>
+
+mavix=$1
+script=$2
+case $mavix in
+    /*) ;;
+    *) mavix=$(pwd)/$mavix ;;      # it runs in the script's directory
+esac
+directory=$(dirname "$script")
+name=$(basename "$script")
+
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+# The text after '// <directive>:' on every line that has one
+directive() {
+    sed -n "s|^.*// $1:[ ]\{0,1\}||p" "$script"
+}
+
+fail() {
+    echo "FAIL $script: $1"
+    exit 1
+}
+
+args=$(directive args | head -n 1 | sed "s|{work}|$work|g")
+compare=$(directive compare | head -n 1)
+preamble=$(directive image | head -n 1)
+
+if [ -n "$preamble" ]; then
+    (cd "$directory" && "$mavix" --save-image="$work/image" "$preamble") \
+        > /dev/null 2> "$work/image.err" || fail "could not save an image of $preamble"
+    args="$args --image=$work/image"
+fi
+
+# run <output> <options>: runs the script, leaving the exit status in $status
+run() {
+    if grep -q '// stdin' "$script"; then
+        (cd "$directory" && "$mavix" $2 < "$name") > "$work/raw" 2> "$work/$1.err"
+        status=$?
+        sed -e '1,2d' -e 's/^\(>>> \)*//' "$work/raw" | sed '/^$/d' > "$work/$1"
+    else
+        (cd "$directory" && "$mavix" $2 "$name") > "$work/$1" 2> "$work/$1.err"
+        status=$?
+    fi
+}
+
+run out "$args"
+
+directive expect > "$work/expected"
+if ! diff -u "$work/expected" "$work/out" > "$work/diff"; then
+    cat "$work/diff"
+    fail "unexpected output"
+fi
+
+expected=0
+if grep -q '// expect runtime error:' "$script"; then expected=70; fi
+exit=$(directive 'expect exit' | head -n 1)
+if [ -n "$exit" ]; then expected=$exit; fi
+if [ "$status" -ne "$expected" ]; then
+    cat "$work/out.err"
+    fail "exit status $status, expected $expected"
+fi
+
+{ directive 'expect runtime error'; directive 'expect error'; } > "$work/errors"
+if [ -s "$work/errors" ]; then
+    while IFS= read -r text; do
+        grep -qF -- "$text" "$work/out.err" || {
+            cat "$work/out.err"
+            fail "stderr lacks '$text'"
+        }
+    done < "$work/errors"
+elif [ -s "$work/out.err" ]; then
+    cat "$work/out.err"
+    fail "unexpected output on stderr"
+fi
+
+check=$(directive check | head -n 1 | sed "s|{work}|$work|g")
+if [ -n "$check" ]; then
+    (cd "$directory" && sh -c "$check") > "$work/check.out" 2>&1 || {
+        cat "$work/check.out"
+        fail "check failed: $check"
+    }
+fi
+
+sed -n 's|^.*// expect in \([^:]*\):[ ]\{0,1\}|\1 |p' "$script" |
+while read -r file text; do
+    [ -f "$work/$file" ] || fail "no $file was written"
+    grep -qF -- "$text" "$work/$file" || {
+        cat "$work/$file"
+        fail "$file lacks '$text'"
+    }
+done || exit 1
+
+if [ -n "$compare" ]; then
+    first=$status
+    run again "$args $compare"
+    if ! diff -u "$work/out" "$work/again" > "$work/diff"; then
+        cat "$work/diff"
+        fail "output differs with $compare"
+    fi
+    if [ "$status" -ne "$first" ]; then
+        fail "exit status $status with $compare, $first without"
+    fi
+fi
+
+exit 0
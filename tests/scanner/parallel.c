@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "scanner.h"
+
+/* @note
+ * Generates a source over PARALLEL_SCAN_THRESHOLD that is mostly block
+ * comments, so that most pieces tokenizeParallel() splits it into start
+ * inside one. The comments hold text that scans as code (and as errors), a
+ * comment opener or two, and '//', even before the '*' '/' that ends them.
+ * Then, for several thread counts:
+ *
+ * - the parallel token stream must be the serial one, token for token, with
+ *   the same lines and error messages;
+ * - the script compiled from it must be the same code with the same line
+ *   table, and running it must print the same and fail with the same
+ *   runtime error, on a line near the end.
+ *
+ * The thread counts are explicit, so the pieces are scanned on threads of
+ * their own even on a single CPU. Run by ctest as scanner/parallel.
+ * */
+
+#define SOURCE_SIZE (PARALLEL_SCAN_THRESHOLD + PARALLEL_SCAN_THRESHOLD / 8)
+
+static const int threadCounts[] = {2, 3, 4, 5, 8, 16, MAX_SCAN_THREADS};
+
+typedef struct {
+    char* bytes;
+    size_t length;
+    size_t capacity;
+    int lines;              // newlines so far
+
+    size_t* comments;       // start and end of every block comment, in pairs
+    int commentCount;
+    int commentCapacity;
+} Source;
+
+
+static void append(Source* source, const char* text) {
+    size_t length = strlen(text);
+    if (source->length + length > source->capacity) {
+        source->capacity = (source->length + length) * 2;
+        source->bytes = realloc(source->bytes, source->capacity);
+    }
+    memcpy(source->bytes + source->length, text, length);
+    source->length += length;
+    for (const char* c = text; *c != '\0'; c++) {
+        if (*c == '\n') source->lines++;
+    }
+}
+
+static void addComment(Source* source, size_t start) {
+    if (source->commentCount + 2 > source->commentCapacity) {
+        source->commentCapacity = source->commentCapacity < 64 ? 64 : source->commentCapacity * 2;
+        source->comments = realloc(source->comments,
+                                   sizeof(size_t) * (size_t)source->commentCapacity);
+    }
+    source->comments[source->commentCount++] = start;
+    source->comments[source->commentCount++] = source->length;
+}
+
+
+// Comment lines that a piece starting among them scans as code
+static const char* commentLines[] = {
+    "  var if ( ) { } 123.5 x = x + y ; print while\n",
+    "  @ # $ unexpected characters, as error tokens\n",
+    "  /* not a nested comment, and // not a line comment\n",
+    "  * / almost the end, but not quite\n",
+    "  and or ! != == <= >= fun return 0.25\n",
+};
+
+
+// Returns the line of the runtime error at the end
+static int generate(Source* source) {
+    append(source, "var x = 0;\nvar y = 1;\n");
+    int block = 0;
+    while (source->length < SOURCE_SIZE) {
+        append(source, "x = x + y;\n");
+        if (block % 97 == 0) append(source, "// a line comment /* that opens nothing\n");
+
+        size_t start = source->length;
+        append(source, block % 5 == 0 ? "/* a comment" : "/*\n");
+        int lines = 1 + (block * 7) % 60;
+        for (int i = 0; i < lines; i++) {
+            // Half of the comments open no comment of their own (which would
+            // end at the same place, hiding a '//' before it)
+            int kind = (block + i) % 5;
+            if (kind == 2 && block % 2 == 1) kind = 3;
+            append(source, commentLines[kind]);
+        }
+        // A piece started inside the comment takes the last one for a line
+        // comment, scans past the real end and has to be rescanned
+        static const char* ends[] = {"*/\n", "  */ x = x + y;\n", "  // */ x = x + y;\n"};
+        append(source, ends[block % 3]);
+        addComment(source, start);
+        block++;
+    }
+
+    append(source, "print x;\n");
+    int errorLine = source->lines + 1;
+    append(source, "print x + nil;\n");
+    append(source, "print x;\n");
+    return errorLine;
+}
+
+
+// Whether a piece starting at 'offset' starts inside a block comment
+static bool insideComment(const Source* source, size_t offset) {
+    for (int i = 0; i < source->commentCount; i += 2) {
+        if (source->comments[i] < offset && offset < source->comments[i + 1]) return true;
+    }
+    return false;
+}
+
+// Pieces that start inside a comment, splitting like tokenizeParallel()
+static int misspeculations(const Source* source, int threadCount) {
+    int count = 0;
+    for (int piece = 1; piece < threadCount; piece++) {
+        size_t target = source->length / threadCount * piece;
+        const char* newline = memchr(source->bytes + target, '\n', source->length - target);
+        if (newline == NULL) break;
+        if (insideComment(source, (size_t)(newline - source->bytes) + 1)) count++;
+    }
+    return count;
+}
+
+
+static int compareStreams(const TokenStream* serial, const TokenStream* parallel,
+                          int threadCount) {
+    if (serial->count != parallel->count) {
+        printf("%d threads: %d tokens, %d serially\n", threadCount, parallel->count, serial->count);
+        return 1;
+    }
+    for (int i = 0; i < serial->count; i++) {
+        bool same = serial->types[i] == parallel->types[i] &&
+                    serial->offsets[i] == parallel->offsets[i] &&
+                    serial->lines[i] == parallel->lines[i];
+        if (same && serial->types[i] == TOKEN_ERROR) {
+            same = strcmp(serial->messages[serial->lengths[i]],
+                          parallel->messages[parallel->lengths[i]]) == 0;
+        } else if (same) {
+            same = serial->lengths[i] == parallel->lengths[i];
+        }
+        if (!same) {
+            printf("%d threads: token %d differs (line %d, serially line %d)\n",
+                   threadCount, i, parallel->lines[i], serial->lines[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// Runs the chunk with its output and errors in 'captured' (a NUL-terminated copy)
+static InterpretResult runCaptured(Chunk* chunk, char** captured) {
+    FILE* file = tmpfile();
+    fflush(stdout);
+    fflush(stderr);
+    int savedOut = dup(1);
+    int savedErr = dup(2);
+    dup2(fileno(file), 1);
+    dup2(fileno(file), 2);
+
+    Value result;
+    InterpretResult status = evaluate(chunk, &result);
+    flushOutput(vm.output);
+    fflush(stdout);
+    fflush(stderr);
+
+    dup2(savedOut, 1);
+    dup2(savedErr, 2);
+    close(savedOut);
+    close(savedErr);
+
+    long size = ftell(file);
+    *captured = calloc((size_t)size + 1, 1);
+    rewind(file);
+    if (fread(*captured, 1, (size_t)size, file) != (size_t)size) (*captured)[0] = '\0';
+    fclose(file);
+    return status;
+}
+
+
+static int compareRuns(const TokenStream* serial, const TokenStream* parallel,
+                       int threadCount, int errorLine) {
+    Chunk serialChunk;
+    Chunk parallelChunk;
+    initChunk(&serialChunk);
+    initChunk(&parallelChunk);
+    int failures = 0;
+
+    if (!compileTokens(serial, &serialChunk) || !compileTokens(parallel, &parallelChunk)) {
+        printf("%d threads: does not compile\n", threadCount);
+        failures++;
+    } else if (serialChunk.count != parallelChunk.count ||
+               memcmp(serialChunk.code, parallelChunk.code, (size_t)serialChunk.count) != 0 ||
+               memcmp(serialChunk.lines, parallelChunk.lines,
+                      sizeof(int) * (size_t)serialChunk.count) != 0) {
+        printf("%d threads: the code or its lines differ\n", threadCount);
+        failures++;
+    } else {
+        char* serialOutput;
+        char* parallelOutput;
+        InterpretResult serialStatus = runCaptured(&serialChunk, &serialOutput);
+        InterpretResult parallelStatus = runCaptured(&parallelChunk, &parallelOutput);
+
+        char expected[64];
+        snprintf(expected, sizeof(expected), "[line %d] in script", errorLine);
+        if (serialStatus != INTERPRET_RUNTIME_ERROR || parallelStatus != serialStatus ||
+            strcmp(serialOutput, parallelOutput) != 0 ||
+            strstr(parallelOutput, expected) == NULL) {
+            printf("%d threads: the runs differ or miss '%s'\n"
+                   "-- serially:\n%s-- in parallel:\n%s", threadCount, expected,
+                   serialOutput, parallelOutput);
+            failures++;
+        }
+        free(serialOutput);
+        free(parallelOutput);
+    }
+
+    freeChunk(&serialChunk);
+    freeChunk(&parallelChunk);
+    return failures;
+}
+
+
+int main() {
+    Source source = {NULL, 0, 0, 0, NULL, 0, 0};
+    int errorLine = generate(&source);
+
+    initVM();
+    TokenStream serial;
+    initTokenStream(&serial);
+    tokenize(source.bytes, source.length, &serial);
+
+    int failures = 0;
+    int inside = 0;
+    int count = (int)(sizeof(threadCounts) / sizeof(threadCounts[0]));
+    for (int i = 0; i < count; i++) {
+        TokenStream parallel;
+        initTokenStream(&parallel);
+        tokenizeParallel(source.bytes, source.length, threadCounts[i], &parallel);
+
+        failures += compareStreams(&serial, &parallel, threadCounts[i]);
+        if (failures == 0) failures += compareRuns(&serial, &parallel, threadCounts[i], errorLine);
+        inside += misspeculations(&source, threadCounts[i]);
+        freeTokenStream(&parallel);
+    }
+
+    // Otherwise the test would not test the stitching
+    if (inside == 0) {
+        printf("no piece starts inside a comment\n");
+        failures++;
+    }
+
+    printf("%zu bytes, %d lines, %d tokens, %d pieces starting in a comment: %d failures\n",
+           source.length, source.lines, serial.count, inside, failures);
+    freeTokenStream(&serial);
+    freeVM();
+    free(source.bytes);
+    free(source.comments);
+    return failures == 0 ? 0 : 1;
+}